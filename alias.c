@@ -0,0 +1,65 @@
+#include "util.h"
+#include "alias.h"
+
+/*
+ * Vose's method: slots whose weight is under the mean give the rest of
+ * their probability to a slot above it, until every slot holds exactly
+ * the mean.
+ */
+bool alias_build(double *weight, uint32_t n, uint32_t *prob, uint32_t *alias)
+{
+	uint32_t i = 0, s = 0, l = 0;
+	uint32_t nb_small = 0, nb_large = 0;
+	uint32_t *small = NULL, *large = NULL;
+	double *p = weight, sum = 0;
+
+	if (n == 0)
+		return false;
+
+	small = malloc(sizeof(uint32_t) * n);
+	large = malloc(sizeof(uint32_t) * n);
+	if (small == NULL || large == NULL) {
+		LOG_ERROR("Failed to allocate alias table of %u entries", n);
+		free(small);
+		free(large);
+		return false;
+	}
+
+	for (i = 0; i < n; i++)
+		sum += p[i];
+	for (i = 0; i < n; i++) {
+		p[i] = p[i] * n / sum;
+		if (p[i] < 1) {
+			small[nb_small++] = i;
+		} else {
+			large[nb_large++] = i;
+		}
+	}
+
+	while (nb_small > 0 && nb_large > 0) {
+		s = small[--nb_small];
+		l = large[nb_large - 1];
+		prob[s] = (uint32_t)(p[s] * 4294967296.0);
+		alias[s] = l;
+		p[l] -= 1 - p[s];
+		if (p[l] < 1) {
+			nb_large--;
+			small[nb_small++] = l;
+		}
+	}
+	/* what is left is 1 up to rounding */
+	while (nb_large > 0) {
+		l = large[--nb_large];
+		prob[l] = UINT32_MAX;
+		alias[l] = l;
+	}
+	while (nb_small > 0) {
+		s = small[--nb_small];
+		prob[s] = UINT32_MAX;
+		alias[s] = s;
+	}
+
+	free(small);
+	free(large);
+	return true;
+}
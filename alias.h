@@ -0,0 +1,26 @@
+#ifndef _PKTGEN_ALIAS_H_
+#define _PKTGEN_ALIAS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Walker/Vose alias table for drawing among n weighted choices in O(1):
+ * slot i keeps i with probability prob[i] / 2^32 and gives alias[i]
+ * otherwise.
+ */
+
+/* Fill prob and alias from the n weights, which are overwritten */
+bool alias_build(double *weight, uint32_t n, uint32_t *prob, uint32_t *alias);
+
+/* r is 64 random bits: the high half picks the slot, the low half the
+ * coin */
+static inline uint32_t alias_draw(const uint32_t *prob, const uint32_t *alias,
+				uint32_t n, uint64_t r)
+{
+	uint32_t idx = ((r >> 32) * n) >> 32;
+
+	return ((uint32_t)r < prob[idx]) ? idx : alias[idx];
+}
+
+#endif /* _PKTGEN_ALIAS_H_ */
@@ -0,0 +1,101 @@
+#include "util.h"
+#include "cksum.h"
+
+#include <rte_byteorder.h>
+#if defined(RTE_ARCH_X86)
+#include <rte_vect.h>
+#endif
+
+#if defined(RTE_ARCH_X86)
+/*
+ * 16 bytes per step: the eight 16-bit words are widened into 32-bit lanes
+ * and added there, so carries are only folded at the end. A lane takes
+ * two words per step, which cannot overflow below 2^15 steps (512KB).
+ */
+static inline uint32_t __add_vec(const uint8_t **buf, uint32_t *len)
+{
+	const xmm_t zero = _mm_setzero_si128();
+	xmm_t acc = _mm_setzero_si128(), v;
+	uint32_t lanes[4];
+	uint64_t sum = 0;
+
+	while (*len >= 16) {
+		v = _mm_loadu_si128((const xmm_t *)*buf);
+		acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+		acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+		*buf += 16;
+		*len -= 16;
+	}
+
+	_mm_storeu_si128((xmm_t *)lanes, acc);
+	sum = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	return (uint32_t)((sum & 0xffffffff) + (sum >> 32));
+}
+#endif
+
+uint32_t cksum_add(const void *data, uint32_t len, uint32_t sum)
+{
+	const uint8_t *buf = data;
+	uint64_t acc = sum;
+	uint32_t word = 0;
+	uint16_t half = 0;
+
+#if defined(RTE_ARCH_X86)
+	acc += __add_vec(&buf, &len);
+#endif
+
+	for (; len >= 4; buf += 4, len -= 4) {
+		memcpy(&word, buf, 4);
+		acc += (word & 0xffff) + (word >> 16);
+	}
+	if (len >= 2) {
+		memcpy(&half, buf, 2);
+		acc += half;
+		buf += 2;
+		len -= 2;
+	}
+	if (len > 0) {
+		/* the odd byte is padded with a zero byte after it */
+		half = 0;
+		memcpy(&half, buf, 1);
+		acc += half;
+	}
+
+	acc = (acc & 0xffffffff) + (acc >> 32);
+	acc = (acc & 0xffffffff) + (acc >> 32);
+	return (uint32_t)acc;
+}
+
+uint16_t cksum_ipv4_hdr(const struct ipv4_hdr *ip)
+{
+	struct ipv4_hdr hdr = *ip;
+
+	hdr.hdr_checksum = 0;
+	return ~cksum_fold(cksum_add(&hdr, sizeof(struct ipv4_hdr), 0));
+}
+
+uint32_t cksum_ipv4_phdr(const struct ipv4_hdr *ip, uint16_t l4_len)
+{
+	struct {
+		uint32_t src_addr;
+		uint32_t dst_addr;
+		uint8_t zero;
+		uint8_t proto;
+		uint16_t len;
+	} __attribute__((__packed__)) psh = {
+		.src_addr = ip->src_addr,
+		.dst_addr = ip->dst_addr,
+		.zero = 0,
+		.proto = ip->next_proto_id,
+		.len = rte_cpu_to_be_16(l4_len),
+	};
+
+	return cksum_add(&psh, sizeof(psh), 0);
+}
+
+uint16_t cksum_ipv4_l4(const struct ipv4_hdr *ip, const void *l4,
+				uint16_t len)
+{
+	return ~cksum_fold(cksum_add(l4, len, cksum_ipv4_phdr(ip, len)));
+}
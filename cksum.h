@@ -0,0 +1,52 @@
+#ifndef _PKTGEN_CKSUM_H_
+#define _PKTGEN_CKSUM_H_
+
+#include <stdint.h>
+#include <rte_ip.h>
+
+/*
+ * Internet checksum (RFC 1071). The ones' complement sum does not depend
+ * on byte order, so words are added as loaded and the result is stored
+ * back as is.
+ */
+
+/* Add len bytes of buf to the running 32-bit sum */
+uint32_t cksum_add(const void *buf, uint32_t len, uint32_t sum);
+
+static inline uint16_t cksum_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)sum;
+}
+
+/* Checksum of an IPv4 header, with its checksum field taken as 0 */
+uint16_t cksum_ipv4_hdr(const struct ipv4_hdr *ip);
+
+/* Sum of the IPv4 pseudo header of an l4_len byte TCP/UDP segment */
+uint32_t cksum_ipv4_phdr(const struct ipv4_hdr *ip, uint16_t l4_len);
+
+/* TCP/UDP checksum over the IPv4 pseudo header and len bytes of l4 */
+uint16_t cksum_ipv4_l4(const struct ipv4_hdr *ip, const void *l4,
+				uint16_t len);
+
+/* RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m') */
+static inline uint16_t cksum_update16(uint16_t cksum, uint16_t old_val,
+				uint16_t new_val)
+{
+	uint32_t sum = (uint16_t)~cksum + (uint16_t)~old_val + new_val;
+
+	return ~cksum_fold(sum);
+}
+
+static inline uint16_t cksum_update32(uint16_t cksum, uint32_t old_val,
+				uint32_t new_val)
+{
+	uint32_t sum = (uint16_t)~cksum
+			+ (uint16_t)~(old_val & 0xffff) + (uint16_t)~(old_val >> 16)
+			+ (new_val & 0xffff) + (new_val >> 16);
+
+	return ~cksum_fold(sum);
+}
+
+#endif /* _PKTGEN_CKSUM_H_ */
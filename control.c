@@ -2,16 +2,32 @@
 #include "control.h"
 
 #include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <rte_lcore.h>
+#include <rte_version.h>
 
 static bool force_quit = false;
 
-static unsigned int worker_state[WORKER_MAX] = {STATE_UNINIT};
+static unsigned int worker_state[WORKER_MAX][WORKER_INST_MAX] = {
+	[WORKER_STAT] = {STATE_UNINIT},
+	[WORKER_RX] = {STATE_UNINIT},
+	[WORKER_TX] = {STATE_UNINIT},
+};
+
+static unsigned int worker_nb_inst[WORKER_MAX] = {1, 1, 1};
 
 bool ctl_is_stop(void)
 {
 	return force_quit;
 }
 
+void ctl_stop(void)
+{
+	force_quit = true;
+}
+
 void ctl_signal_handler(int signo)
 {
 	if (signo == SIGINT || signo == SIGTERM) {
@@ -21,17 +37,105 @@ void ctl_signal_handler(int signo)
 	}
 }
 
+bool ctl_set_nb_inst(unsigned worker, unsigned nb_inst)
+{
+	unsigned int i = 0;
+
+	if (worker >= WORKER_MAX || nb_inst == 0
+			|| nb_inst > WORKER_INST_MAX)
+		return false;
+
+	worker_nb_inst[worker] = nb_inst;
+	for (i = 0; i < WORKER_INST_MAX; i++)
+		worker_state[worker][i] = STATE_UNINIT;
+	return true;
+}
+
+unsigned ctl_get_nb_inst(unsigned worker)
+{
+	if (worker >= WORKER_MAX)
+		return 0;
+	return worker_nb_inst[worker];
+}
+
+/*
+ * State of a worker role over all its instances: ERROR if any instance
+ * failed, UNINIT while any is still initializing, STOPPED once all have
+ * stopped, INITED otherwise.
+ */
 unsigned int ctl_get_state(unsigned worker)
 {
+	unsigned int i = 0, state = 0, nb_stopped = 0;
+	bool is_uninit = false;
+
 	if (worker >= WORKER_MAX)
 		return STATE_UNINIT;
 
-	return worker_state[worker];
+	for (i = 0; i < worker_nb_inst[worker]; i++) {
+		state = __atomic_load_n(&worker_state[worker][i], __ATOMIC_ACQUIRE);
+		if (state == STATE_ERROR)
+			return STATE_ERROR;
+		else if (state == STATE_UNINIT)
+			is_uninit = true;
+		else if (state == STATE_STOPPED)
+			nb_stopped++;
+	}
+
+	if (nb_stopped == worker_nb_inst[worker])
+		return STATE_STOPPED;
+	return is_uninit ? STATE_UNINIT : STATE_INITED;
+}
+
+void ctl_set_inst_state(unsigned worker, unsigned inst, unsigned state)
+{
+	if (worker >= WORKER_MAX || inst >= worker_nb_inst[worker])
+		return;
+	__atomic_store_n(&worker_state[worker][inst], state, __ATOMIC_RELEASE);
 }
 
 void ctl_set_state(unsigned worker, unsigned state)
 {
+	unsigned int i = 0;
+
 	if (worker >= WORKER_MAX)
 		return;
-	worker_state[worker] = state;
+
+	for (i = 0; i < worker_nb_inst[worker]; i++)
+		ctl_set_inst_state(worker, i, state);
+}
+
+/* CPUs an lcore runs on, not its id with --lcores remapping */
+static inline rte_cpuset_t __lcore_cpus(unsigned int lcore)
+{
+#if RTE_VERSION >= RTE_VERSION_NUM(18, 5, 0, 0)
+	return rte_lcore_cpuset(lcore);
+#else
+	return lcore_config[lcore].cpuset;
+#endif
+}
+
+void ctl_pin_off_lcores(void)
+{
+	cpu_set_t set, used, cpus;
+	long ncpu = 0, cpu = 0;
+	unsigned int cnt = 0, lcore = 0;
+
+	CPU_ZERO(&used);
+	RTE_LCORE_FOREACH(lcore) {
+		cpus = __lcore_cpus(lcore);
+		CPU_OR(&used, &used, &cpus);
+	}
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	CPU_ZERO(&set);
+	for (cpu = 0; cpu < ncpu && cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &used))
+			continue;
+		CPU_SET(cpu, &set);
+		cnt++;
+	}
+
+	/* every cpu is an lcore: keep the inherited affinity */
+	if (cnt > 0)
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
 }
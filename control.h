@@ -15,12 +15,28 @@ enum {
 	WORKER_MAX = 3
 };
 
+/* Max lcores sharing one worker role */
+#define WORKER_INST_MAX 64
+
 bool ctl_is_stop(void);
 
+/* Ask every worker to exit, like SIGINT does */
+void ctl_stop(void);
+
 void ctl_signal_handler(int signo);
 
+bool ctl_set_nb_inst(unsigned worker, unsigned nb_inst);
+
+unsigned ctl_get_nb_inst(unsigned worker);
+
 unsigned ctl_get_state(unsigned worker);
 
 void ctl_set_state(unsigned worker, unsigned state);
 
+void ctl_set_inst_state(unsigned worker, unsigned inst, unsigned state);
+
+/* Move the calling helper thread off the EAL lcores so it never steals
+ * time from a worker */
+void ctl_pin_off_lcores(void);
+
 #endif /* _PKTGEN_CONTROL_H_ */
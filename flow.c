@@ -0,0 +1,410 @@
+#include "util.h"
+#include "flow.h"
+
+#include <math.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <rte_malloc.h>
+
+#define FLOW_SPEC_MAX 512
+#define FLOW_LINE_MAX 256
+
+static const char *pick_name[FLOW_PICK_MAX] = {
+	[FLOW_PICK_RR] = "round robin",
+	[FLOW_PICK_UNIFORM] = "uniform",
+	[FLOW_PICK_ZIPF] = "zipf",
+};
+
+/* Ranges the flows are generated from, host order */
+struct flow_range {
+	uint32_t ip_lo[2], ip_hi[2];
+	uint32_t port_lo[2], port_hi[2];
+};
+
+const char *flow_pick_name(unsigned int pick)
+{
+	return (pick < FLOW_PICK_MAX) ? pick_name[pick] : "unknown";
+}
+
+static inline uint16_t __sum32(uint32_t a, uint32_t b)
+{
+	return cksum_fold((a & 0xffff) + (a >> 16) + (b & 0xffff) + (b >> 16));
+}
+
+static void __set_flow(struct flow_table *flows, uint32_t i,
+				uint32_t src_ip, uint32_t dst_ip,
+				uint16_t src_port, uint16_t dst_port)
+{
+	uint16_t ports[2] = {
+		rte_cpu_to_be_16(src_port),
+		rte_cpu_to_be_16(dst_port),
+	};
+
+	flows->src_ip[i] = rte_cpu_to_be_32(src_ip);
+	flows->dst_ip[i] = rte_cpu_to_be_32(dst_ip);
+	memcpy(&flows->ports[i], ports, sizeof(ports));
+	flows->addr_sum[i] = __sum32(flows->src_ip[i], flows->dst_ip[i]);
+	flows->port_sum[i] = cksum_fold((uint32_t)ports[0] + ports[1]);
+}
+
+/* Format: <lo>[-<hi>], addresses or ports */
+static bool __parse_range(char *str, bool is_ip, uint32_t *lo, uint32_t *hi)
+{
+	char *dash = strchr(str, '-');
+	int val = 0;
+
+	if (dash != NULL)
+		*dash = '\0';
+
+	if (is_ip) {
+		if (!str_to_ipv4(str, lo))
+			return false;
+		*hi = *lo;
+		if (dash != NULL && !str_to_ipv4(dash + 1, hi))
+			return false;
+	} else {
+		if (!str_to_int(str, 10, &val) || val < 0 || val > 0xffff)
+			return false;
+		*lo = *hi = val;
+		if (dash != NULL) {
+			if (!str_to_int(dash + 1, 10, &val) || val < 0 || val > 0xffff)
+				return false;
+			*hi = val;
+		}
+	}
+	return *lo <= *hi;
+}
+
+/* Format: rr, uniform or zipf[:<s>] */
+static bool __parse_pick(const char *str, struct flow_table *flows)
+{
+	char *end = NULL;
+
+	if (strcmp(str, "rr") == 0) {
+		flows->pick = FLOW_PICK_RR;
+	} else if (strcmp(str, "uniform") == 0) {
+		flows->pick = FLOW_PICK_UNIFORM;
+	} else if (strncmp(str, "zipf", 4) == 0
+			&& (str[4] == '\0' || str[4] == ':')) {
+		flows->pick = FLOW_PICK_ZIPF;
+		flows->zipf_s = FLOW_ZIPF_S_DEF;
+		if (str[4] == ':') {
+			flows->zipf_s = strtod(str + 5, &end);
+			if (end == str + 5 || *end != '\0' || flows->zipf_s <= 0)
+				return false;
+		}
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static bool __alloc_flows(struct flow_table *flows, uint32_t nb_flows)
+{
+	flows->nb_flows = nb_flows;
+	flows->src_ip = rte_malloc("pktgen: flow src",
+					sizeof(uint32_t) * nb_flows, 0);
+	flows->dst_ip = rte_malloc("pktgen: flow dst",
+					sizeof(uint32_t) * nb_flows, 0);
+	flows->ports = rte_malloc("pktgen: flow ports",
+					sizeof(uint32_t) * nb_flows, 0);
+	flows->addr_sum = rte_malloc("pktgen: flow addr sum",
+					sizeof(uint16_t) * nb_flows, 0);
+	flows->port_sum = rte_malloc("pktgen: flow port sum",
+					sizeof(uint16_t) * nb_flows, 0);
+	return flows->src_ip != NULL && flows->dst_ip != NULL
+			&& flows->ports != NULL && flows->addr_sum != NULL
+			&& flows->port_sum != NULL;
+}
+
+/* Mixed radix over the ranges, the source address varying fastest */
+static bool __gen_flows(struct flow_table *flows, const struct flow_range *r,
+				uint64_t nb_flows)
+{
+	uint64_t span[4], total = 1, i = 0, k = 0;
+	uint32_t val[4];
+	unsigned int f = 0;
+
+	span[0] = (uint64_t)r->ip_hi[0] - r->ip_lo[0] + 1;
+	span[1] = (uint64_t)r->ip_hi[1] - r->ip_lo[1] + 1;
+	span[2] = (uint64_t)r->port_hi[0] - r->port_lo[0] + 1;
+	span[3] = (uint64_t)r->port_hi[1] - r->port_lo[1] + 1;
+	for (f = 0; f < 4; f++) {
+		total *= span[f];
+		if (total > FLOW_MAX)
+			total = FLOW_MAX + 1ULL;
+	}
+
+	if (nb_flows == 0)
+		nb_flows = total;
+	if (nb_flows > total || nb_flows > FLOW_MAX) {
+		LOG_ERROR("%lu flows asked, the ranges give %lu, at most %u",
+						(unsigned long)nb_flows, (unsigned long)total,
+						FLOW_MAX);
+		return false;
+	}
+
+	if (!__alloc_flows(flows, nb_flows)) {
+		LOG_ERROR("Failed to allocate %lu flows", (unsigned long)nb_flows);
+		return false;
+	}
+
+	for (i = 0; i < nb_flows; i++) {
+		k = i;
+		for (f = 0; f < 4; f++) {
+			val[f] = k % span[f];
+			k /= span[f];
+		}
+		__set_flow(flows, i, r->ip_lo[0] + val[0], r->ip_lo[1] + val[1],
+						r->port_lo[0] + val[2], r->port_lo[1] + val[3]);
+	}
+	return true;
+}
+
+static bool __parse_flow_line(const char *line, uint32_t *src, uint32_t *dst,
+				unsigned int *sport, unsigned int *dport)
+{
+	char sbuf[INET_ADDRSTRLEN], dbuf[INET_ADDRSTRLEN];
+
+	if (sscanf(line, "%15s %15s %u %u", sbuf, dbuf, sport, dport) != 4)
+		return false;
+	return *sport <= 0xffff && *dport <= 0xffff
+			&& str_to_ipv4(sbuf, src) && str_to_ipv4(dbuf, dst);
+}
+
+static bool __load_flows(struct flow_table *flows, const char *filename)
+{
+	FILE *fp = NULL;
+	char line[FLOW_LINE_MAX];
+	uint32_t src = 0, dst = 0, cnt = 0;
+	unsigned int sport = 0, dport = 0;
+	unsigned long lineno = 0;
+	char *p = NULL;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		LOG_ERROR("Failed to open flow file %s", filename);
+		return false;
+	}
+
+	/* count first, the arrays are allocated once */
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		for (p = line; *p == ' ' || *p == '\t'; p++);
+		if (*p != '#' && *p != '\n' && *p != '\0')
+			cnt++;
+	}
+	if (cnt == 0 || cnt > FLOW_MAX) {
+		LOG_ERROR("Flow file %s holds %u flows, need 1 to %u",
+						filename, cnt, FLOW_MAX);
+		goto close_file;
+	}
+	if (!__alloc_flows(flows, cnt)) {
+		LOG_ERROR("Failed to allocate %u flows", cnt);
+		goto close_file;
+	}
+
+	rewind(fp);
+	cnt = 0;
+	while (fgets(line, sizeof(line), fp) != NULL
+			&& cnt < flows->nb_flows) {
+		lineno++;
+		for (p = line; *p == ' ' || *p == '\t'; p++);
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		if (!__parse_flow_line(p, &src, &dst, &sport, &dport)) {
+			LOG_ERROR("Wrong flow at %s:%lu", filename, lineno);
+			goto close_file;
+		}
+		__set_flow(flows, cnt++, src, dst, sport, dport);
+	}
+	if (cnt != flows->nb_flows) {
+		LOG_ERROR("Flow file %s changed while loading", filename);
+		goto close_file;
+	}
+
+	fclose(fp);
+	return true;
+
+close_file:
+	fclose(fp);
+	return false;
+}
+
+static bool __build_alias(struct flow_table *flows)
+{
+	uint32_t n = flows->nb_flows, i = 0;
+	double *p = NULL;
+	bool ret = false;
+
+	flows->alias_prob = rte_malloc("pktgen: flow alias prob",
+					sizeof(uint32_t) * n, 0);
+	flows->alias = rte_malloc("pktgen: flow alias",
+					sizeof(uint32_t) * n, 0);
+	p = malloc(sizeof(double) * n);
+	if (flows->alias_prob == NULL || flows->alias == NULL || p == NULL) {
+		LOG_ERROR("Failed to allocate the Zipf table of %u flows", n);
+		goto close_free;
+	}
+
+	for (i = 0; i < n; i++)
+		p[i] = pow(i + 1, -flows->zipf_s);
+	ret = alias_build(p, n, flows->alias_prob, flows->alias);
+
+close_free:
+	free(p);
+	return ret;
+}
+
+struct flow_table *flow_table_create(const char *spec)
+{
+	struct flow_table *flows = NULL;
+	struct flow_range range = {
+		.ip_lo = {PKT_SEQ_IP_SRC, PKT_SEQ_IP_DST},
+		.ip_hi = {PKT_SEQ_IP_SRC, PKT_SEQ_IP_DST},
+		.port_lo = {PKT_SEQ_PORT_SRC, PKT_SEQ_PORT_DST},
+		.port_hi = {PKT_SEQ_PORT_SRC, PKT_SEQ_PORT_DST},
+	};
+	char buf[FLOW_SPEC_MAX];
+	char *tok = NULL, *save = NULL, *val = NULL;
+	const char *file = NULL;
+	uint64_t nb_flows = 0;
+	int n = 0;
+	bool ok = true;
+
+	if (spec == NULL || strlen(spec) >= sizeof(buf)) {
+		LOG_ERROR("Wrong flow set");
+		return NULL;
+	}
+	snprintf(buf, sizeof(buf), "%s", spec);
+
+	flows = rte_zmalloc("pktgen: flow table", sizeof(struct flow_table), 0);
+	if (flows == NULL) {
+		LOG_ERROR("Failed to allocate flow table");
+		return NULL;
+	}
+	flows->pick = FLOW_PICK_RR;
+
+	for (tok = strtok_r(buf, ",", &save); tok != NULL && ok;
+					tok = strtok_r(NULL, ",", &save)) {
+		if (strncmp(tok, "file:", 5) == 0) {
+			file = spec + (tok + 5 - buf);
+			continue;
+		}
+
+		val = strchr(tok, '=');
+		if (val == NULL) {
+			ok = false;
+			break;
+		}
+		*val++ = '\0';
+
+		if (strcmp(tok, "n") == 0) {
+			ok = str_to_int(val, 10, &n) && n > 0;
+			nb_flows = n;
+		} else if (strcmp(tok, "src") == 0) {
+			ok = __parse_range(val, true, &range.ip_lo[0], &range.ip_hi[0]);
+		} else if (strcmp(tok, "dst") == 0) {
+			ok = __parse_range(val, true, &range.ip_lo[1], &range.ip_hi[1]);
+		} else if (strcmp(tok, "sport") == 0) {
+			ok = __parse_range(val, false, &range.port_lo[0],
+							&range.port_hi[0]);
+		} else if (strcmp(tok, "dport") == 0) {
+			ok = __parse_range(val, false, &range.port_lo[1],
+							&range.port_hi[1]);
+		} else if (strcmp(tok, "pick") == 0) {
+			ok = __parse_pick(val, flows);
+		} else {
+			ok = false;
+		}
+	}
+	if (!ok) {
+		LOG_ERROR("Wrong flow set %s", spec);
+		goto close_free;
+	}
+
+	if (file != NULL) {
+		/* the path ends at the next comma */
+		snprintf(buf, sizeof(buf), "%s", file);
+		buf[strcspn(buf, ",")] = '\0';
+		if (!__load_flows(flows, buf))
+			goto close_free;
+	} else if (!__gen_flows(flows, &range, nb_flows)) {
+		goto close_free;
+	}
+
+	if (flows->pick == FLOW_PICK_ZIPF && !__build_alias(flows))
+		goto close_free;
+
+	if (flows->pick == FLOW_PICK_ZIPF) {
+		LOG_INFO("%u flows, picked by zipf s=%.2lf", flows->nb_flows,
+						flows->zipf_s);
+	} else {
+		LOG_INFO("%u flows, picked by %s", flows->nb_flows,
+						flow_pick_name(flows->pick));
+	}
+	return flows;
+
+close_free:
+	flow_table_free(flows);
+	return NULL;
+}
+
+void flow_table_free(struct flow_table *flows)
+{
+	if (flows == NULL)
+		return;
+
+	rte_free(flows->src_ip);
+	rte_free(flows->dst_ip);
+	rte_free(flows->ports);
+	rte_free(flows->addr_sum);
+	rte_free(flows->port_sum);
+	rte_free(flows->alias_prob);
+	rte_free(flows->alias);
+	rte_free(flows);
+}
+
+bool flow_base_init(struct flow_base *base, const struct pkt_tmpl *tmpl)
+{
+	uint8_t frame[PKT_TMPL_MAX];
+	struct ipv4_hdr *ip = (struct ipv4_hdr *)(frame + sizeof(struct ether_hdr));
+	uint8_t *l4 = (uint8_t *)(ip + 1);
+	uint16_t l4_len = 0;
+
+	memcpy(frame, tmpl->data, tmpl->len);
+	l4_len = tmpl->len - ETH_CRC_LEN - sizeof(struct ether_hdr)
+			- sizeof(struct ipv4_hdr);
+	base->is_tcp = (ip->next_proto_id == IPPROTO_TCP);
+	if (!base->is_tcp && ip->next_proto_id != IPPROTO_UDP) {
+		LOG_ERROR("Flows need a TCP or UDP packet");
+		return false;
+	}
+
+	/* what flow_apply adds back per flow */
+	ip->src_addr = 0;
+	ip->dst_addr = 0;
+	memset(l4, 0, sizeof(uint32_t));
+
+	ip->hdr_checksum = 0;
+	base->ip_sum = cksum_fold(cksum_add(ip, sizeof(struct ipv4_hdr), 0));
+
+	if (base->is_tcp) {
+		((struct tcp_hdr *)l4)->cksum = 0;
+		base->l4_cksum = true;
+	} else {
+		base->l4_cksum = (((struct udp_hdr *)l4)->dgram_cksum != 0);
+		((struct udp_hdr *)l4)->dgram_cksum = 0;
+	}
+	base->l4_sum = cksum_fold(cksum_add(l4, l4_len,
+					cksum_ipv4_phdr(ip, l4_len)));
+	return true;
+}
+
+void flow_cursor_init(struct flow_cursor *cur, const struct flow_table *flows,
+				unsigned int inst, unsigned int nb_inst)
+{
+	cur->next = inst % flows->nb_flows;
+	cur->step = nb_inst % flows->nb_flows;
+}
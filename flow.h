@@ -0,0 +1,128 @@
+#ifndef _PKTGEN_FLOW_H_
+#define _PKTGEN_FLOW_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pkt_seq.h"
+#include "rate.h"
+#include "cksum.h"
+#include "alias.h"
+
+/*
+ * A set of flows built once before TX starts. Each field lives in its own
+ * array, already in network order, together with the folded sums of the
+ * addresses and of the ports, so that turning a template copy into a
+ * packet of flow i is a few stores and two additions per checksum.
+ */
+#define FLOW_MAX (1U << 24)
+
+/* How TX lcores pick the flow of each packet */
+enum {
+	FLOW_PICK_RR = 0,	/* one after the other */
+	FLOW_PICK_UNIFORM,
+	FLOW_PICK_ZIPF,		/* flow i has weight 1 / (i + 1)^s */
+	FLOW_PICK_MAX
+};
+
+#define FLOW_ZIPF_S_DEF 1.0
+
+struct flow_table {
+	uint32_t nb_flows;
+	unsigned int pick;	/* FLOW_PICK_* */
+	double zipf_s;
+
+	uint32_t *src_ip;
+	uint32_t *dst_ip;
+	uint32_t *ports;	/* source then destination port, as in the header */
+	uint16_t *addr_sum;	/* folded ones' complement sum of both addresses */
+	uint16_t *port_sum;	/* same for both ports */
+
+	/* Zipf: alias table of the flow weights */
+	uint32_t *alias_prob;
+	uint32_t *alias;
+};
+
+/* Checksums of a template frame with the flow fields set to zero */
+struct flow_base {
+	uint16_t ip_sum;
+	uint16_t l4_sum;
+	bool is_tcp;
+	bool l4_cksum;		/* false for a disabled (zero) UDP checksum */
+};
+
+/* Per TX lcore position in the table */
+struct flow_cursor {
+	uint32_t next;
+	uint32_t step;
+};
+
+/*
+ * Format: comma separated key=value pairs, any of
+ *   n=<number of flows, default all combinations of the ranges>
+ *   src=<ip>[-<ip>], dst=<ip>[-<ip>], sport=<port>[-<port>],
+ *   dport=<port>[-<port>] (default the single packet's fields)
+ *   pick=rr|uniform|zipf[:<s>]
+ * or file:<path>[,pick=...] with one "<src ip> <dst ip> <src port>
+ * <dst port>" flow per line. The source address varies fastest.
+ */
+struct flow_table *flow_table_create(const char *spec);
+
+void flow_table_free(struct flow_table *flows);
+
+const char *flow_pick_name(unsigned int pick);
+
+/* Split the checksums of tmpl, an IPv4 TCP/UDP frame, into the part
+ * the flow fields do not change */
+bool flow_base_init(struct flow_base *base, const struct pkt_tmpl *tmpl);
+
+/* Start TX lcore inst of nb_inst, round robin lcores interleave */
+void flow_cursor_init(struct flow_cursor *cur, const struct flow_table *flows,
+				unsigned int inst, unsigned int nb_inst);
+
+static inline uint32_t flow_next(const struct flow_table *flows,
+				struct flow_cursor *cur, struct rate_ctl *rng)
+{
+	uint32_t idx = 0;
+
+	if (flows->pick == FLOW_PICK_RR) {
+		idx = cur->next;
+		cur->next += cur->step;
+		if (cur->next >= flows->nb_flows)
+			cur->next -= flows->nb_flows;
+		return idx;
+	}
+
+	if (flows->pick == FLOW_PICK_UNIFORM)
+		return ((rate_rand(rng) >> 32) * flows->nb_flows) >> 32;
+	return alias_draw(flows->alias_prob, flows->alias, flows->nb_flows,
+					rate_rand(rng));
+}
+
+/* Write flow idx into pkt, a copy of the template base was taken from.
+ * The FCS is left to the caller. */
+static inline void flow_apply(const struct flow_table *flows, uint32_t idx,
+				const struct flow_base *base, struct rte_mbuf *pkt)
+{
+	uint8_t *data = rte_pktmbuf_mtod(pkt, uint8_t *);
+	struct ipv4_hdr *ip = (struct ipv4_hdr *)(data + sizeof(struct ether_hdr));
+	uint8_t *l4 = (uint8_t *)(ip + 1);
+	uint32_t sum = flows->addr_sum[idx];
+	uint16_t cksum = 0;
+
+	ip->src_addr = flows->src_ip[idx];
+	ip->dst_addr = flows->dst_ip[idx];
+	*(uint32_t *)l4 = flows->ports[idx];
+	ip->hdr_checksum = ~cksum_fold(base->ip_sum + sum);
+
+	if (base->l4_cksum) {
+		cksum = ~cksum_fold(base->l4_sum + sum + flows->port_sum[idx]);
+		if (base->is_tcp) {
+			((struct tcp_hdr *)l4)->cksum = cksum;
+		} else {
+			((struct udp_hdr *)l4)->dgram_cksum = (cksum == 0) ? 0xffff : cksum;
+		}
+	}
+}
+
+#endif /* _PKTGEN_FLOW_H_ */
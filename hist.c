@@ -0,0 +1,72 @@
+#include "util.h"
+#include "hist.h"
+
+/* Largest value falling into bucket idx */
+static uint64_t __bucket_hi(unsigned int idx)
+{
+	unsigned int group = idx >> HIST_SUB_BITS;
+	uint64_t sub = idx & (HIST_SUB_CNT - 1);
+
+	if (group == 0)
+		return sub;
+
+	return ((HIST_SUB_CNT + sub + 1) << (group - 1)) - 1;
+}
+
+void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(struct hist));
+}
+
+void hist_add(struct hist *dst, const struct hist *src)
+{
+	unsigned int i = 0;
+	uint64_t max = 0;
+
+	/* total first: buckets are then at least as large as it says */
+	dst->total += __atomic_load_n(&src->total, __ATOMIC_ACQUIRE);
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->cnt[i] += __atomic_load_n(&src->cnt[i], __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	if (max > dst->max)
+		dst->max = max;
+}
+
+void hist_sub(struct hist *dst, const struct hist *a, const struct hist *b)
+{
+	unsigned int i = 0;
+
+	dst->total = a->total - b->total;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->cnt[i] = a->cnt[i] - b->cnt[i];
+	dst->max = a->max;
+}
+
+uint64_t hist_percentile(const struct hist *h, double pct)
+{
+	uint64_t target = 0, sum = 0, total = 0;
+	unsigned int i = 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		total += h->cnt[i];
+
+	if (total == 0)
+		return 0;
+
+	target = (uint64_t)(total * pct / 100.0 + 0.5);
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += h->cnt[i];
+		if (sum < target)
+			continue;
+
+		/* never report more than what was actually recorded */
+		if (h->max != 0 && h->max < __bucket_hi(i))
+			return h->max;
+		return __bucket_hi(i);
+	}
+	return h->max;
+}
@@ -0,0 +1,76 @@
+#ifndef _PKTGEN_HIST_H_
+#define _PKTGEN_HIST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Log-linear (HDR style) histogram in fixed memory. Values below
+ * 2^HIST_SUB_BITS are exact, larger ones fall into buckets of relative
+ * width 2^-HIST_SUB_BITS (about 3%). Values from 2^HIST_MAX_BIT on are
+ * clamped into the last bucket.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_CNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_BIT 48
+#define HIST_GROUPS (HIST_MAX_BIT - HIST_SUB_BITS + 1)
+#define HIST_BUCKETS (HIST_GROUPS * HIST_SUB_CNT)
+
+/* Written by a single thread, read by others through hist_add */
+struct hist {
+	uint64_t total;
+	uint64_t max;
+	uint64_t cnt[HIST_BUCKETS];
+};
+
+static inline unsigned int hist_index(uint64_t val)
+{
+	unsigned int msb = 0;
+
+	if (val < HIST_SUB_CNT)
+		return val;
+
+	if (val >= (1ULL << HIST_MAX_BIT))
+		return HIST_BUCKETS - 1;
+
+	msb = 63 - __builtin_clzll(val);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+			+ (unsigned int)((val >> (msb - HIST_SUB_BITS)) - HIST_SUB_CNT);
+}
+
+static inline void hist_record(struct hist *h, uint64_t val)
+{
+	unsigned int idx = hist_index(val);
+
+	__atomic_store_n(&h->cnt[idx], h->cnt[idx] + 1, __ATOMIC_RELAXED);
+	if (val > h->max)
+		__atomic_store_n(&h->max, val, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELEASE);
+}
+
+/* Record val n times, n may be 0 */
+static inline void hist_record_n(struct hist *h, uint64_t val, uint64_t n)
+{
+	unsigned int idx = hist_index(val);
+
+	if (n == 0)
+		return;
+
+	__atomic_store_n(&h->cnt[idx], h->cnt[idx] + n, __ATOMIC_RELAXED);
+	if (val > h->max)
+		__atomic_store_n(&h->max, val, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->total, h->total + n, __ATOMIC_RELEASE);
+}
+
+void hist_reset(struct hist *h);
+
+/* dst += src, src may be updated concurrently by its writer */
+void hist_add(struct hist *dst, const struct hist *src);
+
+/* dst = a - b, where b is an earlier snapshot of a (max is a's) */
+void hist_sub(struct hist *dst, const struct hist *a, const struct hist *b);
+
+/* Upper bound of the bucket holding the pct-th percentile (0-100) */
+uint64_t hist_percentile(const struct hist *h, double pct);
+
+#endif /* _PKTGEN_HIST_H_ */
@@ -15,17 +15,40 @@
 #include "control.h"
 #include "pkt_seq.h"
 #include "measure.h"
+#include "trace.h"
+#include "rate.h"
+#include "schedule.h"
+#include "rfc2544.h"
+#include "tsc.h"
 
 #define CLIENT_RXQ_NAME "dpdkr%u_tx"
 #define CLIENT_TXQ_NAME "dpdkr%u_rx"
 #define CLIENT_MP_NAME_PREFIX	"ovs_mp_2030_0"
 #define CLIENT_MP_PREFIX_LEN 13
 
-static int sender_id = -1;
-static int receiver_id = -1;
+/* Each client id given with -p is a sender, id + 1 its receiver */
+#define CLIENT_PAIR_MAX 16
+
+static int sender_id[CLIENT_PAIR_MAX];
+static int receiver_id[CLIENT_PAIR_MAX];
+static int sender_port[CLIENT_PAIR_MAX];
+static int receiver_port[CLIENT_PAIR_MAX];
+static unsigned nb_pairs = 0;
+
+/* -1: hybrid if the probe thread has its own lcore, sleep otherwise */
+static int probe_wait = -1;
+static struct rate_dist probe_dist = {
+	.type = RATE_DIST_CONST,
+};
+
+/* 0: split the worker lcores between RX and TX */
+static unsigned nb_tx_lcore = 0;
+static unsigned nb_rx_lcore = 0;
 
 static unsigned dev_type = 0;
 static unsigned tx_type = TX_TYPE_SINGLE;
+static const char *tx_file = NULL;
+static const char *convert_file = NULL;
 
 //static int portid = -1;
 
@@ -36,10 +59,9 @@ struct lcore_param {
 	bool is_rx;
 	bool is_tx;
 	bool is_stat;
+	struct rxtx_param rxtx;
 };
 
-#define LCORE_MAX 3
-
 static struct lcore_param lcore_param[RTE_MAX_LCORE] = {
 	{
 		.is_rx = false,
@@ -64,34 +86,92 @@ static const char *__get_txq_name(unsigned int id)
 	return buffer;
 }
 
+/* Format: a client id, or a comma separated list of them */
 static int __parse_client_num(const char *client)
 {
-	if (str_to_int(client, 10, &sender_id)) {
-		receiver_id = sender_id + 1;
-		return 0;
+	char buf[128];
+	char *tok = NULL, *save = NULL;
+	int id = 0;
+
+	snprintf(buf, sizeof(buf), "%s", client);
+	nb_pairs = 0;
+	for (tok = strtok_r(buf, ",", &save); tok != NULL;
+					tok = strtok_r(NULL, ",", &save)) {
+		if (nb_pairs >= CLIENT_PAIR_MAX || !str_to_int(tok, 10, &id)
+				|| id < 0)
+			return -1;
+
+		sender_id[nb_pairs] = id;
+		receiver_id[nb_pairs] = id + 1;
+		nb_pairs++;
 	}
-	return -1;
+	return (nb_pairs > 0) ? 0 : -1;
+}
+
+static int __parse_lcore_num(const char *str, unsigned *num)
+{
+	int val = 0;
+
+	if (!str_to_int(str, 10, &val) || val <= 0
+			|| val > WORKER_INST_MAX)
+		return -1;
+	*num = val;
+	return 0;
 }
 
 static void __usage(const char *progname)
 {
 	LOG_INFO("Usage: %s [<EAL args> --proc-type=secondary] -- ", progname);
 	LOG_INFO("\t\t-d <device type (eth for hardware NIC, dpdkr for dpdkr)>");
-	LOG_INFO("\t\t-p <portid (for eth dev) or clientid (for dpdkr)>");
-	LOG_INFO("\t\t-r <TX rate (default 0)>");
+	LOG_INFO("\t\t-p <portid (for eth dev) or clientid (for dpdkr), comma separated for several>");
+	LOG_INFO("\t\t-r <TX rate (default 0), shared by all TX lcores>");
+	LOG_INFO("\t\t-l Account preamble and IFG in the TX rate (L1 rate)");
+	LOG_INFO("\t\t-w <probe thread wait mode: sleep, spin or hybrid>");
+	LOG_INFO("\t\t-W <TX lcore wait mode: sleep, spin (default) or hybrid>");
+	LOG_INFO("\t\t-S Pace each packet instead of each burst");
+	LOG_INFO("\t\t-a <data arrivals: const (default), exp, uniform[:<jitter 0-1>],");
+	LOG_INFO("\t\t    pareto:<mean burst>[:<shape>]>");
+	LOG_INFO("\t\t-A <probe arrivals, same format as -a>");
+	LOG_INFO("\t\t-Q <probe class, up to %u: [rate=<rate>][,len=<frame size with FCS>]",
+					PKT_PROBE_CLASS_INBAND);
+	LOG_INFO("\t\t    [,src=<ip>][,dst=<ip>][,sport=<port>][,dport=<port>]>");
+	LOG_INFO("\t\t-N <measure latency in-band on every n-th generated data packet>");
+	LOG_INFO("\t\t-j <RX timestamps: burst (one TSC read per rx_burst, default), pkt (one");
+	LOG_INFO("\t\t    per probe) or interp (spread over the rx_burst call)>");
+	LOG_INFO("\t\t-B <RFC 2544 throughput search up to the -r rate:");
+	LOG_INFO("\t\t    <trial sec>[:<max loss %%>[:<resolution %%>]]>");
+	LOG_INFO("\t\t-s <TX rate schedule: ramp:<from>:<to>:<sec>, step:<from>:<to>:<inc>:<sec>,");
+	LOG_INFO("\t\t    sine:<min>:<max>:<period>, onoff:<rate>:<on>:<off> or file:<path>>");
+	LOG_INFO("\t\t-t <number of TX lcores, at most one per client pair>");
+	LOG_INFO("\t\t-x <number of RX lcores, one per client pair>");
 	LOG_INFO("\t\t-o <output file prefix>");
 	LOG_INFO("\t\t-R Random pakcets");
+	LOG_INFO("\t\t-Z <zero-copy TX from that many pre-built packets per TX lcore,");
+	LOG_INFO("\t\t    only for switches that do not rewrite packets, at least");
+	LOG_INFO("\t\t    as many as the flows of -f>");
+	LOG_INFO("\t\t-z <frame sizes with FCS: <len>[:<weight>][,...], imix,");
+	LOG_INFO("\t\t    genome:<RFC 6985 letters a-g> or pcap:<path>>");
+	LOG_INFO("\t\t-f <flow set: [n=<flows>][,src=<ip>[-<ip>]][,dst=<ip>[-<ip>]]");
+	LOG_INFO("\t\t    [,sport=<port>[-<port>]][,dport=<port>[-<port>]] or file:<path>,");
+	LOG_INFO("\t\t    then [,pick=rr|uniform|zipf[:<s>]]>");
+	LOG_INFO("\t\t-P <pcap file to replay>");
+	LOG_INFO("\t\t-L <passes over the input file (default 1, 0 for endless)>");
+	LOG_INFO("\t\t-T Replay pcap with the captured timing");
+	LOG_INFO("\t\t-F <binary 5-tuple trace to replay>");
+	LOG_INFO("\t\t-C <text 5-tuple trace to convert into the -F file, then exit>");
 }
 
 static int __parse_options(int argc, char *argv[])
 {
-	int opt = 0;
+	int opt = 0, val = 0;
+	unsigned mode = 0;
+	struct rate_dist dist;
 	char **argvopt = argv;
 	const char *progname = NULL;
 
 	progname = argv[0];
 
-	while ((opt = getopt(argc, argvopt, "d:p:r:o:R")) != -1) {
+	while ((opt = getopt(argc, argvopt, "d:p:r:o:RP:L:TF:C:t:x:lw:W:Ss:a:A:B:f:z:Z:Q:N:j:")) != -1) {
 		switch(opt) {
 			case 'd':
 				if (strcmp(optarg, "eth") == 0) {
@@ -118,22 +198,171 @@ static int __parse_options(int argc, char *argv[])
 			case 'o':
 				stat_set_output(optarg);
 				break;
+			case 'l':
+				rxtx_set_l1_rate(true);
+				break;
+			case 'w':
+				if (!rate_parse_wait(optarg, &mode)) {
+					__usage(progname);
+					return -1;
+				}
+				probe_wait = mode;
+				break;
+			case 'W':
+				if (!rate_parse_wait(optarg, &mode)) {
+					__usage(progname);
+					return -1;
+				}
+				rxtx_set_wait(mode);
+				break;
+			case 'S':
+				rxtx_set_smooth(true);
+				break;
+			case 's':
+				if (!sched_parse(optarg)) {
+					__usage(progname);
+					return -1;
+				}
+				break;
+			case 'a':
+				if (!rate_parse_dist(optarg, &dist)) {
+					__usage(progname);
+					return -1;
+				}
+				rxtx_set_arrival(&dist);
+				break;
+			case 'A':
+				if (!rate_parse_dist(optarg, &probe_dist)) {
+					__usage(progname);
+					return -1;
+				}
+				break;
+			case 'Q':
+				if (!measure_add_probe_class(optarg)) {
+					__usage(progname);
+					return -1;
+				}
+				break;
+			case 'N':
+				if (!str_to_int(optarg, 10, &val) || val <= 0) {
+					LOG_ERROR("Wrong in-band sampling interval %s", optarg);
+					__usage(progname);
+					return -1;
+				}
+				rxtx_set_inband(val);
+				break;
+			case 'j':
+				if (!rxtx_set_rx_stamp(optarg)) {
+					__usage(progname);
+					return -1;
+				}
+				break;
+			case 'B':
+				if (!rfc2544_parse(optarg)) {
+					__usage(progname);
+					return -1;
+				}
+				break;
 			case 'R':
 				tx_type = TX_TYPE_RANDOM;
 				break;
+			case 'Z':
+				if (!str_to_int(optarg, 10, &val) || val <= 0
+						|| val > TX_ZC_PKTS_MAX) {
+					LOG_ERROR("Wrong number of zero-copy packets %s", optarg);
+					__usage(progname);
+					return -1;
+				}
+				rxtx_set_zero_copy(val);
+				break;
+			case 'z':
+				if (!rxtx_set_sizes(optarg)) {
+					__usage(progname);
+					return -1;
+				}
+				break;
+			case 'f':
+				tx_type = TX_TYPE_FLOW;
+				tx_file = optarg;
+				break;
+			case 'P':
+				tx_type = TX_TYPE_PCAP;
+				tx_file = optarg;
+				break;
+			case 'L':
+				if (!str_to_int(optarg, 10, &val) || val < 0) {
+					LOG_ERROR("Wrong number of passes %s", optarg);
+					__usage(progname);
+					return -1;
+				}
+				rxtx_set_loops(val);
+				break;
+			case 'T':
+				rxtx_set_pcap_timing(true);
+				break;
+			case 'F':
+				tx_type = TX_TYPE_5TUPLE_TRACE;
+				tx_file = optarg;
+				break;
+			case 'C':
+				convert_file = optarg;
+				break;
+			case 't':
+				if (__parse_lcore_num(optarg, &nb_tx_lcore) != 0) {
+					LOG_ERROR("Wrong number of TX lcores %s", optarg);
+					__usage(progname);
+					return -1;
+				}
+				break;
+			case 'x':
+				if (__parse_lcore_num(optarg, &nb_rx_lcore) != 0) {
+					LOG_ERROR("Wrong number of RX lcores %s", optarg);
+					__usage(progname);
+					return -1;
+				}
+				break;
 			default:
 				__usage(progname);
 				return -1;
 		}
 	}
+
+	/* both drive the TX rate */
+	if (rfc2544_is_set() && (sched_is_set() || tx_type == TX_TYPE_PCAP)) {
+		LOG_ERROR("RFC 2544 search needs paced TX without a schedule");
+		__usage(progname);
+		return -1;
+	}
 	return 0;
 }
 
-/* return value: if need to create stats thread */
-static bool __set_lcore(void)
+static void __set_rxtx_param(struct rxtx_param *param, unsigned inst,
+				unsigned pair)
+{
+	param->inst = inst;
+	param->sender = sender_port[pair];
+	param->recv = receiver_port[pair];
+	param->mp = mp;
+	param->tx_type = tx_type;
+	param->seq = NULL;
+	param->filename = tx_file;
+}
+
+/*
+ * Give the enabled lcores their roles: with one lcore it does both RX and
+ * TX, with two one does RX and the other TX. With more, the last one runs
+ * the stat thread and the others are split into RX and TX lcores. The
+ * i-th RX/TX lcore uses client pair i: dpdkr rings have a single producer
+ * and a single consumer, so a pair is never shared, and every pair needs
+ * an RX lcore to drain it.
+ *
+ * return value: 1 if need to create stats thread, 0 if not, -1 on error
+ */
+static int __set_lcore(void)
 {
-	unsigned core = 0;
-	unsigned used_core[3] = {UINT_MAX}, used = 0;
+	unsigned core = 0, i = 0;
+	unsigned used_core[RTE_MAX_LCORE], used = 0, workers = 0;
+	unsigned nb_rx = 0, nb_tx = 0;
 
 	for (core = 0; core < RTE_MAX_LCORE; core++) {
 		if (rte_lcore_is_enabled(core) == 0)
@@ -141,25 +370,64 @@ static bool __set_lcore(void)
 
 		used_core[used] = core;
 		used++;
-		if (used >= 3)
-			break;
 	}
 
 	if (used == 1) {
 		lcore_param[used_core[0]].is_rx = true;
 		lcore_param[used_core[0]].is_tx = true;
-		return true;
+		__set_rxtx_param(&lcore_param[used_core[0]].rxtx, 0, 0);
+		nb_rx = nb_tx = 1;
 	} else if (used == 2) {
 		lcore_param[used_core[0]].is_rx = true;
 		lcore_param[used_core[1]].is_tx = true;
-		return true;
-	} else if (used == 3) {
-		lcore_param[used_core[0]].is_rx = true;
-		lcore_param[used_core[1]].is_tx = true;
-		lcore_param[used_core[2]].is_stat = true;
-		return false;
+		__set_rxtx_param(&lcore_param[used_core[0]].rxtx, 0, 0);
+		__set_rxtx_param(&lcore_param[used_core[1]].rxtx, 0, 0);
+		nb_rx = nb_tx = 1;
+	} else if (used >= 3) {
+		workers = used - 1;
+		nb_rx = (nb_rx_lcore > 0) ? nb_rx_lcore : nb_pairs;
+		nb_tx = nb_tx_lcore;
+		if (nb_tx == 0 && workers > nb_rx)
+			nb_tx = RTE_MIN(workers - nb_rx, nb_pairs);
+	} else {
+		return -1;
+	}
+
+	if (nb_rx != nb_pairs || nb_tx == 0 || nb_tx > nb_pairs) {
+		LOG_ERROR("%u client pairs need %u RX lcores and 1 to %u TX lcores, "
+						"got %u RX and %u TX", nb_pairs, nb_pairs,
+						nb_pairs, nb_rx, nb_tx);
+		return -1;
 	}
-	return false;
+	if ((used >= 3 && nb_rx + nb_tx > workers) || nb_rx > WORKER_INST_MAX
+			|| nb_tx > WORKER_INST_MAX) {
+		LOG_ERROR("Cannot run %u RX and %u TX lcores on %u lcores",
+						nb_rx, nb_tx, used);
+		return -1;
+	}
+
+	if (used >= 3) {
+		for (i = 0; i < nb_rx; i++) {
+			lcore_param[used_core[i]].is_rx = true;
+			__set_rxtx_param(&lcore_param[used_core[i]].rxtx, i, i);
+		}
+		for (i = 0; i < nb_tx; i++) {
+			lcore_param[used_core[nb_rx + i]].is_tx = true;
+			__set_rxtx_param(&lcore_param[used_core[nb_rx + i]].rxtx, i, i);
+		}
+		lcore_param[used_core[used - 1]].is_stat = true;
+
+		if (nb_rx + nb_tx < workers)
+			LOG_INFO("%u lcores left idle, give more clients with -p "
+							"to use them", workers - nb_rx - nb_tx);
+	}
+
+	if (!ctl_set_nb_inst(WORKER_RX, nb_rx)
+			|| !ctl_set_nb_inst(WORKER_TX, nb_tx))
+		return -1;
+
+	LOG_INFO("%u RX lcores, %u TX lcores", nb_rx, nb_tx);
+	return (used < 3) ? 1 : 0;
 }
 
 static int __lcore_main(__attribute__((__unused__))void *arg)
@@ -167,13 +435,13 @@ static int __lcore_main(__attribute__((__unused__))void *arg)
 	unsigned lcoreid;
 	struct lcore_param *param;
 	struct measure_param measure = {
-		.sender = sender_id,
+		.sender = sender_port[0],
 		.mp = mp,
+		.wait_mode = (probe_wait < 0) ? RATE_WAIT_HYBRID : probe_wait,
+		.dist = &probe_dist,
 	};
 
 	lcoreid = rte_lcore_id();
-//	if (lcoreid >= LCORE_MAX)
-//		return 0;
 
 	LOG_INFO("lcore %u started.", lcoreid);
 	param = &lcore_param[lcoreid];
@@ -181,12 +449,11 @@ static int __lcore_main(__attribute__((__unused__))void *arg)
 	if (param->is_stat) {
 		measure_thread_run(&measure);
 	} else if (param->is_rx && param->is_tx) {
-		rxtx_thread_run_rxtx(sender_id, receiver_id, mp,
-								tx_type, NULL, NULL);
+		rxtx_thread_run_rxtx(&param->rxtx);
 	} else if (param->is_rx) {
-		rxtx_thread_run_rx(receiver_id);
+		rxtx_thread_run_rx(&param->rxtx);
 	} else if (param->is_tx) {
-		rxtx_thread_run_tx(sender_id, mp, tx_type, NULL, NULL);
+		rxtx_thread_run_tx(&param->rxtx);
 	}
 
 	LOG_INFO("lcore %u finished.", lcoreid);
@@ -285,7 +552,8 @@ int main(int argc, char *argv[])
 {
 	int retval = 0;
 	int coreid = 0;
-	bool is_create_stat = false;
+	int is_create_stat = 0;
+	unsigned i = 0;
 	pthread_t tid;
 	struct measure_param param;
 
@@ -303,31 +571,75 @@ int main(int argc, char *argv[])
 		rte_exit(EXIT_FAILURE, "Invalid command-line arguments\n");
 	}
 
+	if (convert_file != NULL) {
+		if (tx_type != TX_TYPE_5TUPLE_TRACE
+				|| !trace_convert(convert_file, tx_file)) {
+			rte_exit(EXIT_FAILURE, "Failed to convert trace %s\n",
+							convert_file);
+		}
+		return 0;
+	}
+
+	if (nb_pairs == 0) {
+		rte_exit(EXIT_FAILURE, "No client given with -p\n");
+	}
+
 	signal(SIGINT, ctl_signal_handler);
 	signal(SIGTERM, ctl_signal_handler);
 
-	if (__get_ring_dev(sender_id) < 0) {
-		rte_exit(EXIT_FAILURE, "Failed to get dpdkr device (sender)\n");
+	for (i = 0; i < nb_pairs; i++) {
+		sender_port[i] = __get_ring_dev(sender_id[i]);
+		if (sender_port[i] < 0) {
+			rte_exit(EXIT_FAILURE, "Failed to get dpdkr%d device (sender)\n",
+							sender_id[i]);
+		}
+
+		/* Start device */
+		if (rte_eth_dev_start(sender_port[i]) < 0) {
+			rte_exit(EXIT_FAILURE, "Cannot start dpdkr%d device (sender)\n",
+							sender_id[i]);
+		}
+
+		receiver_port[i] = __get_ring_dev(receiver_id[i]);
+		if (receiver_port[i] < 0) {
+			rte_exit(EXIT_FAILURE, "Failed to get dpdkr%d device (receiver)\n",
+							receiver_id[i]);
+		}
+
+		/* Start device */
+		if (rte_eth_dev_start(receiver_port[i]) < 0) {
+			rte_exit(EXIT_FAILURE, "Cannot start dpdkr%d device (receiver)\n",
+							receiver_id[i]);
+		}
+
+		LOG_INFO("Processing client, sender %d (port %d), receiver %d (port %d)",
+						sender_id[i], sender_port[i],
+						receiver_id[i], receiver_port[i]);
 	}
 
-	/* Start device */
-	if (rte_eth_dev_start(sender_id) < 0) {
-		rte_exit(EXIT_FAILURE, "Cannot start dpdkr device (sender)\n");
+	is_create_stat = __set_lcore();
+	if (is_create_stat < 0) {
+		rte_exit(EXIT_FAILURE, "Failed to assign lcores\n");
 	}
 
-	if (__get_ring_dev(receiver_id) < 0) {
-		rte_exit(EXIT_FAILURE, "Failed to get dpdkr device (receiver)\n");
+	/* needs the slave lcores idle, and is used by the stamps of all */
+	if (!tsc_calibrate()) {
+		rte_exit(EXIT_FAILURE, "Failed to calibrate the TSC\n");
 	}
 
-	/* Start device */
-	if (rte_eth_dev_start(receiver_id) < 0) {
-		rte_exit(EXIT_FAILURE, "Cannot start dpdkr device (receiver)\n");
+	if (!rxtx_init(tx_type, tx_file, ctl_get_nb_inst(WORKER_TX))) {
+		rte_exit(EXIT_FAILURE, "Failed to initialize TX\n");
 	}
 
-	is_create_stat = __set_lcore();
+	/* the measure lcore starts the schedule, not before the TX lcores */
+	if (sched_is_set())
+		rxtx_publish_rate(sched_first_bps());
 
-	param.sender = sender_id;
+	/* the stat thread shares its core with a worker here */
+	param.sender = sender_port[0];
 	param.mp = mp;
+	param.wait_mode = (probe_wait < 0) ? RATE_WAIT_SLEEP : probe_wait;
+	param.dist = &probe_dist;
 
 	if (is_create_stat) {
 		if (pthread_create(&tid, NULL, (void *)measure_thread_run, &param)) {
@@ -335,9 +647,6 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	LOG_INFO("Processing client, sender %d, receiver %d",
-					sender_id, receiver_id);
-
 	retval = rte_eal_mp_remote_launch(__lcore_main, NULL, CALL_MASTER);
 	if (retval < 0) {
 		rte_exit(EXIT_FAILURE, "mp launch failed\n");
@@ -354,8 +663,13 @@ int main(int argc, char *argv[])
 		pthread_join(tid, NULL);
 	}
 
-	rte_eth_dev_stop(sender_id);
-	rte_eth_dev_stop(receiver_id);
+	for (i = 0; i < nb_pairs; i++) {
+		rte_eth_dev_stop(sender_port[i]);
+		rte_eth_dev_stop(receiver_port[i]);
+	}
+
+	rxtx_cleanup();
+	stat_cleanup();
 
 	LOG_INFO("Done.");
 	return 0;
@@ -3,6 +3,9 @@
 #include "pkt_seq.h"
 #include "stat.h"
 #include "rate.h"
+#include "schedule.h"
+#include "rfc2544.h"
+#include "rxtx.h"
 
 #include <rte_cycles.h>
 #include <rte_mempool.h>
@@ -12,21 +15,110 @@
 #include <rte_hash_crc.h>
 #include <rte_malloc.h>
 
-static struct rate_ctl probe_rate = {
-	.rate_bps = 0,
-	.cycle_per_byte = 0,
-	.next_tx_cycle = 0,
+#define PROBE_SPEC_MAX 256
+
+/* One probe stream, with its own sequence and statistics */
+struct probe_class {
+	struct pkt_seq_info info;	/* pkt_len without FCS */
+	uint64_t rate_bps;
+	struct rate_ctl rate;
+	struct pkt_probe *hdr;
+	uint32_t iter;
+	uint64_t drops;
 };
 
-static uint32_t probe_iter = 0;
-static struct pkt_probe *probe_pkt = NULL;
-static int probe_pkt_len = PKT_SEQ_PROBE_PKT_LEN;
+static struct probe_class probe_cls[PKT_PROBE_CLASS_INBAND];
+static unsigned int nb_probe_cls = 0;
+
+static void __class_init(struct probe_class *cls)
+{
+	memset(cls, 0, sizeof(struct probe_class));
+	cls->info.src_ip = PKT_SEQ_IP_SRC;
+	cls->info.dst_ip = PKT_SEQ_IP_DST;
+	cls->info.proto = IPPROTO_UDP;
+	cls->info.src_port = PKT_SEQ_PROBE_PORT_SRC;
+	cls->info.dst_port = PKT_SEQ_PROBE_PORT_DST;
+	cls->info.pkt_len = PKT_SEQ_PROBE_PKT_LEN;
+	rate_parse_bps(PROBE_RATE_DEF, &cls->rate_bps);
+}
+
+static bool __parse_port(const char *str, uint16_t *port)
+{
+	int val = 0;
+
+	if (!str_to_int(str, 10, &val) || val < 0 || val > 0xffff)
+		return false;
+	*port = val;
+	return true;
+}
+
+static bool __parse_class(const char *spec, struct probe_class *cls)
+{
+	char buf[PROBE_SPEC_MAX];
+	char *tok = NULL, *save = NULL, *val = NULL;
+	int len = 0;
+	bool ok = false;
+
+	if (strlen(spec) >= sizeof(buf))
+		return false;
+	snprintf(buf, sizeof(buf), "%s", spec);
+
+	for (tok = strtok_r(buf, ",", &save); tok != NULL;
+					tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (val == NULL)
+			return false;
+		*val++ = '\0';
+
+		if (strcmp(tok, "rate") == 0) {
+			ok = rate_parse_bps(val, &cls->rate_bps) && cls->rate_bps > 0;
+		} else if (strcmp(tok, "len") == 0) {
+			/* frame length with FCS, as for -z */
+			ok = str_to_int(val, 10, &len)
+					&& len >= (int)(sizeof(struct pkt_probe) + ETH_CRC_LEN)
+					&& len <= PKT_TMPL_MAX;
+			cls->info.pkt_len = len - ETH_CRC_LEN;
+		} else if (strcmp(tok, "src") == 0) {
+			ok = str_to_ipv4(val, &cls->info.src_ip);
+		} else if (strcmp(tok, "dst") == 0) {
+			ok = str_to_ipv4(val, &cls->info.dst_ip);
+		} else if (strcmp(tok, "sport") == 0) {
+			ok = __parse_port(val, &cls->info.src_port);
+		} else if (strcmp(tok, "dport") == 0) {
+			ok = __parse_port(val, &cls->info.dst_port);
+		} else {
+			ok = false;
+		}
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+bool measure_add_probe_class(const char *spec)
+{
+	struct probe_class *cls = NULL;
+
+	if (nb_probe_cls >= PKT_PROBE_CLASS_INBAND) {
+		LOG_ERROR("At most %u probe classes", PKT_PROBE_CLASS_INBAND);
+		return false;
+	}
+
+	cls = &probe_cls[nb_probe_cls];
+	__class_init(cls);
+	if (!__parse_class(spec, cls)) {
+		LOG_ERROR("Wrong probe class %s", spec);
+		return false;
+	}
+	nb_probe_cls++;
+	return true;
+}
 
 static void __prepare_probe_mbuf(struct rte_mbuf **buf,
-				struct rte_mempool *mp)
+				struct probe_class *cls, struct rte_mempool *mp)
 {
 	struct rte_mbuf *pkt = NULL;
-	uint32_t crc = 0;
+	uint16_t len = cls->info.pkt_len;
 
 	pkt = rte_mbuf_raw_alloc(mp);
 	if (pkt == NULL) {
@@ -35,29 +127,26 @@ static void __prepare_probe_mbuf(struct rte_mbuf **buf,
 		return;
 	}
 
-	pkt->pkt_len = probe_pkt_len + ETH_CRC_LEN;
-	pkt->data_len = probe_pkt_len + ETH_CRC_LEN;
+	pkt->pkt_len = len + ETH_CRC_LEN;
+	pkt->data_len = len + ETH_CRC_LEN;
 	/* the number of packet segments */
 	pkt->nb_segs = 1;
 
 	/* construct probe packet */
-	probe_pkt->probe_idx = probe_iter;
-	probe_pkt->send_cycle = rte_get_tsc_cycles();
-	if (!copy_buf_to_pkt(probe_pkt, sizeof(struct pkt_probe),
+	cls->hdr->probe_idx = cls->iter;
+	cls->hdr->send_cycle = rte_get_tsc_cycles();
+	if (!copy_buf_to_pkt(cls->hdr, sizeof(struct pkt_probe),
 							pkt, 0)) {
 		LOG_ERROR("Failed to copy probe packet into mbuf");
 		goto close_free_mbuf;
 	}
+	if (len > sizeof(struct pkt_probe))
+		memset(rte_pktmbuf_mtod_offset(pkt, uint8_t *,
+						sizeof(struct pkt_probe)), 0,
+						len - sizeof(struct pkt_probe));
 
-	/* calculate ethernet frame checksum */
-	crc = rte_hash_crc(rte_pktmbuf_mtod(pkt, void *),
-					probe_pkt_len, PKT_PROBE_INITVAL);
-
-	if (!copy_buf_to_pkt(&crc, sizeof(uint32_t),
-							pkt, probe_pkt_len)) {
-		LOG_ERROR("Failed to copy FCS into mbuf");
-		goto close_free_mbuf;
-	}
+	/* send time and FCS are written by the TX lcore right before the
+	 * burst that carries it */
 
 	/* complete packet mbuf */
 	pkt->ol_flags = 0;
@@ -74,82 +163,175 @@ close_free_mbuf:
 	return;
 }
 
-static int __process_tx(int portid, struct rte_mempool *mp)
+/*
+ * Probes are handed to the TX lcore owning queue 0 of the port, which
+ * splices them into its data bursts: the queue has a single producer and
+ * probes wait behind the same data packets as they would in production.
+ */
+static int __process_tx_class(struct probe_class *cls, uint16_t id,
+				struct rte_mempool *mp, uint64_t start_cyc)
 {
-	uint16_t nb_tx = 0;
-	uint64_t start_cyc = 0;
 	struct rte_mbuf *pkt = NULL;
 
-	start_cyc = rte_get_tsc_cycles();
-
-	if (probe_pkt == NULL) {
-		LOG_INFO("create probe");
-		probe_pkt = pkt_seq_create_probe();
-		if (probe_pkt == NULL) {
+	if (cls->hdr == NULL) {
+		LOG_INFO("create probe of class %u", id);
+		cls->hdr = pkt_seq_create_probe(&cls->info, id);
+		if (cls->hdr == NULL) {
 			LOG_ERROR("Failed to create template of probe pkt");
 			return -ENOMEM;
 		}
 	}
 
 	/* check if send now */
-	if (start_cyc < probe_rate.next_tx_cycle) {
+	if (start_cyc < cls->rate.next_tx_cycle) {
 		return 0;
 	}
 
 	/* construct mbuf for probe packet */
-//	LOG_ERROR("TX start");
-	__prepare_probe_mbuf(&pkt, mp);
+	__prepare_probe_mbuf(&pkt, cls, mp);
 
 	if (pkt == NULL)
 		return -EAGAIN;
 
-	/* send probe packet */
-	nb_tx = rte_eth_tx_burst(portid, 0, &pkt, 1);
-	if (nb_tx < 1) {
-		LOG_ERROR("Failed to send probe packet %u", probe_pkt->probe_idx);
-		return -EAGAIN;
+	/* hand the probe over, drop it if no TX lcore takes probes */
+	if (rxtx_inject_probe(pkt)) {
+		cls->iter++;
+	} else {
+		rte_pktmbuf_free(pkt);
+		cls->drops++;
 	}
-//	LOG_INFO("TX packet %u on %lu", probe_iter, start_cyc);
-
-	/* update TX statistics */
-	stat_update_tx_probe(probe_pkt->probe_idx,
-					pkt->pkt_len, probe_pkt->send_cycle);
-
-	/* update tx seq state */
-	probe_iter++;
 
 	/* calculate the next time to TX (and sleep) */
-	rate_set_next_cycle(&probe_rate, probe_pkt->send_cycle, pkt->pkt_len);
-//	if (is_sleep) {
-//		rate_wait_for_time(&probe_rate);
-//	}
+	rate_set_next_cycle(&cls->rate, cls->hdr->send_cycle,
+					cls->info.pkt_len + ETH_CRC_LEN, 1);
+	return 0;
+}
+
+static int __process_tx(struct rte_mempool *mp)
+{
+	uint64_t start_cyc = rte_get_tsc_cycles();
+	unsigned int i = 0;
+	int ret = 0;
 
+	for (i = 0; i < nb_probe_cls; i++) {
+		ret = __process_tx_class(&probe_cls[i], i, mp, start_cyc);
+		if (ret < 0)
+			return ret;
+	}
 	return 0;
 }
 
+/* Departure of the next probe of any class */
+static uint64_t __next_probe_cycle(void)
+{
+	uint64_t next = UINT64_MAX;
+	unsigned int i = 0;
+
+	for (i = 0; i < nb_probe_cls; i++)
+		next = RTE_MIN(next, probe_cls[i].rate.next_tx_cycle);
+	return next;
+}
+
+/* The statistics only hold the classes in use, tell them before
+ * stat_init */
+static void __set_classes(void)
+{
+	uint32_t mask = 0;
+
+	if (nb_probe_cls == 0) {
+		__class_init(&probe_cls[0]);
+		nb_probe_cls = 1;
+	}
+
+	mask = (1U << nb_probe_cls) - 1;
+	if (rxtx_get_inband() > 0) {
+		mask |= 1U << PKT_PROBE_CLASS_INBAND;
+		LOG_INFO("Probe class %u: in-band, every %u data packets",
+						PKT_PROBE_CLASS_INBAND, rxtx_get_inband());
+	}
+	stat_set_probe_classes(mask);
+}
+
+static void __start_classes(const struct rate_dist *dist, uint64_t start_cyc)
+{
+	struct probe_class *cls = NULL;
+	const struct pkt_seq_info *info = NULL;
+	unsigned int i = 0;
+
+	for (i = 0; i < nb_probe_cls; i++) {
+		cls = &probe_cls[i];
+		info = &cls->info;
+		cls->iter = 0;
+		cls->drops = 0;
+		memset(&cls->rate, 0, sizeof(struct rate_ctl));
+		rate_set_bps(&cls->rate, cls->rate_bps);
+		if (dist != NULL)
+			rate_set_dist(&cls->rate, dist,
+							start_cyc + ((uint64_t)i << 48));
+
+		LOG_INFO("Probe class %u: %lu bps, %u bytes, "
+						"%u.%u.%u.%u:%u -> %u.%u.%u.%u:%u", i,
+						(unsigned long)cls->rate_bps,
+						info->pkt_len + ETH_CRC_LEN,
+						info->src_ip >> 24, (info->src_ip >> 16) & 0xff,
+						(info->src_ip >> 8) & 0xff, info->src_ip & 0xff,
+						info->src_port,
+						info->dst_ip >> 24, (info->dst_ip >> 16) & 0xff,
+						(info->dst_ip >> 8) & 0xff, info->dst_ip & 0xff,
+						info->dst_port);
+	}
+}
+
+static void __stop_classes(void)
+{
+	struct probe_class *cls = NULL;
+	unsigned int i = 0;
+
+	for (i = 0; i < nb_probe_cls; i++) {
+		cls = &probe_cls[i];
+		if (cls->hdr != NULL) {
+			rte_free(cls->hdr);
+			cls->hdr = NULL;
+		}
+
+		if (cls->drops > 0)
+			LOG_INFO("%lu probes of class %u dropped, the TX lcore "
+							"did not take them",
+							(unsigned long)cls->drops, i);
+	}
+}
+
 void measure_thread_run(struct measure_param *param)
 {
-	uint64_t start_cyc = 0, next_cycle = 0;
+	uint64_t start_cyc = 0, next_cycle = 0, sched_cycle = 0, search_cycle = 0;
+	uint64_t probe_cycle = 0;
 	int sender = param->sender;
 	struct rte_mempool *mp = param->mp;
 	int ret = 0;
 	bool is_err = false;
 
+	/* main published the rate at time 0 before launching the TX lcores,
+	 * the schedule runs from here */
+	sched_start(rte_get_tsc_cycles());
+
+	__set_classes();
 	if (sender < 0 || mp == NULL || !stat_init()) {
 		LOG_ERROR("Failed to initialize probe thread");
 		return;
 	}
 
 	start_cyc = rte_get_tsc_cycles();
-	probe_iter = 0;
-	rate_set_rate(PROBE_RATE_DEF, &probe_rate);
+	rfc2544_start(rxtx_get_rate(), start_cyc);
+	__start_classes(param->dist, start_cyc);
 
-	LOG_INFO("Probe packet send to port %d", sender);
+	LOG_INFO("Probe packet send to port %d, %s wait, %s arrivals", sender,
+					rate_wait_name(param->wait_mode),
+					rate_dist_name(probe_cls[0].rate.dist.type));
 
 	while(!stat_is_stop()) {
 		/* TX */
-		if (!is_err) {
-			ret = __process_tx(sender, mp);
+		if (!is_err && !rfc2544_is_draining()) {
+			ret = __process_tx(mp);
 			if (ret == -ENOMEM) {
 				LOG_ERROR("Probe packet TX error!");
 				is_err = true;
@@ -157,17 +339,21 @@ void measure_thread_run(struct measure_param *param)
 		}
 
 		next_cycle = stat_processing();
-		if (next_cycle > probe_rate.next_tx_cycle) {
-			rate_wait_for_time(probe_rate.next_tx_cycle);
+		sched_cycle = sched_update(rte_get_tsc_cycles());
+		if (sched_cycle < next_cycle)
+			next_cycle = sched_cycle;
+		search_cycle = rfc2544_update(rte_get_tsc_cycles());
+		if (search_cycle < next_cycle)
+			next_cycle = search_cycle;
+		probe_cycle = __next_probe_cycle();
+		if (next_cycle > probe_cycle) {
+			rate_wait_for_time(probe_cycle, param->wait_mode);
 		} else {
-			rate_wait_for_time(next_cycle);
+			rate_wait_for_time(next_cycle, param->wait_mode);
 		}
 	}
 
-	if (probe_pkt != NULL) {
-		rte_free(probe_pkt);
-		probe_pkt = NULL;
-	}
+	__stop_classes();
 
 	stat_finish(start_cyc);
 }
@@ -1,13 +1,27 @@
 #ifndef _PKTGEN_MEASURE_H_
 #define _PKTGEN_MEASURE_H_
 
+#include <stdbool.h>
+
+struct rate_dist;
+
 struct measure_param {
 	int sender;
 	struct rte_mempool *mp;
+	unsigned wait_mode;	/* RATE_WAIT_* */
+	const struct rate_dist *dist;	/* probe arrivals, NULL for const */
 };
 
 #define PROBE_RATE_DEF "10k"
 
+/*
+ * Add a probe stream with its own sequence and statistics, default one
+ * 10k bps stream of 64-byte frames. Format: comma separated key=value
+ * pairs, any of rate=<bps as for -r>, len=<frame length with FCS>,
+ * src=<ip>, dst=<ip>, sport=<port>, dport=<port>.
+ */
+bool measure_add_probe_class(const char *spec);
+
 void measure_thread_run(struct measure_param *param);
 
 #endif
@@ -0,0 +1,358 @@
+#include "util.h"
+#include "pcap.h"
+#include "pkt_seq.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <rte_cycles.h>
+#include <rte_malloc.h>
+#include <rte_memcpy.h>
+#include <rte_hash_crc.h>
+
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC	0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_USEC 1000ULL
+
+#define ARENA_ALIGN 64
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_frac;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct pcap_fmt {
+	bool swapped;
+	bool nsec;
+};
+
+static inline uint32_t __fix32(const struct pcap_fmt *fmt, uint32_t val)
+{
+	return fmt->swapped ? __builtin_bswap32(val) : val;
+}
+
+static bool __parse_file_hdr(const struct pcap_file_hdr *hdr,
+				struct pcap_fmt *fmt)
+{
+	switch (hdr->magic) {
+		case PCAP_MAGIC:
+			fmt->swapped = false;
+			fmt->nsec = false;
+			break;
+		case PCAP_MAGIC_NSEC:
+			fmt->swapped = false;
+			fmt->nsec = true;
+			break;
+		default:
+			if (__builtin_bswap32(hdr->magic) == PCAP_MAGIC) {
+				fmt->swapped = true;
+				fmt->nsec = false;
+			} else if (__builtin_bswap32(hdr->magic) == PCAP_MAGIC_NSEC) {
+				fmt->swapped = true;
+				fmt->nsec = true;
+			} else {
+				LOG_ERROR("Not a pcap file, magic 0x%x", hdr->magic);
+				return false;
+			}
+	}
+
+	if (__fix32(fmt, hdr->linktype) != PCAP_LINKTYPE_ETHERNET) {
+		LOG_ERROR("Unsupported link type %u",
+						__fix32(fmt, hdr->linktype));
+		return false;
+	}
+	return true;
+}
+
+/* First pass: count usable frames and the arena size they need */
+static bool __scan(const uint8_t *map, size_t map_len,
+				const struct pcap_fmt *fmt, uint16_t max_len,
+				uint32_t *nb_pkts, size_t *arena_len)
+{
+	size_t pos = sizeof(struct pcap_file_hdr);
+	const struct pcap_rec_hdr *rec = NULL;
+	uint32_t caplen = 0, skipped = 0;
+
+	*nb_pkts = 0;
+	*arena_len = 0;
+
+	while (pos + sizeof(struct pcap_rec_hdr) <= map_len) {
+		rec = (const struct pcap_rec_hdr *)(map + pos);
+		caplen = __fix32(fmt, rec->incl_len);
+		pos += sizeof(struct pcap_rec_hdr);
+		if (pos + caplen > map_len) {
+			LOG_INFO("Truncated record at offset %lu, stop parsing",
+							(unsigned long)pos);
+			break;
+		}
+		pos += caplen;
+
+		if (caplen == 0 || caplen + ETH_CRC_LEN > max_len) {
+			skipped++;
+			continue;
+		}
+
+		if (*nb_pkts == UINT32_MAX) {
+			LOG_ERROR("Too many packets in pcap file");
+			return false;
+		}
+		(*nb_pkts)++;
+		*arena_len += RTE_ALIGN_CEIL(caplen + ETH_CRC_LEN, ARENA_ALIGN);
+	}
+
+	if (skipped > 0)
+		LOG_INFO("Skipped %u frames larger than %u bytes",
+						skipped, max_len);
+	return true;
+}
+
+static uint64_t __rec_ns(const struct pcap_fmt *fmt,
+				const struct pcap_rec_hdr *rec)
+{
+	uint64_t ns = (uint64_t)__fix32(fmt, rec->ts_sec) * NSEC_PER_SEC;
+
+	if (fmt->nsec)
+		return ns + __fix32(fmt, rec->ts_frac);
+	return ns + __fix32(fmt, rec->ts_frac) * NSEC_PER_USEC;
+}
+
+/* Second pass: copy frames into the arena and convert timestamps */
+static void __fill(const uint8_t *map, size_t map_len,
+				const struct pcap_fmt *fmt, uint16_t max_len,
+				struct pcap_arena *arena)
+{
+	size_t pos = sizeof(struct pcap_file_hdr);
+	const struct pcap_rec_hdr *rec = NULL;
+	uint32_t caplen = 0, idx = 0, off = 0, crc = 0;
+	uint64_t first_ns = 0, ns = 0, last_ns = 0;
+	uint64_t hz = rte_get_tsc_hz();
+
+	while (idx < arena->nb_pkts
+			&& pos + sizeof(struct pcap_rec_hdr) <= map_len) {
+		rec = (const struct pcap_rec_hdr *)(map + pos);
+		caplen = __fix32(fmt, rec->incl_len);
+		pos += sizeof(struct pcap_rec_hdr);
+
+		if (caplen == 0 || caplen + ETH_CRC_LEN > max_len) {
+			pos += caplen;
+			continue;
+		}
+
+		ns = __rec_ns(fmt, rec);
+		if (idx == 0)
+			first_ns = ns;
+		/* clamp timestamps going backwards */
+		if (ns < last_ns)
+			ns = last_ns;
+		last_ns = ns;
+
+		/* append an FCS like the generated packets carry */
+		rte_memcpy(arena->data + off, map + pos, caplen);
+		crc = rte_hash_crc(arena->data + off, caplen, 0);
+		memcpy(arena->data + off + caplen, &crc, ETH_CRC_LEN);
+		caplen += ETH_CRC_LEN;
+
+		arena->off[idx] = off;
+		arena->len[idx] = caplen;
+		arena->ts_cyc[idx] = (uint64_t)((double)(ns - first_ns)
+						* hz / NSEC_PER_SEC);
+		arena->total_bytes += caplen;
+
+		off += RTE_ALIGN_CEIL(caplen, ARENA_ALIGN);
+		pos += caplen - ETH_CRC_LEN;
+		idx++;
+	}
+
+	/* The next pass starts one mean gap after the last frame */
+	if (arena->nb_pkts > 1) {
+		arena->duration = arena->ts_cyc[arena->nb_pkts - 1]
+				+ arena->ts_cyc[arena->nb_pkts - 1] / (arena->nb_pkts - 1);
+	} else {
+		arena->duration = 0;
+	}
+}
+
+struct pcap_arena *pcap_arena_load(const char *filename, uint16_t max_len)
+{
+	int fd = -1;
+	struct stat st;
+	uint8_t *map = NULL;
+	struct pcap_fmt fmt;
+	struct pcap_arena *arena = NULL;
+	uint32_t nb_pkts = 0;
+	size_t arena_len = 0;
+
+	if (filename == NULL) {
+		LOG_ERROR("No pcap file given");
+		return NULL;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		LOG_ERROR("Failed to open pcap file %s", filename);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 ||
+			(size_t)st.st_size < sizeof(struct pcap_file_hdr)) {
+		LOG_ERROR("Invalid pcap file %s", filename);
+		goto close_fd;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	if (map == MAP_FAILED) {
+		LOG_ERROR("Failed to mmap pcap file %s", filename);
+		goto close_fd;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	if (!__parse_file_hdr((const struct pcap_file_hdr *)map, &fmt))
+		goto close_unmap;
+
+	if (!__scan(map, st.st_size, &fmt, max_len, &nb_pkts, &arena_len))
+		goto close_unmap;
+
+	if (nb_pkts == 0) {
+		LOG_ERROR("No usable packet in pcap file %s", filename);
+		goto close_unmap;
+	}
+
+	/* frame offsets are 32 bits */
+	if (arena_len > UINT32_MAX) {
+		LOG_ERROR("pcap file %s needs a %lu byte arena, at most %u",
+						filename, (unsigned long)arena_len, UINT32_MAX);
+		goto close_unmap;
+	}
+
+	arena = rte_zmalloc("pktgen: pcap arena",
+					sizeof(struct pcap_arena), 0);
+	if (arena == NULL)
+		goto close_no_mem;
+
+	arena->nb_pkts = nb_pkts;
+	arena->data = rte_malloc("pktgen: pcap data", arena_len, ARENA_ALIGN);
+	arena->off = rte_malloc("pktgen: pcap off",
+					sizeof(uint32_t) * nb_pkts, 0);
+	arena->len = rte_malloc("pktgen: pcap len",
+					sizeof(uint16_t) * nb_pkts, 0);
+	arena->ts_cyc = rte_malloc("pktgen: pcap ts",
+					sizeof(uint64_t) * nb_pkts, 0);
+	if (arena->data == NULL || arena->off == NULL
+			|| arena->len == NULL || arena->ts_cyc == NULL)
+		goto close_no_mem;
+
+	__fill(map, st.st_size, &fmt, max_len, arena);
+
+	munmap(map, st.st_size);
+	close(fd);
+
+	LOG_INFO("Loaded %u packets (%lu bytes) from %s",
+					arena->nb_pkts, arena->total_bytes, filename);
+	return arena;
+
+close_no_mem:
+	LOG_ERROR("Failed to allocate memory for pcap arena");
+	pcap_arena_free(arena);
+	arena = NULL;
+
+close_unmap:
+	munmap(map, st.st_size);
+
+close_fd:
+	close(fd);
+	return NULL;
+}
+
+void pcap_arena_free(struct pcap_arena *arena)
+{
+	if (arena == NULL)
+		return;
+
+	rte_free(arena->data);
+	rte_free(arena->off);
+	rte_free(arena->len);
+	rte_free(arena->ts_cyc);
+	rte_free(arena);
+}
+
+bool pcap_size_hist(const char *filename, uint64_t *cnt, uint16_t min_len,
+				uint16_t max_len)
+{
+	int fd = -1;
+	struct stat st;
+	uint8_t *map = NULL;
+	struct pcap_fmt fmt;
+	const struct pcap_rec_hdr *rec = NULL;
+	size_t pos = sizeof(struct pcap_file_hdr);
+	uint32_t len = 0, caplen = 0;
+	uint64_t nb_pkts = 0, skipped = 0;
+	bool ret = false;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		LOG_ERROR("Failed to open pcap file %s", filename);
+		return false;
+	}
+
+	if (fstat(fd, &st) < 0 ||
+			(size_t)st.st_size < sizeof(struct pcap_file_hdr)) {
+		LOG_ERROR("Invalid pcap file %s", filename);
+		goto close_fd;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		LOG_ERROR("Failed to mmap pcap file %s", filename);
+		goto close_fd;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	if (!__parse_file_hdr((const struct pcap_file_hdr *)map, &fmt))
+		goto close_unmap;
+
+	while (pos + sizeof(struct pcap_rec_hdr) <= (size_t)st.st_size) {
+		rec = (const struct pcap_rec_hdr *)(map + pos);
+		caplen = __fix32(&fmt, rec->incl_len);
+		pos += sizeof(struct pcap_rec_hdr) + caplen;
+
+		/* the length on the wire, short frames were padded there */
+		len = __fix32(&fmt, rec->orig_len) + ETH_CRC_LEN;
+		if (len < min_len)
+			len = min_len;
+		if (len > max_len) {
+			skipped++;
+			continue;
+		}
+		cnt[len - min_len]++;
+		nb_pkts++;
+	}
+
+	if (skipped > 0)
+		LOG_INFO("Skipped %lu frames larger than %u bytes",
+						(unsigned long)skipped, max_len);
+	LOG_INFO("Took %lu packet sizes from %s", (unsigned long)nb_pkts,
+					filename);
+	ret = (nb_pkts > 0);
+
+close_unmap:
+	munmap(map, st.st_size);
+
+close_fd:
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,31 @@
+#ifndef _PKTGEN_PCAP_H_
+#define _PKTGEN_PCAP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Packets of a capture file, pre-parsed and copied into one contiguous,
+ * hugepage-backed arena so that replay never touches the file. */
+struct pcap_arena {
+	uint8_t *data;		/* frame bytes, each frame cache-line aligned */
+	uint32_t nb_pkts;
+	uint32_t *off;		/* offset of each frame in data */
+	uint16_t *len;		/* captured length of each frame, plus FCS */
+	uint64_t *ts_cyc;	/* TSC cycles relative to the first frame */
+	uint64_t duration;	/* cycles of one pass, including the last gap */
+	uint64_t total_bytes;
+};
+
+/* Frames longer than max_len once their FCS is appended are skipped.
+ * Captures needing an arena of 4GB or more are refused. */
+struct pcap_arena *pcap_arena_load(const char *filename, uint16_t max_len);
+
+void pcap_arena_free(struct pcap_arena *arena);
+
+/* Count the frames of a capture by length on the wire, FCS included:
+ * cnt[len - min_len], shorter frames count as min_len and longer ones
+ * are skipped */
+bool pcap_size_hist(const char *filename, uint64_t *cnt, uint16_t min_len,
+				uint16_t max_len);
+
+#endif /* _PKTGEN_PCAP_H_ */
@@ -1,9 +1,14 @@
 #include "util.h"
 #include "pkt_seq.h"
+#include "cksum.h"
 
 #include <rte_hash_crc.h>
 #include <rte_malloc.h>
 #include <rte_mbuf.h>
+#include <rte_prefetch.h>
+#if defined(RTE_ARCH_X86)
+#include <rte_vect.h>
+#endif
 
 #define IP_VERSION 0x40
 #define IP_HDRLEN 0x05
@@ -57,18 +62,6 @@ void pkt_seq_init(struct pkt_seq_info *info)
 //	info->seq_cnt = PKT_SEQ_CNT;
 }
 
-static uint16_t __checksum_16(const void *data, uint32_t len)
-{
-	uint32_t crc32 = 0;
-
-	crc32 = rte_hash_crc(data, len, 0);
-
-	crc32 = (crc32 & 0xffff) + (crc32 >> 16);
-	crc32 = (crc32 & 0xffff) + (crc32 >> 16);
-
-	return ~((uint16_t)crc32);
-}
-
 static void __setup_ip_hdr(struct ipv4_hdr *ip)
 {
 	/* Setup IPv4 header */
@@ -79,7 +72,7 @@ static void __setup_ip_hdr(struct ipv4_hdr *ip)
 	ip->packet_id = 0;
 
 	/* Compute IPv4 header checksum */
-	ip->hdr_checksum = __checksum_16(ip, sizeof(struct ipv4_hdr));
+	ip->hdr_checksum = cksum_ipv4_hdr(ip);
 }
 
 void pkt_seq_setup_tcpip(struct pkt_seq_info *info,
@@ -99,20 +92,18 @@ void pkt_seq_setup_tcpip(struct pkt_seq_info *info,
 	tcpip->tcp.rx_win = rte_cpu_to_be_16(PKT_SEQ_TCP_WINDOW);
 	tcpip->tcp.tcp_urp = 0;
 
-	/* Setup part of IP header */
+	/* Setup IP header, the TCP checksum covers its addresses */
 	tcpip->ip.src_addr = rte_cpu_to_be_32(info->src_ip);
 	tcpip->ip.dst_addr = rte_cpu_to_be_32(info->dst_ip);
 	tcpip->ip.total_length = rte_cpu_to_be_16(info->pkt_len
-								- sizeof(struct ether_hdr)
-								- sizeof(struct ipv4_hdr));
+								- sizeof(struct ether_hdr));
 	tcpip->ip.next_proto_id = IPPROTO_TCP;
-
-	/* Calculate tcp checksum */
-	tlen = info->pkt_len - sizeof(struct ether_hdr);
-	tcpip->tcp.cksum = __checksum_16(tcpip, tlen);
-
-	/* Setup remaining part of ip header */
 	__setup_ip_hdr(&tcpip->ip);
+
+	/* Calculate TCP checksum, the payload is all zero and adds nothing */
+	tlen = info->pkt_len - sizeof(struct ether_hdr) - sizeof(struct ipv4_hdr);
+	tcpip->tcp.cksum = ~cksum_fold(cksum_add(&tcpip->tcp,
+					sizeof(struct tcp_hdr), cksum_ipv4_phdr(&tcpip->ip, tlen)));
 }
 
 void pkt_seq_setup_udpip(struct pkt_seq_info *info,
@@ -138,24 +129,25 @@ void pkt_seq_setup_udpip(struct pkt_seq_info *info,
 	ip->src_addr = rte_cpu_to_be_32(info->src_ip);
 	ip->dst_addr = rte_cpu_to_be_32(info->dst_ip);
 
-	/* Calculate UDP checksum */
+	/* No UDP checksum: the probe payload changes with every packet */
 	udp->dgram_cksum = 0;
 
 	/* Setup remaining part of ip header */
 	__setup_ip_hdr(ip);
 }
 
-struct pkt_probe *pkt_seq_create_probe(void)
+struct pkt_probe *pkt_seq_create_probe(const struct pkt_seq_info *info,
+				uint16_t cls)
 {
 	struct pkt_probe *pkt = NULL;
-	struct pkt_seq_info info = {
-		.src_ip = PKT_SEQ_IP_SRC,
-		.dst_ip = PKT_SEQ_IP_DST,
-		.proto = IPPROTO_UDP,
-		.src_port = PKT_SEQ_PROBE_PORT_SRC,
-		.dst_port = PKT_SEQ_PROBE_PORT_DST,
-		.pkt_len = PKT_SEQ_PROBE_PKT_LEN,
-	};
+	struct pkt_seq_info udp_info = *info;
+
+	if (info->pkt_len < sizeof(struct pkt_probe)
+			|| info->pkt_len > PKT_SEQ_PROBE_PKT_MAX) {
+		LOG_ERROR("Probe length %u out of range", info->pkt_len);
+		return NULL;
+	}
+	udp_info.proto = IPPROTO_UDP;
 
 	pkt = rte_zmalloc("pktgen: struct pkt_probe",
 						sizeof(struct pkt_probe), 0);
@@ -170,7 +162,7 @@ struct pkt_probe *pkt_seq_create_probe(void)
 					sizeof(pkt->probe_idx), sizeof(struct pkt_probe));
 
 	/* Setup UDP and IPv4 headers */
-	pkt_seq_setup_udpip(&info, &pkt->udpip_hdr);
+	pkt_seq_setup_udpip(&udp_info, &pkt->udpip_hdr);
 
 	/* Setup Ethernet header */
 	ether_addr_copy(&mac_src, &pkt->eth_hdr.s_addr);
@@ -178,19 +170,54 @@ struct pkt_probe *pkt_seq_create_probe(void)
 	pkt->eth_hdr.ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
 
 	/* Setup probe info */
+	pkt->probe_class = cls;
 	pkt->probe_idx = 0;
 	pkt->probe_magic = PKT_PROBE_MAGIC;
 	pkt->send_cycle = 0;
 	return pkt;
 }
 
-void pkt_seq_fill_mbuf(struct rte_mbuf *mbuf, struct pkt_seq_info *info)
+/* Build a complete frame (headers, zeroed payload and FCS) described by
+ * info into buf, which must hold at least info->pkt_len + ETH_CRC_LEN bytes.
+ */
+static void __fill_buf(uint8_t *buf, struct pkt_seq_info *info)
 {
 	struct ether_hdr *eth_hdr;
 	uint8_t *payload = NULL;
-	unsigned len = 0;
+	unsigned hdr_len = 0;
 	uint32_t *crc = NULL;
 
+	/* Setup payload */
+	if (info->proto == IPPROTO_TCP)
+		hdr_len = sizeof(struct ether_hdr) + sizeof(struct tcpip_hdr);
+	else
+		hdr_len = sizeof(struct ether_hdr) + sizeof(struct udpip_hdr);
+	payload = buf + hdr_len;
+	if (info->pkt_len > hdr_len)
+		memset(payload, 0, info->pkt_len - hdr_len);
+
+	/* Setup TCP/UDP+IP */
+	if (info->proto == IPPROTO_TCP) {
+		pkt_seq_setup_tcpip(info,
+				(struct tcpip_hdr *)(buf + sizeof(struct ether_hdr)));
+	} else {
+		pkt_seq_setup_udpip(info,
+				(struct udpip_hdr *)(buf + sizeof(struct ether_hdr)));
+	}
+
+	/* Setup Ethernet header */
+	eth_hdr = (struct ether_hdr *)buf;
+	ether_addr_copy(&mac_src, &eth_hdr->s_addr);
+	ether_addr_copy(&mac_dst, &eth_hdr->d_addr);
+	eth_hdr->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+	/* Setup Eth FCS */
+	crc = (uint32_t *)(buf + info->pkt_len);
+	*crc = rte_hash_crc(buf, info->pkt_len, 0);
+}
+
+void pkt_seq_fill_mbuf(struct rte_mbuf *mbuf, struct pkt_seq_info *info)
+{
 	if (info == NULL) {
 		LOG_ERROR("Wrong data to fill into mbuf");
 		return;
@@ -199,47 +226,93 @@ void pkt_seq_fill_mbuf(struct rte_mbuf *mbuf, struct pkt_seq_info *info)
 	mbuf->pkt_len = info->pkt_len + ETH_CRC_LEN;
 	mbuf->data_len = info->pkt_len + ETH_CRC_LEN;
 
-	/* Setup payload */
-	if (info->proto == IPPROTO_TCP) {
-		len = info->pkt_len - sizeof(struct ether_hdr)
-							- sizeof(struct tcpip_hdr);
-	} else {
-		len = info->pkt_len - sizeof(struct ether_hdr)
-							- sizeof(struct udpip_hdr);
-	}
-	payload = rte_pktmbuf_mtod_offset(mbuf, uint8_t *,
-					sizeof(struct ether_hdr) + sizeof(struct tcpip_hdr));
-	memset(payload, 0, len);
+	__fill_buf(rte_pktmbuf_mtod(mbuf, uint8_t *), info);
+}
 
-	/* Setup TCP/UDP+IP */
-	if (info->proto == IPPROTO_TCP) {
-		struct tcpip_hdr *tcpip = NULL;
+bool pkt_seq_build_tmpl(struct pkt_seq_info *info, struct pkt_tmpl *tmpl)
+{
+	if (info == NULL || tmpl == NULL) {
+		LOG_ERROR("Wrong data to build packet template");
+		return false;
+	}
 
-		tcpip = rte_pktmbuf_mtod_offset(mbuf, struct tcpip_hdr*,
-						sizeof(struct ether_hdr));
-		pkt_seq_setup_tcpip(info, tcpip);
+	if (info->pkt_len + ETH_CRC_LEN > PKT_TMPL_MAX
+			|| info->pkt_len < sizeof(struct ether_hdr)
+								+ sizeof(struct tcpip_hdr)) {
+		LOG_ERROR("Packet length %u out of range", info->pkt_len);
+		return false;
+	}
 
-	} else {
-		struct udpip_hdr *udpip;
+	memset(tmpl, 0, sizeof(struct pkt_tmpl));
+	__fill_buf(tmpl->data, info);
+	tmpl->len = info->pkt_len + ETH_CRC_LEN;
+	return true;
+}
 
-		udpip = rte_pktmbuf_mtod_offset(mbuf, struct udpip_hdr*,
-						sizeof(struct ether_hdr));
-		pkt_seq_setup_udpip(info, udpip);
-	}
+/*
+ * A probe is an IPv4 (with a 20-byte header) UDP packet carrying the
+ * probe magic. Both 16-byte words below are compared at once under a mask:
+ * the first starts at the ethertype and covers IP version and protocol,
+ * the second ends with the magic.
+ */
+#define CLS_OFF_HDR offsetof(struct ether_hdr, ether_type)
+#define CLS_OFF_MAGIC (offsetof(struct pkt_probe, probe_magic) + 4 - 16)
+
+#if defined(RTE_ARCH_X86)
+static inline uint32_t __is_probe(const uint8_t *data)
+{
+	/* ETHER_TYPE_IPv4 in network order */
+	const xmm_t hdr_pat = _mm_setr_epi8(0x08, 0x00, IP_VHL_DEF,
+					0, 0, 0, 0, 0, 0, 0, 0, IPPROTO_UDP, 0, 0, 0, 0);
+	const xmm_t hdr_mask = _mm_setr_epi8(-1, -1, -1,
+					0, 0, 0, 0, 0, 0, 0, 0, -1, 0, 0, 0, 0);
+	const xmm_t magic_pat = _mm_set_epi32(PKT_PROBE_MAGIC, 0, 0, 0);
+	const xmm_t magic_mask = _mm_set_epi32(-1, 0, 0, 0);
+	xmm_t hdr, magic, diff;
+
+	hdr = _mm_loadu_si128((const xmm_t *)(data + CLS_OFF_HDR));
+	magic = _mm_loadu_si128((const xmm_t *)(data + CLS_OFF_MAGIC));
+	diff = _mm_or_si128(
+			_mm_and_si128(_mm_xor_si128(hdr, hdr_pat), hdr_mask),
+			_mm_and_si128(_mm_xor_si128(magic, magic_pat), magic_mask));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128()))
+					== 0xffff;
+}
+#else
+static inline uint32_t __is_probe(const uint8_t *data)
+{
+	const struct pkt_probe *probe = (const struct pkt_probe *)data;
 
-	/* Setup Ethernet header */
-	eth_hdr = rte_pktmbuf_mtod(mbuf, struct ether_hdr*);
-	ether_addr_copy(&mac_src, &eth_hdr->s_addr);
-	ether_addr_copy(&mac_dst, &eth_hdr->d_addr);
-	eth_hdr->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+	return (probe->eth_hdr.ether_type == rte_cpu_to_be_16(ETHER_TYPE_IPv4))
+			& (probe->udpip_hdr.ip.version_ihl == IP_VHL_DEF)
+			& (probe->udpip_hdr.ip.next_proto_id == IPPROTO_UDP)
+			& (probe->probe_magic == PKT_PROBE_MAGIC);
+}
+#endif
 
-	/* Setup Eth FCS */
-	crc = rte_pktmbuf_mtod_offset(mbuf, uint32_t*, info->pkt_len);
-	*crc = rte_hash_crc(rte_pktmbuf_mtod(mbuf, void *),
-					info->pkt_len, 0);
+uint32_t pkt_seq_classify(struct rte_mbuf **pkts, uint16_t nb_pkts)
+{
+	uint32_t mask = 0, len_ok = 0;
+	uint16_t i = 0;
+
+	/* the mbufs come from another process, none of them is cached */
+	for (i = 0; i < nb_pkts; i++)
+		rte_prefetch0(pkts[i]);
+	for (i = 0; i < nb_pkts; i++)
+		rte_prefetch0(rte_pktmbuf_mtod(pkts[i], void *));
+
+	/* the loads may read past the end of a short packet, but not past
+	 * its mbuf buffer, and the length check rejects it */
+	for (i = 0; i < nb_pkts; i++) {
+		len_ok = (pkts[i]->data_len >= sizeof(struct pkt_probe));
+		mask |= (__is_probe(rte_pktmbuf_mtod(pkts[i], uint8_t *))
+						& len_ok) << i;
+	}
+	return mask;
 }
 
-int pkt_seq_get_idx(struct rte_mbuf *pkt, uint32_t *idx)
+int pkt_seq_get_idx(struct rte_mbuf *pkt, uint16_t *cls, uint32_t *idx,
+				uint64_t *send_cycle)
 {
 	struct ether_hdr *eth_hdr = NULL;
 	struct ipv4_hdr *ip_hdr = NULL;
@@ -267,6 +340,8 @@ int pkt_seq_get_idx(struct rte_mbuf *pkt, uint32_t *idx)
 		return -1;
 	}
 
+	*cls = probe->probe_class;
 	*idx = probe->probe_idx;
+	*send_cycle = probe->send_cycle;
 	return 0;
 }
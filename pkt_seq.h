@@ -2,7 +2,9 @@
 #define _PERF_PKT_SEQ_H_
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <arpa/inet.h>
 #include <rte_ether.h>
 #include <rte_eth_ctrl.h>
@@ -10,6 +12,10 @@
 #include <rte_udp.h>
 #include <rte_tcp.h>
 #include <rte_mbuf.h>
+#include <rte_memcpy.h>
+#include <rte_hash_crc.h>
+
+#include "cksum.h"
 
 enum {
 	DEV_TYPE_DPDKR = 0,
@@ -32,6 +38,13 @@ struct pkt_seq_info {
 #define PKT_PROBE_MAGIC 0x12345678
 #define PKT_PROBE_INITVAL 7
 
+/* Concurrent probe streams, each with its own statistics. The last one
+ * is kept for the in-band samples of the data packets. */
+#define PKT_PROBE_CLASS_MAX 8
+#define PKT_PROBE_CLASS_INBAND (PKT_PROBE_CLASS_MAX - 1)
+
+#define PKT_TRAILER_MAGIC 0x5452424e
+
 struct tcpip_hdr {
 	struct ipv4_hdr ip;
 	struct tcp_hdr tcp;
@@ -42,14 +55,32 @@ struct udpip_hdr {
 	struct udp_hdr udp;
 };
 
+/* Packed so that the smallest probe, 60 bytes, holds all of it before
+ * the FCS. Offsets in the frame: probe_class 42, probe_idx 44,
+ * probe_magic 48, send_cycle 52 (56 in captures taken before packing). */
+#define PKT_PROBE_SEND_CYCLE_OFF 52
+
 struct pkt_probe {
 	struct ether_hdr eth_hdr;
 	struct udpip_hdr udpip_hdr;
+	uint16_t probe_class;
 	uint32_t probe_idx;
 	uint32_t probe_magic;
 	uint64_t send_cycle;
-//	uint8_t pad[10];
-};
+} __attribute__((__packed__));
+
+/*
+ * In-band sample: the last bytes of a data packet before the FCS, in any
+ * protocol. The magic comes last so that RX finds it from the frame end.
+ * Each TX lcore numbers its samples on its own, idx counts within sender.
+ */
+struct pkt_trailer {
+	uint64_t send_cycle;
+	uint32_t idx;
+	uint16_t cls;
+	uint16_t sender;	/* TX lcore inst */
+	uint32_t magic;
+} __attribute__((__packed__));
 
 #define IPv4(a, b, c, d)   ((uint32_t)(((a) & 0xff) << 24) |   \
 			    (((b) & 0xff) << 16) |	\
@@ -72,6 +103,7 @@ struct pkt_probe {
 #define PKT_SEQ_TCP_WINDOW 8192
 
 #define PKT_SEQ_PROBE_PKT_LEN 60
+#define PKT_SEQ_PROBE_PKT_MAX (PKT_TMPL_MAX - ETH_CRC_LEN)
 #define PKT_SEQ_PROBE_PROTO IPPROTO_UDP
 #define PKT_SEQ_PROBE_PORT_SRC 3024
 #define PKT_SEQ_PROBE_PORT_DST 3024
@@ -88,15 +120,239 @@ void pkt_seq_setup_udpip(struct pkt_seq_info *info,
 void pkt_seq_setup_tcpip(struct pkt_seq_info *info,
 				struct tcpip_hdr *tcpip);
 
-struct pkt_probe *pkt_seq_create_probe(void);
+/* Headers of the probes of class cls, info->pkt_len without FCS */
+struct pkt_probe *pkt_seq_create_probe(const struct pkt_seq_info *info,
+				uint16_t cls);
 
-int pkt_seq_get_idx(struct rte_mbuf *pkt, uint32_t *idx);
+int pkt_seq_get_idx(struct rte_mbuf *pkt, uint16_t *cls, uint32_t *idx,
+				uint64_t *send_cycle);
+
+/* Most packets pkt_seq_classify takes at once, one bit each */
+#define PKT_SEQ_CLASSIFY_MAX 32
+
+/*
+ * Tell the probes of a received burst from data packets, with the same
+ * checks as pkt_seq_get_idx. Returns a mask with bit i set if pkts[i] is
+ * a probe. The headers of all the burst are prefetched first.
+ */
+uint32_t pkt_seq_classify(struct rte_mbuf **pkts, uint16_t nb_pkts);
 
 void pkt_seq_fill_mbuf(struct rte_mbuf *mbuf,
 				struct pkt_seq_info *info);
 
 #define ETH_CRC_LEN 4
 
+/* Largest frame (including FCS) a template can hold */
+#define PKT_TMPL_MAX (ETHER_MAX_LEN)
+
+/* Pre-built frame, copied verbatim into mbufs on the TX path */
+struct pkt_tmpl {
+	uint16_t len;	/* frame length including FCS */
+	uint8_t data[PKT_TMPL_MAX] __rte_cache_aligned;
+};
+
+bool pkt_seq_build_tmpl(struct pkt_seq_info *info, struct pkt_tmpl *tmpl);
+
+static inline void pkt_seq_tmpl_to_mbuf(const struct pkt_tmpl *tmpl,
+				struct rte_mbuf *pkt)
+{
+	pkt->pkt_len = tmpl->len;
+	pkt->data_len = tmpl->len;
+	rte_memcpy(rte_pktmbuf_mtod(pkt, void *), tmpl->data, tmpl->len);
+}
+
+/* Copy the first len bytes (FCS included) of a larger template, the
+ * headers still describe the template length until pkt_seq_set_len */
+static inline void pkt_seq_tmpl_to_mbuf_len(const struct pkt_tmpl *tmpl,
+				struct rte_mbuf *pkt, uint16_t len)
+{
+	pkt->pkt_len = len;
+	pkt->data_len = len;
+	rte_memcpy(rte_pktmbuf_mtod(pkt, void *), tmpl->data,
+					len - ETH_CRC_LEN);
+}
+
+/*
+ * Set the IPv4 and UDP lengths of a frame cut from a larger template to
+ * its data_len (FCS included), updating both checksums for them. The
+ * payload is zero, so only the length fields and the pseudo header change.
+ */
+static inline void pkt_seq_set_len(struct rte_mbuf *pkt)
+{
+	uint8_t *data = rte_pktmbuf_mtod(pkt, uint8_t *);
+	struct ipv4_hdr *ip = (struct ipv4_hdr *)(data + sizeof(struct ether_hdr));
+	struct tcp_hdr *tcp = (struct tcp_hdr *)(ip + 1);
+	struct udp_hdr *udp = (struct udp_hdr *)(ip + 1);
+	uint16_t ip_len = rte_cpu_to_be_16(pkt->data_len - ETH_CRC_LEN
+					- sizeof(struct ether_hdr));
+	uint16_t l4_len = rte_cpu_to_be_16(pkt->data_len - ETH_CRC_LEN
+					- sizeof(struct ether_hdr) - sizeof(struct ipv4_hdr));
+	uint16_t old_l4_len = rte_cpu_to_be_16(rte_be_to_cpu_16(ip->total_length)
+					- sizeof(struct ipv4_hdr));
+	uint16_t cksum = 0;
+
+	ip->hdr_checksum = cksum_update16(ip->hdr_checksum, ip->total_length,
+					ip_len);
+	ip->total_length = ip_len;
+
+	if (ip->next_proto_id == IPPROTO_TCP) {
+		tcp->cksum = cksum_update16(tcp->cksum, old_l4_len, l4_len);
+	} else if (ip->next_proto_id == IPPROTO_UDP) {
+		/* the length is in the header and in the pseudo header */
+		if (udp->dgram_cksum != 0) {
+			cksum = cksum_update16(udp->dgram_cksum, old_l4_len, l4_len);
+			cksum = cksum_update16(cksum, old_l4_len, l4_len);
+			udp->dgram_cksum = (cksum == 0) ? 0xffff : cksum;
+		}
+		udp->dgram_len = l4_len;
+	}
+}
+
+/* The FCS covers the whole frame, recompute it after any rewrite */
+static inline void pkt_seq_set_fcs(struct rte_mbuf *pkt)
+{
+	uint8_t *data = rte_pktmbuf_mtod(pkt, uint8_t *);
+
+	*(uint32_t *)(data + pkt->data_len - ETH_CRC_LEN) =
+			rte_hash_crc(data, pkt->data_len - ETH_CRC_LEN, 0);
+}
+
+/*
+ * Rewrite the addresses and ports (host order) of a frame copied from a
+ * template. The IPv4 and TCP/UDP checksums are updated incrementally
+ * (RFC 1624) from the old values; a zero UDP checksum stays disabled.
+ */
+static inline void pkt_seq_rewrite_flow(struct rte_mbuf *pkt,
+				uint32_t src_ip, uint32_t dst_ip,
+				uint16_t src_port, uint16_t dst_port)
+{
+	uint8_t *data = rte_pktmbuf_mtod(pkt, uint8_t *);
+	struct ipv4_hdr *ip = (struct ipv4_hdr *)(data + sizeof(struct ether_hdr));
+	struct tcp_hdr *tcp = (struct tcp_hdr *)(ip + 1);
+	struct udp_hdr *udp = (struct udp_hdr *)(ip + 1);
+	uint32_t sip = rte_cpu_to_be_32(src_ip), dip = rte_cpu_to_be_32(dst_ip);
+	uint16_t sp = rte_cpu_to_be_16(src_port), dp = rte_cpu_to_be_16(dst_port);
+	bool is_tcp = (ip->next_proto_id == IPPROTO_TCP);
+	uint16_t cksum = is_tcp ? tcp->cksum : udp->dgram_cksum;
+
+	/* TCP and UDP keep the ports at the same offsets */
+	if (is_tcp || cksum != 0) {
+		cksum = cksum_update32(cksum, ip->src_addr, sip);
+		cksum = cksum_update32(cksum, ip->dst_addr, dip);
+		cksum = cksum_update16(cksum, tcp->src_port, sp);
+		cksum = cksum_update16(cksum, tcp->dst_port, dp);
+		if (is_tcp) {
+			tcp->cksum = cksum;
+		} else {
+			udp->dgram_cksum = (cksum == 0) ? 0xffff : cksum;
+		}
+	}
+
+	ip->hdr_checksum = cksum_update32(ip->hdr_checksum, ip->src_addr, sip);
+	ip->hdr_checksum = cksum_update32(ip->hdr_checksum, ip->dst_addr, dip);
+	ip->src_addr = sip;
+	ip->dst_addr = dip;
+	tcp->src_port = sp;
+	tcp->dst_port = dp;
+}
+
+/* Write the send time into a probe, and its FCS which covers it */
+static inline void pkt_seq_stamp_probe(struct rte_mbuf *pkt, uint64_t cycle)
+{
+	struct pkt_probe *probe = rte_pktmbuf_mtod(pkt, struct pkt_probe *);
+	uint16_t len = pkt->data_len - ETH_CRC_LEN;
+
+	/* the FCS of the smallest probe must not land on send_cycle */
+	RTE_BUILD_BUG_ON(sizeof(struct pkt_probe) > PKT_SEQ_PROBE_PKT_LEN);
+	RTE_BUILD_BUG_ON(offsetof(struct pkt_probe, send_cycle)
+					!= PKT_PROBE_SEND_CYCLE_OFF);
+
+	probe->send_cycle = cycle;
+	*(uint32_t *)((uint8_t *)probe + len) =
+			rte_hash_crc(probe, len, PKT_PROBE_INITVAL);
+}
+
+/* Whether the payload of an IPv4 TCP/UDP frame can hold a trailer */
+static inline bool pkt_seq_trailer_fits(struct rte_mbuf *pkt)
+{
+	uint8_t *data = rte_pktmbuf_mtod(pkt, uint8_t *);
+	struct ipv4_hdr *ip = (struct ipv4_hdr *)(data + sizeof(struct ether_hdr));
+	struct tcp_hdr *tcp = (struct tcp_hdr *)(ip + 1);
+	uint16_t hdr_len = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr);
+
+	if (ip->next_proto_id == IPPROTO_TCP)
+		hdr_len += (tcp->data_off >> 4) * 4;
+	else
+		hdr_len += sizeof(struct udp_hdr);
+	return pkt->data_len >= hdr_len + sizeof(struct pkt_trailer)
+					+ ETH_CRC_LEN;
+}
+
+/*
+ * Write a trailer into the end of the payload of a frame built on the TX
+ * path, updating the TCP/UDP checksum from the bytes it replaces (RFC
+ * 1624) and the FCS. May be called again on the same frame.
+ */
+static inline void pkt_seq_stamp_trailer(struct rte_mbuf *pkt, uint16_t cls,
+				uint16_t sender, uint32_t idx, uint64_t cycle)
+{
+	uint8_t *data = rte_pktmbuf_mtod(pkt, uint8_t *);
+	struct ipv4_hdr *ip = (struct ipv4_hdr *)(data + sizeof(struct ether_hdr));
+	struct tcp_hdr *tcp = (struct tcp_hdr *)(ip + 1);
+	struct udp_hdr *udp = (struct udp_hdr *)(ip + 1);
+	uint16_t off = pkt->data_len - ETH_CRC_LEN - sizeof(struct pkt_trailer);
+	struct pkt_trailer *t = (struct pkt_trailer *)(data + off);
+	struct pkt_trailer old = *t;
+	struct pkt_trailer new = {
+		.send_cycle = cycle,
+		.idx = idx,
+		.cls = cls,
+		.sender = sender,
+		.magic = PKT_TRAILER_MAGIC,
+	};
+	bool is_tcp = (ip->next_proto_id == IPPROTO_TCP);
+	uint16_t cksum = is_tcp ? tcp->cksum : udp->dgram_cksum;
+	uint32_t diff = 0;
+
+	*t = new;
+
+	if (is_tcp || cksum != 0) {
+		diff = cksum_add(&new, sizeof(new), 0)
+				+ (uint16_t)~cksum_fold(cksum_add(&old, sizeof(old), 0));
+		diff = cksum_fold(diff);
+		/* words starting at an odd offset of the segment sum swapped */
+		if ((off - sizeof(struct ether_hdr) - sizeof(struct ipv4_hdr)) & 1)
+			diff = rte_bswap16(diff);
+		cksum = ~cksum_fold((uint16_t)~cksum + diff);
+		if (is_tcp) {
+			tcp->cksum = cksum;
+		} else {
+			udp->dgram_cksum = (cksum == 0) ? 0xffff : cksum;
+		}
+	}
+
+	pkt_seq_set_fcs(pkt);
+}
+
+/* Trailer of a received frame, NULL if it carries none */
+static inline const struct pkt_trailer *pkt_seq_get_trailer(
+				struct rte_mbuf *pkt)
+{
+	const struct pkt_trailer *t = NULL;
+
+	if (pkt->data_len < sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr)
+					+ sizeof(struct udp_hdr) + sizeof(struct pkt_trailer)
+					+ ETH_CRC_LEN)
+		return NULL;
+
+	t = rte_pktmbuf_mtod_offset(pkt, const struct pkt_trailer *,
+					pkt->data_len - ETH_CRC_LEN
+					- sizeof(struct pkt_trailer));
+	if (t->magic != PKT_TRAILER_MAGIC || t->cls >= PKT_PROBE_CLASS_MAX)
+		return NULL;
+	return t;
+}
+
 static inline bool copy_buf_to_pkt(void *buf, unsigned len,
 				struct rte_mbuf *pkt, unsigned offset)
 {
@@ -0,0 +1,140 @@
+#include "util.h"
+#include "pkt_size.h"
+#include "pcap.h"
+
+#define PKT_SIZE_SPEC_MAX 512
+
+#define PKT_SIZE_IMIX "64:7,594:4,1518:1"
+
+/* RFC 6985 IMIX genome letters */
+static const uint16_t genome_len[] = {
+	['a' - 'a'] = 64,
+	['b' - 'a'] = 128,
+	['c' - 'a'] = 256,
+	['d' - 'a'] = 512,
+	['e' - 'a'] = 1024,
+	['f' - 'a'] = 1280,
+	['g' - 'a'] = 1518,
+};
+
+/* Turn weights indexed by length - PKT_SIZE_MIN into the table */
+static bool __build(const double *weight, struct pkt_size_dist *dist)
+{
+	double w[PKT_SIZE_NB], sum = 0, bytes = 0;
+	uint32_t i = 0, n = 0;
+
+	for (i = 0; i < PKT_SIZE_NB; i++) {
+		if (weight[i] <= 0)
+			continue;
+		dist->len[n] = PKT_SIZE_MIN + i;
+		w[n] = weight[i];
+		sum += weight[i];
+		bytes += weight[i] * dist->len[n];
+		n++;
+	}
+	if (n == 0) {
+		LOG_ERROR("No packet size given");
+		return false;
+	}
+
+	dist->nb_sizes = n;
+	dist->max_len = dist->len[n - 1];
+	dist->mean_len = bytes / sum;
+	return alias_build(w, n, dist->alias_prob, dist->alias);
+}
+
+static bool __parse_len(int len)
+{
+	if (len < PKT_SIZE_MIN || len > PKT_SIZE_MAX) {
+		LOG_ERROR("Packet size %d out of [%u, %u]", len, PKT_SIZE_MIN,
+						PKT_SIZE_MAX);
+		return false;
+	}
+	return true;
+}
+
+static bool __parse_list(const char *spec, double *weight)
+{
+	char buf[PKT_SIZE_SPEC_MAX];
+	char *tok = NULL, *save = NULL, *colon = NULL, *end = NULL;
+	double w = 0;
+	int len = 0;
+
+	if (strlen(spec) >= sizeof(buf))
+		return false;
+	snprintf(buf, sizeof(buf), "%s", spec);
+
+	for (tok = strtok_r(buf, ",", &save); tok != NULL;
+					tok = strtok_r(NULL, ",", &save)) {
+		w = 1;
+		colon = strchr(tok, ':');
+		if (colon != NULL) {
+			*colon = '\0';
+			w = strtod(colon + 1, &end);
+			if (end == colon + 1 || *end != '\0' || w < 0)
+				return false;
+		}
+		if (!str_to_int(tok, 10, &len) || !__parse_len(len))
+			return false;
+		weight[len - PKT_SIZE_MIN] += w;
+	}
+	return true;
+}
+
+static bool __parse_genome(const char *letters, double *weight)
+{
+	const char *p = NULL;
+	unsigned int k = 0;
+
+	if (*letters == '\0')
+		return false;
+
+	for (p = letters; *p != '\0'; p++) {
+		k = *p - 'a';
+		if (*p < 'a' || k >= RTE_DIM(genome_len)) {
+			LOG_ERROR("Unsupported IMIX genome letter %c", *p);
+			return false;
+		}
+		weight[genome_len[k] - PKT_SIZE_MIN] += 1;
+	}
+	return true;
+}
+
+static bool __parse_pcap(const char *filename, double *weight)
+{
+	uint64_t cnt[PKT_SIZE_NB];
+	uint32_t i = 0;
+
+	memset(cnt, 0, sizeof(cnt));
+	if (!pcap_size_hist(filename, cnt, PKT_SIZE_MIN, PKT_SIZE_MAX))
+		return false;
+
+	for (i = 0; i < PKT_SIZE_NB; i++)
+		weight[i] = cnt[i];
+	return true;
+}
+
+bool pkt_size_parse(const char *spec, struct pkt_size_dist *dist)
+{
+	double weight[PKT_SIZE_NB];
+	bool ok = false;
+
+	memset(weight, 0, sizeof(weight));
+	memset(dist, 0, sizeof(struct pkt_size_dist));
+
+	if (strcmp(spec, "imix") == 0) {
+		ok = __parse_list(PKT_SIZE_IMIX, weight);
+	} else if (strncmp(spec, "genome:", 7) == 0) {
+		ok = __parse_genome(spec + 7, weight);
+	} else if (strncmp(spec, "pcap:", 5) == 0) {
+		ok = __parse_pcap(spec + 5, weight);
+	} else {
+		ok = __parse_list(spec, weight);
+	}
+
+	if (!ok || !__build(weight, dist)) {
+		LOG_ERROR("Wrong packet sizes %s", spec);
+		return false;
+	}
+	return true;
+}
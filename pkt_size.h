@@ -0,0 +1,48 @@
+#ifndef _PKTGEN_PKT_SIZE_H_
+#define _PKTGEN_PKT_SIZE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pkt_seq.h"
+#include "rate.h"
+#include "alias.h"
+
+/*
+ * Frame length distribution of the generated packets. Lengths include the
+ * FCS, as IMIX profiles are usually given. Packets are cut from a template
+ * built at the largest length, then their length fields are patched.
+ */
+#define PKT_SIZE_MIN 64
+#define PKT_SIZE_MAX PKT_TMPL_MAX
+#define PKT_SIZE_NB (PKT_SIZE_MAX - PKT_SIZE_MIN + 1)
+
+struct pkt_size_dist {
+	uint32_t nb_sizes;
+	uint16_t max_len;
+	double mean_len;
+	uint16_t len[PKT_SIZE_NB];
+	uint32_t alias_prob[PKT_SIZE_NB];
+	uint32_t alias[PKT_SIZE_NB];
+};
+
+/*
+ * Format, lengths in bytes with FCS:
+ *   imix				64:7,594:4,1518:1
+ *   genome:<letters>		RFC 6985, a=64 b=128 c=256 d=512 e=1024
+ *					f=1280 g=1518, one packet per letter
+ *   pcap:<path>			lengths seen on the wire in a capture
+ *   <len>[:<weight>][,...]	weighted list, weights default to 1
+ */
+bool pkt_size_parse(const char *spec, struct pkt_size_dist *dist);
+
+static inline uint16_t pkt_size_next(const struct pkt_size_dist *dist,
+				struct rate_ctl *rng)
+{
+	if (dist->nb_sizes == 1)
+		return dist->len[0];
+	return dist->len[alias_draw(dist->alias_prob, dist->alias,
+					dist->nb_sizes, rate_rand(rng))];
+}
+
+#endif /* _PKTGEN_PKT_SIZE_H_ */
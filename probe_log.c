@@ -0,0 +1,258 @@
+#include "util.h"
+#include "control.h"
+#include "stat.h"
+#include "probe_log.h"
+#include "tsc.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+
+/* One ring per EAL lcore, plus one for non-EAL threads */
+#define PROBE_RING_MAX (RTE_MAX_LCORE + 1)
+
+#define PROBE_WBUF_RECS (1 << 16)
+#define PROBE_LOG_POLL_USEC 1000
+
+struct probe_wbuf {
+	int fd;
+	uint32_t cnt;
+	struct probe_rec recs[PROBE_WBUF_RECS];
+};
+
+static struct probe_ring *rings[PROBE_RING_MAX];
+static struct probe_wbuf *wbuf[2];	/* RECORD_RX, RECORD_TX */
+
+static pthread_t writer_tid;
+static bool writer_running = false;
+static bool writer_stop = false;
+
+static bool __write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret = 0;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+static void __flush(struct probe_wbuf *b)
+{
+	if (b->cnt == 0)
+		return;
+
+	if (!__write_all(b->fd, b->recs, sizeof(struct probe_rec) * b->cnt))
+		LOG_ERROR("Failed to write %u probe records", b->cnt);
+	b->cnt = 0;
+}
+
+/* Move everything available in ring r into the write buffers */
+static unsigned int __drain(struct probe_ring *r)
+{
+	uint64_t head = 0, tail = r->tail;
+	struct probe_rec *rec = NULL;
+	struct probe_wbuf *b = NULL;
+	unsigned int cnt = 0;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	for (; tail != head; tail++, cnt++) {
+		rec = &r->recs[tail & PROBE_RING_MASK];
+		b = wbuf[(rec->type == RECORD_RX) ? 0 : 1];
+		b->recs[b->cnt++] = *rec;
+		if (b->cnt == PROBE_WBUF_RECS)
+			__flush(b);
+	}
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	return cnt;
+}
+
+static void *__writer_run(void *arg __rte_unused)
+{
+	unsigned int i = 0, cnt = 0;
+	bool stop = false;
+
+	ctl_pin_off_lcores();
+
+	do {
+		stop = __atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE);
+
+		cnt = 0;
+		for (i = 0; i < PROBE_RING_MAX; i++) {
+			struct probe_ring *r = __atomic_load_n(&rings[i],
+							__ATOMIC_ACQUIRE);
+			if (r != NULL)
+				cnt += __drain(r);
+		}
+
+		if (cnt == 0 && !stop)
+			usleep(PROBE_LOG_POLL_USEC);
+	} while (!stop);
+
+	__flush(wbuf[0]);
+	__flush(wbuf[1]);
+	return NULL;
+}
+
+/* Header and lcore offsets, as the calibration found them */
+static bool __write_hdr(int fd, uint32_t type)
+{
+	struct probe_log_lcore ent[RTE_MAX_LCORE];
+	const struct tsc_lcore *tl = NULL;
+	struct probe_log_hdr hdr = {
+		.magic = PROBE_LOG_MAGIC,
+		.version = PROBE_LOG_VERSION,
+		.rec_size = sizeof(struct probe_rec),
+		.type = type,
+		.tsc_hz = tsc_get_hz(),
+		.tsc_hz_nominal = rte_get_tsc_hz(),
+		.tsc_invariant = tsc_is_invariant(),
+		.ref_lcore = tsc_ref_lcore(),
+	};
+	unsigned int lcore = 0, n = 0;
+
+	memset(ent, 0, sizeof(ent));
+	RTE_LCORE_FOREACH_SLAVE(lcore) {
+		tl = tsc_get_lcore(lcore);
+		ent[n].lcore = lcore;
+		ent[n].offset = tl->offset;
+		ent[n].rtt = tl->rtt;
+		n++;
+	}
+	hdr.nb_lcores = n;
+
+	return __write_all(fd, &hdr, sizeof(hdr))
+			&& __write_all(fd, ent, n * sizeof(struct probe_log_lcore));
+}
+
+static int __open_output(const char *prefix, const char *suffix,
+				uint32_t type)
+{
+	char buf[PATH_MAX];
+	int fd = -1;
+
+	snprintf(buf, sizeof(buf), "%s.%s", prefix, suffix);
+	fd = open(buf, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		LOG_ERROR("Failed to open probe output %s", buf);
+		return -1;
+	}
+
+	if (!__write_hdr(fd, type)) {
+		LOG_ERROR("Failed to write probe output %s", buf);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool probe_log_start(const char *prefix)
+{
+	unsigned int i = 0;
+
+	memset(rings, 0, sizeof(rings));
+	writer_stop = false;
+
+	for (i = 0; i < 2; i++) {
+		wbuf[i] = rte_zmalloc("pktgen: probe wbuf",
+						sizeof(struct probe_wbuf), 0);
+		if (wbuf[i] == NULL) {
+			LOG_ERROR("Failed to allocate probe write buffer");
+			goto close_free;
+		}
+		wbuf[i]->fd = -1;
+	}
+
+	wbuf[0]->fd = __open_output(prefix, "rx", RECORD_RX);
+	wbuf[1]->fd = __open_output(prefix, "tx", RECORD_TX);
+	if (wbuf[0]->fd < 0 || wbuf[1]->fd < 0)
+		goto close_free;
+
+	if (pthread_create(&writer_tid, NULL, __writer_run, NULL)) {
+		LOG_ERROR("Failed to create probe writer thread");
+		goto close_free;
+	}
+	writer_running = true;
+	return true;
+
+close_free:
+	for (i = 0; i < 2; i++) {
+		if (wbuf[i] != NULL && wbuf[i]->fd >= 0)
+			close(wbuf[i]->fd);
+		rte_free(wbuf[i]);
+		wbuf[i] = NULL;
+	}
+	return false;
+}
+
+uint64_t probe_log_get_drops(void)
+{
+	uint64_t drops = 0;
+	unsigned int i = 0;
+
+	for (i = 0; i < PROBE_RING_MAX; i++) {
+		struct probe_ring *r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+
+		if (r != NULL)
+			drops += __atomic_load_n(&r->drops, __ATOMIC_RELAXED);
+	}
+	return drops;
+}
+
+void probe_log_stop(void)
+{
+	unsigned int i = 0;
+
+	if (!writer_running)
+		return;
+
+	__atomic_store_n(&writer_stop, true, __ATOMIC_RELEASE);
+	pthread_join(writer_tid, NULL);
+	writer_running = false;
+
+	if (probe_log_get_drops() > 0)
+		LOG_INFO("%lu probe records dropped, writer fell behind",
+						(unsigned long)probe_log_get_drops());
+
+	for (i = 0; i < 2; i++) {
+		if (close(wbuf[i]->fd) != 0)
+			LOG_ERROR("Failed to close probe output");
+		rte_free(wbuf[i]);
+		wbuf[i] = NULL;
+	}
+
+	/* rings stay allocated, their producers may still be running */
+}
+
+struct probe_ring *probe_log_get_ring(void)
+{
+	unsigned int id = rte_lcore_id();
+	struct probe_ring *r = NULL;
+
+	if (id >= RTE_MAX_LCORE)
+		id = RTE_MAX_LCORE;
+
+	r = __atomic_load_n(&rings[id], __ATOMIC_ACQUIRE);
+	if (r != NULL)
+		return r;
+
+	r = rte_zmalloc_socket("pktgen: probe ring", sizeof(struct probe_ring),
+					RTE_CACHE_LINE_SIZE, rte_socket_id());
+	if (r == NULL) {
+		LOG_ERROR("Failed to allocate probe ring");
+		return NULL;
+	}
+	__atomic_store_n(&rings[id], r, __ATOMIC_RELEASE);
+	return r;
+}
@@ -0,0 +1,103 @@
+#ifndef _PKTGEN_PROBE_LOG_H_
+#define _PKTGEN_PROBE_LOG_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <rte_memory.h>
+
+/*
+ * Raw probe records. Each producer (an RX lcore, or the thread sending
+ * probes) owns a single-producer/single-consumer ring; a writer thread
+ * drains all rings into <prefix>.rx and <prefix>.tx with large write()s.
+ *
+ * Output file layout: a probe_log_hdr, nb_lcores probe_log_lcore entries,
+ * then probe_rec records, all in host byte order. The cycles of the records
+ * are on the TSC of ref_lcore: the lcore offsets are already removed, and
+ * are only kept to tell how the records were corrected.
+ */
+#define PROBE_LOG_MAGIC 0x50424c47	/* "GLBP" */
+#define PROBE_LOG_VERSION 4
+
+struct probe_log_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rec_size;
+	uint32_t type;		/* RECORD_RX or RECORD_TX */
+	uint64_t tsc_hz;	/* measured, rte_get_tsc_hz() before version 3 */
+
+	/* since version 3 */
+	uint64_t tsc_hz_nominal;	/* rte_get_tsc_hz() */
+	uint32_t tsc_invariant;
+	uint32_t ref_lcore;
+	uint32_t nb_lcores;
+	uint32_t pad;
+};
+
+/* An lcore other than ref_lcore */
+struct probe_log_lcore {
+	uint32_t lcore;
+	uint32_t pad;
+	int64_t offset;		/* its TSC minus that of ref_lcore, in cycles */
+	uint64_t rtt;		/* round trip of the measurement, twice the error */
+};
+
+struct probe_rec {
+	uint32_t idx;		/* counts within the probe class and sender */
+	uint8_t type;		/* RECORD_RX or RECORD_TX, 16 bits before version 4 */
+	uint8_t sender;		/* TX lcore of an in-band sample, since version 4 */
+	uint16_t cls;		/* probe class, since version 2 */
+	uint64_t cycle;
+};
+
+#define PROBE_RING_SIZE (1 << 16)
+#define PROBE_RING_MASK (PROBE_RING_SIZE - 1)
+
+struct probe_ring {
+	/* producer side */
+	uint64_t head __rte_cache_aligned;
+	uint64_t tail_cache;
+	uint64_t drops;
+
+	/* consumer side */
+	uint64_t tail __rte_cache_aligned;
+
+	struct probe_rec recs[PROBE_RING_SIZE] __rte_cache_aligned;
+};
+
+bool probe_log_start(const char *prefix);
+
+/* Drain every ring, flush the files and stop the writer thread */
+void probe_log_stop(void);
+
+/* Get the ring of the calling thread, call after probe_log_start */
+struct probe_ring *probe_log_get_ring(void);
+
+/* Number of records dropped because a ring was full */
+uint64_t probe_log_get_drops(void);
+
+/* Never blocks: the record is dropped if the writer is behind */
+static inline void probe_log_put(struct probe_ring *r, uint16_t cls,
+				uint16_t sender, uint32_t idx, uint16_t type,
+				uint64_t cycle)
+{
+	uint64_t head = r->head;
+	struct probe_rec *rec = NULL;
+
+	if (head - r->tail_cache >= PROBE_RING_SIZE) {
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head - r->tail_cache >= PROBE_RING_SIZE) {
+			__atomic_store_n(&r->drops, r->drops + 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	rec = &r->recs[head & PROBE_RING_MASK];
+	rec->idx = idx;
+	rec->type = type;
+	rec->sender = sender;
+	rec->cls = cls;
+	rec->cycle = cycle;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* _PKTGEN_PROBE_LOG_H_ */
@@ -1,35 +1,108 @@
 #include "util.h"
 #include "rate.h"
 
+#include <math.h>
 #include <rte_cycles.h>
+#include <rte_common.h>
+#include <rte_version.h>
+#if RTE_VERSION >= RTE_VERSION_NUM(17, 5, 0, 0)
+#include <rte_pause.h>
+#endif
 
 #define USEC_PER_SEC	1000000
 
+/* Credit carried over when sending late is capped to this many usec, so
+ * that an idle period is not followed by a long catch-up burst */
+#define RATE_MAX_LAG_USEC 100
+
+/* Hybrid waits stop sleeping this long before the deadline, which covers
+ * the default 50us kernel timer slack plus the wakeup latency */
+#define RATE_SPIN_USEC 80
+
+static const char *wait_name[RATE_WAIT_MAX] = {
+	[RATE_WAIT_SLEEP] = "sleep",
+	[RATE_WAIT_SPIN] = "spin",
+	[RATE_WAIT_HYBRID] = "hybrid",
+};
+
+static const char *dist_name[RATE_DIST_MAX] = {
+	[RATE_DIST_CONST] = "const",
+	[RATE_DIST_EXP] = "exp",
+	[RATE_DIST_UNIFORM] = "uniform",
+	[RATE_DIST_PARETO] = "pareto",
+};
+
 /* - Cycles per second */
 static uint64_t cycle_per_sec = 0;
 
+/* -ln(u) at the middle of 2^RATE_EXP_BITS slices of (0, 1), scaled so
+ * that the table mean is exactly 1. Read only once built. */
+#define RATE_EXP_SIZE (1 << RATE_EXP_BITS)
+static uint32_t exp_tbl[RATE_EXP_SIZE];
+static bool exp_tbl_ready = false;
+
+static void __build_exp_tbl(void)
+{
+	double val[RATE_EXP_SIZE], sum = 0;
+	unsigned int i = 0;
+
+	if (exp_tbl_ready)
+		return;
+
+	for (i = 0; i < RATE_EXP_SIZE; i++) {
+		val[i] = -log((i + 0.5) / RATE_EXP_SIZE);
+		sum += val[i];
+	}
+	for (i = 0; i < RATE_EXP_SIZE; i++)
+		exp_tbl[i] = (uint32_t)(val[i] * RATE_EXP_SIZE / sum
+						* (1 << RATE_EXP_SHIFT) + 0.5);
+	exp_tbl_ready = true;
+}
+
+static inline uint32_t __rand_exp(struct rate_ctl *rate)
+{
+	return exp_tbl[rate_rand(rate) >> (64 - RATE_EXP_BITS)];
+}
+
+static uint64_t __splitmix(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
 static uint64_t __get_cycle_per_byte(uint64_t tx_bps)
 {
 	if (cycle_per_sec == 0) {
 		cycle_per_sec = rte_get_tsc_hz();
 	}
 
-	return (cycle_per_sec / (tx_bps / 8));
+	if (tx_bps == 0)
+		return 0;
+
+	/* cycles per byte = hz * 8 / bps, kept with 32 fractional bits */
+	return (uint64_t)((((unsigned __int128)cycle_per_sec * 8)
+						<< RATE_FP_SHIFT) / tx_bps);
+}
+
+uint64_t rate_bps_to_cpb(uint64_t bps)
+{
+	return __get_cycle_per_byte(bps);
 }
 
-/* Format: e.g 1000k => 1000 kbps, 2m => 2 mbps,
+/* Format: e.g 1000k => 1000 kbps, 2m => 2 mbps, 1.5g => 1.5 gbps,
  * 			   128 => 128 bps
  */
-bool rate_set_rate(const char *rate_str, 
-						struct rate_ctl *rate)
+bool rate_parse_bps(const char *rate_str, uint64_t *bps)
 {
-	long val = 0;
+	double val = 0;
 	char *unit = NULL;
 	uint64_t tx_rate = 0;
 
-	memset(rate, 0, sizeof(struct rate_ctl));
-
-	val = strtol(rate_str, &unit, 10);
+	errno = 0;
+	val = strtod(rate_str, &unit);
 	if (errno == EINVAL || errno == ERANGE
 					|| unit == rate_str) {
 		LOG_ERROR("Failed to parse TX rate %s", rate_str);
@@ -37,47 +110,251 @@ bool rate_set_rate(const char *rate_str,
 	}
 
 	if (val < 0) {
-		LOG_ERROR("Wrong rate value %ld", val);
+		LOG_ERROR("Wrong rate value %lf", val);
 		return false;
 	}
 
 	switch(*unit) {
 		case 'k':	case 'K':
-			tx_rate = val << 10;
+			tx_rate = val * (1ULL << 10);
 			break;
 		case 'm':	case 'M':
-			tx_rate = val << 20;
+			tx_rate = val * (1ULL << 20);
 			break;
 		case 'g':	case 'G':
-			tx_rate = val << 40;
+			tx_rate = val * (1ULL << 30);
 			break;
 		default:
 			tx_rate = val;
 	}
 
-	rate->rate_bps = tx_rate;
-	rate->cycle_per_byte = __get_cycle_per_byte(tx_rate);
+	*bps = tx_rate;
+	return true;
+}
+
+bool rate_set_rate(const char *rate_str,
+						struct rate_ctl *rate)
+{
+	uint64_t tx_rate = 0;
+
+	memset(rate, 0, sizeof(struct rate_ctl));
+
+	if (!rate_parse_bps(rate_str, &tx_rate))
+		return false;
+
+	rate_set_bps(rate, tx_rate);
+	LOG_INFO("bps %lu, hz %lu, cycle_per_byte %.6lf", tx_rate,
+					cycle_per_sec, (double)rate->cycle_per_byte
+									/ (1ULL << RATE_FP_SHIFT));
+	return true;
+}
+
+void rate_set_bps(struct rate_ctl *rate, uint64_t bps)
+{
+	rate->rate_bps = bps;
+	rate->cycle_per_byte = __get_cycle_per_byte(bps);
 	rate->next_tx_cycle = 0;
-	LOG_INFO("bps %lu, hz %lu, cycle_per_byte %lu", tx_rate,
-					cycle_per_sec, rate->cycle_per_byte);
+	rate->next_tx_frac = 0;
+}
+
+void rate_set_cpb(struct rate_ctl *rate, uint64_t cpb, uint64_t cur_cycle)
+{
+	uint64_t old = rate->cycle_per_byte;
+
+	if (cpb == old)
+		return;
+
+	if (old == RATE_CPB_PAUSED || old == 0 || cpb == 0) {
+		rate->next_tx_cycle = cur_cycle;
+		rate->next_tx_frac = 0;
+	} else if (cpb != RATE_CPB_PAUSED && rate->next_tx_cycle > cur_cycle) {
+		/* the pending gap was computed with the old slope, rescale it */
+		rate->next_tx_cycle = cur_cycle + (uint64_t)((unsigned __int128)
+						(rate->next_tx_cycle - cur_cycle) * cpb / old);
+		rate->next_tx_frac = 0;
+	}
+	rate->cycle_per_byte = cpb;
+}
+
+bool rate_parse_dist(const char *str, struct rate_dist *dist)
+{
+	double val = 0, mean = 0;
+	char *end = NULL;
+
+	memset(dist, 0, sizeof(struct rate_dist));
+
+	if (strcmp(str, "const") == 0) {
+		dist->type = RATE_DIST_CONST;
+	} else if (strcmp(str, "exp") == 0) {
+		dist->type = RATE_DIST_EXP;
+	} else if (strncmp(str, "uniform", 7) == 0
+			&& (str[7] == '\0' || str[7] == ':')) {
+		dist->type = RATE_DIST_UNIFORM;
+		val = 1;
+		if (str[7] == ':') {
+			val = strtod(str + 8, &end);
+			if (end == str + 8 || *end != '\0' || val < 0 || val > 1)
+				goto close_error;
+		}
+		dist->jitter = (uint32_t)(val * (1 << RATE_EXP_SHIFT));
+	} else if (strncmp(str, "pareto:", 7) == 0) {
+		dist->type = RATE_DIST_PARETO;
+		dist->shape = RATE_PARETO_SHAPE_DEF;
+		mean = strtod(str + 7, &end);
+		if (end == str + 7 || mean < 1)
+			goto close_error;
+		if (*end == ':') {
+			val = strtod(end + 1, &end);
+			dist->shape = val;
+		}
+		if (*end != '\0' || dist->shape <= 1)
+			goto close_error;
+
+		/* E[X] = shape * x_min / (shape - 1) */
+		dist->burst_min = mean * (dist->shape - 1) / dist->shape;
+	} else {
+		goto close_error;
+	}
+
+	__build_exp_tbl();
 	return true;
+
+close_error:
+	LOG_ERROR("Wrong arrival process %s", str);
+	return false;
+}
+
+const char *rate_dist_name(unsigned type)
+{
+	return (type < RATE_DIST_MAX) ? dist_name[type] : "unknown";
+}
+
+void rate_set_dist(struct rate_ctl *rate, const struct rate_dist *dist,
+				uint64_t seed)
+{
+	rate->dist = *dist;
+	rate->rng[0] = __splitmix(&seed);
+	rate->rng[1] = __splitmix(&seed);
+	rate->burst_left = 0;
+	rate->burst_debt = 0;
+}
+
+/* Pareto x_min * u^(-1/shape), with -ln(u) taken from the table */
+static uint64_t __pareto_burst(struct rate_ctl *rate)
+{
+	double e = (double)__rand_exp(rate) / (1 << RATE_EXP_SHIFT);
+	double len = rate->dist.burst_min * exp(e / rate->dist.shape);
+
+	return (len < 1) ? 1 : (uint64_t)len;
+}
+
+/* keep the credit of small delays so the average rate stays exact,
+ * restart from now after a long stall */
+static inline void __catch_up(struct rate_ctl *rate, uint64_t cur_cycle)
+{
+	if (cur_cycle > rate->next_tx_cycle
+					+ RATE_MAX_LAG_USEC * (cycle_per_sec / USEC_PER_SEC)) {
+		rate->next_tx_cycle = cur_cycle;
+		rate->next_tx_frac = 0;
+	}
 }
 
 void rate_set_next_cycle(struct rate_ctl *rate,
-				uint64_t cur_cycle, uint16_t pkt_len)
+				uint64_t cur_cycle, uint64_t bytes, unsigned int pkts)
+{
+	unsigned __int128 gap = 0;
+	uint64_t factor = 0;
+
+	gap = (unsigned __int128)(bytes + (uint64_t)pkts * rate->overhead)
+				* rate->cycle_per_byte;
+
+	switch (rate->dist.type) {
+		case RATE_DIST_EXP:
+			__catch_up(rate, cur_cycle);
+			gap = (gap * __rand_exp(rate)) >> RATE_EXP_SHIFT;
+			break;
+		case RATE_DIST_UNIFORM:
+			/* 1 - jitter + 2 * jitter * u */
+			__catch_up(rate, cur_cycle);
+			factor = (1ULL << RATE_EXP_SHIFT) - rate->dist.jitter
+					+ ((2 * (uint64_t)rate->dist.jitter
+						* (rate_rand(rate) >> (64 - RATE_EXP_SHIFT)))
+							>> RATE_EXP_SHIFT);
+			gap = (gap * factor) >> RATE_EXP_SHIFT;
+			break;
+		case RATE_DIST_PARETO:
+			/* a burst leaves back to back from its start, then
+			 * waits for the gaps of all its packets */
+			if (rate->burst_debt == 0)
+				__catch_up(rate, cur_cycle);
+			rate->burst_debt += gap;
+			if (rate->burst_left > pkts) {
+				rate->burst_left -= pkts;
+				return;
+			}
+			gap = rate->burst_debt;
+			rate->burst_debt = 0;
+			rate->burst_left = __pareto_burst(rate);
+			break;
+		default:
+			__catch_up(rate, cur_cycle);
+	}
+
+	gap += rate->next_tx_frac;
+	rate->next_tx_cycle += (uint64_t)(gap >> RATE_FP_SHIFT);
+	rate->next_tx_frac = (uint64_t)gap & RATE_FP_MASK;
+}
+
+bool rate_parse_wait(const char *str, unsigned *mode)
+{
+	unsigned int i = 0;
+
+	for (i = 0; i < RATE_WAIT_MAX; i++) {
+		if (strcmp(str, wait_name[i]) == 0) {
+			*mode = i;
+			return true;
+		}
+	}
+	LOG_ERROR("Unknown wait mode %s", str);
+	return false;
+}
+
+const char *rate_wait_name(unsigned mode)
+{
+	return (mode < RATE_WAIT_MAX) ? wait_name[mode] : "unknown";
+}
+
+static inline void __spin_until(uint64_t next_cycle)
 {
-	rate->next_tx_cycle =  cur_cycle + rate->cycle_per_byte * pkt_len;
+	while (rte_get_tsc_cycles() < next_cycle)
+		rte_pause();
 }
 
-void rate_wait_for_time(uint64_t next_cycle)
+void rate_wait_for_time(uint64_t next_cycle, unsigned mode)
 {
 	unsigned long time = 0;
-	uint64_t cur = 0;
+	uint64_t cur = 0, cycle_per_usec = 0;
+
+	if (cycle_per_sec == 0)
+		cycle_per_sec = rte_get_tsc_hz();
+	cycle_per_usec = cycle_per_sec / USEC_PER_SEC;
 
 	cur = rte_get_tsc_cycles();
 	if (cur >= next_cycle)
 		return;
 
-	time = (next_cycle - cur) / (cycle_per_sec / USEC_PER_SEC);
-	usleep(time);
+	time = (next_cycle - cur) / cycle_per_usec;
+
+	switch (mode) {
+		case RATE_WAIT_SPIN:
+			__spin_until(next_cycle);
+			break;
+		case RATE_WAIT_HYBRID:
+			if (time > RATE_SPIN_USEC)
+				usleep(time - RATE_SPIN_USEC);
+			__spin_until(next_cycle);
+			break;
+		default:
+			usleep(time);
+	}
 }
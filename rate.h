@@ -4,17 +4,115 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* cycle_per_byte is fixed-point with RATE_FP_SHIFT fractional bits */
+#define RATE_FP_SHIFT 32
+#define RATE_FP_MASK ((1ULL << RATE_FP_SHIFT) - 1)
+
+/* Preamble + SFD (8 bytes) and inter-frame gap (12 bytes) */
+#define RATE_L1_OVERHEAD 20
+
+/* How a thread waits for its next departure */
+enum {
+	RATE_WAIT_SLEEP = 0,	/* usleep only, for threads sharing a core */
+	RATE_WAIT_SPIN,		/* busy poll the TSC */
+	RATE_WAIT_HYBRID,	/* sleep until close to the deadline, then spin */
+	RATE_WAIT_MAX
+};
+
+/* Inter-arrival processes, all keep the mean rate */
+enum {
+	RATE_DIST_CONST = 0,	/* evenly spaced */
+	RATE_DIST_EXP,		/* exponential gaps (Poisson arrivals) */
+	RATE_DIST_UNIFORM,	/* gaps uniform around the mean */
+	RATE_DIST_PARETO,	/* back to back bursts of Pareto length */
+	RATE_DIST_MAX
+};
+
+/* Exponential samples come from a table of 2^RATE_EXP_BITS entries,
+ * fixed-point with RATE_EXP_SHIFT fractional bits */
+#define RATE_EXP_BITS 12
+#define RATE_EXP_SHIFT 24
+
+/* Pareto shape used when none is given */
+#define RATE_PARETO_SHAPE_DEF 1.5
+
+struct rate_dist {
+	unsigned int type;	/* RATE_DIST_* */
+	uint32_t jitter;	/* uniform: half width, fraction of the mean gap
+				 * with RATE_EXP_SHIFT fractional bits */
+	double burst_min;	/* pareto: scale of the burst length, packets */
+	double shape;		/* pareto: tail index, > 1 */
+};
+
+/* cycle_per_byte of a stopped flow, nothing is sent until it changes */
+#define RATE_CPB_PAUSED UINT64_MAX
+
 struct rate_ctl {
 	uint64_t rate_bps;
-	uint64_t cycle_per_byte;
+	uint64_t cycle_per_byte;	/* 0 means no pacing, see RATE_CPB_PAUSED */
 	uint64_t next_tx_cycle;
+	uint64_t next_tx_frac;		/* fraction of a cycle, fixed-point */
+	uint32_t overhead;		/* bytes accounted per packet on top of its length */
+
+	/* arrival process, with its own PRNG so that each lcore draws
+	 * without sharing state */
+	struct rate_dist dist;
+	uint64_t rng[2];
+	uint64_t burst_left;		/* packets left in the current burst */
+	unsigned __int128 burst_debt;	/* gap owed by the current burst */
 };
 
+static inline uint64_t __rate_rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+/* xoroshiro128+ on the PRNG of the flow, also used for other per-lcore
+ * random choices */
+static inline uint64_t rate_rand(struct rate_ctl *rate)
+{
+	uint64_t s0 = rate->rng[0], s1 = rate->rng[1];
+	uint64_t r = s0 + s1;
+
+	s1 ^= s0;
+	rate->rng[0] = __rate_rotl(s0, 24) ^ s1 ^ (s1 << 16);
+	rate->rng[1] = __rate_rotl(s1, 37);
+	return r;
+}
+
+/* Format: e.g 1000k, 2m, 1.5g (powers of 1024) or plain bps */
+bool rate_parse_bps(const char *rate_str, uint64_t *bps);
+
 bool rate_set_rate(const char *rate_str, struct rate_ctl *rate);
 
+void rate_set_bps(struct rate_ctl *rate, uint64_t bps);
+
+/* Fixed-point cycles per byte of bps, 0 for 0 */
+uint64_t rate_bps_to_cpb(uint64_t bps);
+
+/* Change the slope of a running flow, keeping its position in the
+ * schedule. cpb may be RATE_CPB_PAUSED. */
+void rate_set_cpb(struct rate_ctl *rate, uint64_t cpb, uint64_t cur_cycle);
+
+/* Schedule the next departure after sending pkts packets of bytes bytes,
+ * cur_cycle being the time they were due to be sent */
 void rate_set_next_cycle(struct rate_ctl *rate,
-				uint64_t cur_cycle, uint16_t pkt_len);
+				uint64_t cur_cycle, uint64_t bytes, unsigned int pkts);
+
+/* Format: const, exp, uniform[:<jitter 0-1>] or pareto:<mean burst>[:<shape>] */
+bool rate_parse_dist(const char *str, struct rate_dist *dist);
+
+const char *rate_dist_name(unsigned type);
+
+/* Use the arrival process dist, seed picks the PRNG sequence */
+void rate_set_dist(struct rate_ctl *rate, const struct rate_dist *dist,
+				uint64_t seed);
+
+/* Format: sleep, spin or hybrid */
+bool rate_parse_wait(const char *str, unsigned *mode);
+
+const char *rate_wait_name(unsigned mode);
 
-void rate_wait_for_time(uint64_t next_cycle);
+void rate_wait_for_time(uint64_t next_cycle, unsigned mode);
 
 #endif
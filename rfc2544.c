@@ -0,0 +1,230 @@
+#include "util.h"
+#include "rfc2544.h"
+#include "control.h"
+#include "rxtx.h"
+#include "stat.h"
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+
+enum {
+	RFC2544_IDLE = 0,
+	RFC2544_TRIAL,
+	RFC2544_DRAIN,
+	RFC2544_DONE
+};
+
+static bool rfc2544_on = false;
+static double trial_sec = RFC2544_TRIAL_SEC_DEF;
+static double max_loss = 0;		/* percent */
+static double resolution = 1;		/* percent of max_rate */
+
+/* Only touched by the stat thread */
+static unsigned int state = RFC2544_IDLE;
+static struct rfc2544_trial trials[RFC2544_TRIAL_MAX];
+static unsigned int nb_trials = 0;
+static uint64_t max_rate = 0, lo_rate = 0, hi_rate = 0, best_rate = 0;
+static struct stat_total base;		/* counters when the trial started */
+static uint64_t last_rx = 0;
+static uint64_t trial_end = 0, drain_end = 0, idle_end = 0;
+static uint64_t cycle_per_msec = 0;
+
+bool rfc2544_parse(const char *spec)
+{
+	char *end = NULL;
+
+	trial_sec = strtod(spec, &end);
+	if (end == spec || trial_sec <= 0)
+		goto close_error;
+
+	if (*end == ':') {
+		spec = end + 1;
+		max_loss = strtod(spec, &end);
+		if (end == spec || max_loss < 0 || max_loss >= 100)
+			goto close_error;
+	}
+
+	if (*end == ':') {
+		spec = end + 1;
+		resolution = strtod(spec, &end);
+		if (end == spec || resolution <= 0 || resolution >= 100)
+			goto close_error;
+	}
+
+	if (*end != '\0')
+		goto close_error;
+
+	rfc2544_on = true;
+	return true;
+
+close_error:
+	LOG_ERROR("Wrong RFC 2544 search parameters");
+	return false;
+}
+
+bool rfc2544_is_set(void)
+{
+	return rfc2544_on;
+}
+
+bool rfc2544_is_draining(void)
+{
+	return state == RFC2544_DRAIN;
+}
+
+static void __start_trial(uint64_t rate, uint64_t cur_cycle)
+{
+	struct rfc2544_trial *t = &trials[nb_trials];
+
+	memset(t, 0, sizeof(struct rfc2544_trial));
+	t->rate_bps = rate;
+
+	stat_get_total(&base);
+	rxtx_publish_rate(rate);
+	trial_end = cur_cycle + (uint64_t)(trial_sec * 1000 * cycle_per_msec);
+	state = RFC2544_TRIAL;
+
+	LOG_INFO("RFC 2544 trial %u at %.3lf Mbps", nb_trials + 1,
+					(double)rate / 1000000);
+}
+
+static void __finish_trial(const struct stat_total *total)
+{
+	struct rfc2544_trial *t = &trials[nb_trials];
+
+	t->tx_bytes = total->tx_bytes - base.tx_bytes;
+	t->tx_pkts = total->tx_pkts - base.tx_pkts;
+	t->rx_pkts = total->rx_pkts - base.rx_pkts;
+
+	/* a trial that sent nothing tells nothing, count it as a failure */
+	if (t->tx_pkts == 0) {
+		t->loss = 100;
+	} else if (t->rx_pkts >= t->tx_pkts) {
+		t->loss = 0;
+	} else {
+		t->loss = (double)(t->tx_pkts - t->rx_pkts) * 100 / t->tx_pkts;
+	}
+	t->pass = (t->tx_pkts > 0 && t->loss <= max_loss);
+
+	LOG_INFO("RFC 2544 trial %u: TX %lu, RX %lu, loss %.4lf%%, %s",
+					nb_trials + 1, (unsigned long)t->tx_pkts,
+					(unsigned long)t->rx_pkts, t->loss,
+					t->pass ? "pass" : "fail");
+	nb_trials++;
+}
+
+static void __report(void)
+{
+	const struct rfc2544_trial *t = NULL;
+	uint64_t lowest = UINT64_MAX;
+	unsigned int i = 0;
+
+	LOG_INFO("RFC 2544 throughput search, %.1lf s trials, max loss %.4lf%%",
+					trial_sec, max_loss);
+	LOG_INFO("\ttrial\toffered Mbps\tsent Mbps\tTX pkts\tRX pkts\tloss %%\tresult");
+	for (i = 0; i < nb_trials; i++) {
+		t = &trials[i];
+		LOG_INFO("\t%u\t%.3lf\t%.3lf\t%lu\t%lu\t%.4lf\t%s", i + 1,
+						(double)t->rate_bps / 1000000,
+						t->tx_bytes * 8 / trial_sec / 1000000,
+						(unsigned long)t->tx_pkts,
+						(unsigned long)t->rx_pkts, t->loss,
+						t->pass ? "pass" : "fail");
+		lowest = RTE_MIN(lowest, t->rate_bps);
+	}
+
+	if (nb_trials == 0) {
+		LOG_INFO("No trial completed");
+	} else if (best_rate == 0) {
+		LOG_INFO("No rate passed down to the %.2lf%% resolution, lowest "
+						"tried %.3lf Mbps", resolution,
+						(double)lowest / 1000000);
+	} else {
+		LOG_INFO("Throughput: %.3lf Mbps", (double)best_rate / 1000000);
+	}
+}
+
+/* Pick the rate of the next trial, 0 once the search is over */
+static uint64_t __next_rate(void)
+{
+	const struct rfc2544_trial *t = &trials[nb_trials - 1];
+
+	if (t->pass) {
+		lo_rate = t->rate_bps;
+		best_rate = t->rate_bps;
+	} else {
+		hi_rate = t->rate_bps;
+	}
+
+	/* the max rate itself passed */
+	if (lo_rate == max_rate)
+		return 0;
+
+	if ((double)(hi_rate - lo_rate) * 100 <= resolution * max_rate
+			|| nb_trials >= RFC2544_TRIAL_MAX)
+		return 0;
+	return lo_rate + (hi_rate - lo_rate) / 2;
+}
+
+void rfc2544_start(uint64_t max_bps, uint64_t start_cycle)
+{
+	if (!rfc2544_on)
+		return;
+
+	cycle_per_msec = rte_get_tsc_hz() / 1000;
+	max_rate = max_bps;
+	lo_rate = 0;
+	hi_rate = max_bps;
+	best_rate = 0;
+	nb_trials = 0;
+
+	LOG_INFO("RFC 2544 search up to %.3lf Mbps, resolution %.2lf%%",
+					(double)max_bps / 1000000, resolution);
+	__start_trial(max_bps, start_cycle);
+}
+
+uint64_t rfc2544_update(uint64_t cur_cycle)
+{
+	struct stat_total total;
+	uint64_t rate = 0;
+
+	switch (state) {
+		case RFC2544_TRIAL:
+			if (cur_cycle < trial_end)
+				return trial_end;
+
+			/* stop TX and wait for what is still in the switch */
+			rxtx_publish_rate(0);
+			stat_get_total(&total);
+			last_rx = total.rx_pkts;
+			drain_end = cur_cycle + RFC2544_DRAIN_MAX_MSEC * cycle_per_msec;
+			idle_end = cur_cycle + RFC2544_DRAIN_IDLE_MSEC * cycle_per_msec;
+			state = RFC2544_DRAIN;
+			break;
+
+		case RFC2544_DRAIN:
+			stat_get_total(&total);
+			if (total.rx_pkts != last_rx) {
+				last_rx = total.rx_pkts;
+				idle_end = cur_cycle
+						+ RFC2544_DRAIN_IDLE_MSEC * cycle_per_msec;
+			}
+			if (cur_cycle < idle_end && cur_cycle < drain_end)
+				break;
+
+			__finish_trial(&total);
+			rate = __next_rate();
+			if (rate == 0) {
+				state = RFC2544_DONE;
+				__report();
+				ctl_stop();
+				return UINT64_MAX;
+			}
+			__start_trial(rate, cur_cycle);
+			return trial_end;
+
+		default:
+			return UINT64_MAX;
+	}
+	return cur_cycle + RFC2544_TICK_MSEC * cycle_per_msec;
+}
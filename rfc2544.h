@@ -0,0 +1,45 @@
+#ifndef _PKTGEN_RFC2544_H_
+#define _PKTGEN_RFC2544_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * RFC 2544 throughput search: fixed-duration trials at a rate picked by
+ * binary search between 0 and the -r rate, until the highest rate whose
+ * loss stays under the threshold is known within the resolution. TX is
+ * paused and the switch drained between trials.
+ */
+#define RFC2544_TRIAL_SEC_DEF 10
+#define RFC2544_TRIAL_MAX 64
+
+/* A drain ends once nothing was received for this long, or at the max */
+#define RFC2544_DRAIN_IDLE_MSEC 100
+#define RFC2544_DRAIN_MAX_MSEC 2000
+#define RFC2544_TICK_MSEC 10
+
+struct rfc2544_trial {
+	uint64_t rate_bps;	/* offered */
+	uint64_t tx_bytes;
+	uint64_t tx_pkts;
+	uint64_t rx_pkts;
+	double loss;		/* percent of the TX packets */
+	bool pass;
+};
+
+/* Format: <trial sec>[:<max loss %>[:<resolution % of the max rate>]] */
+bool rfc2544_parse(const char *spec);
+
+bool rfc2544_is_set(void);
+
+/* Start the first trial at max_bps */
+void rfc2544_start(uint64_t max_bps, uint64_t start_cycle);
+
+/* Probes must not be sent while the switch drains */
+bool rfc2544_is_draining(void);
+
+/* Step the search, returns the cycle of the next step. Stops the run
+ * once the search converged. */
+uint64_t rfc2544_update(uint64_t cur_cycle);
+
+#endif /* _PKTGEN_RFC2544_H_ */
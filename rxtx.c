@@ -7,6 +7,9 @@
 #include <rte_ethdev.h>
 #include <rte_hash_crc.h>
 #include <rte_random.h>
+#include <rte_malloc.h>
+#include <rte_lcore.h>
+#include <rte_version.h>
 
 #include "util.h"
 #include "control.h"
@@ -14,91 +17,502 @@
 #include "stat.h"
 #include "pkt_seq.h"
 #include "rate.h"
+#include "pcap.h"
+#include "trace.h"
+#include "pkt_size.h"
+#include "tsc.h"
 
 /**** TX ****/
 /* - default tx rate: 1mbps */
 #define TX_RATE_DEF "2000M"
 
-struct pkt_setup_param {
-	struct pkt_seq_info *info;
-	unsigned int type;
+/* Aggregate TX rate, split evenly among the TX lcores */
+static struct rate_ctl tx_rate = {
+	.rate_bps = 0,
+	.cycle_per_byte = 0,
+	.next_tx_cycle = 0,
 };
 
-static struct tx_ctl tx_ctl = {
-	.tx_type = TX_TYPE_SINGLE,
-	.tx_mp = NULL,
-	.trace = NULL,
-	.tx_rate = {
-		.rate_bps = 0,
-		.cycle_per_byte = 0,
-		.next_tx_cycle = 0,
-	},
-	.len = 0,
-	.offset = 0,
-	.mbuf_tbl = {NULL},
+/* Per-lcore cycle_per_byte published by the rate schedule, polled by the
+ * TX lcores without locking */
+static uint64_t tx_cpb_pub = 0;
+
+/* While paused, TX lcores look for a new rate this often */
+#define TX_PAUSE_POLL_USEC 100
+
+static unsigned int nb_tx_inst = 1;
+static bool tx_rate_l1 = false;
+static unsigned int tx_wait = RATE_WAIT_SPIN;
+static unsigned int tx_loops = 1;
+static bool pcap_orig_timing = false;
+static bool tx_smooth = false;
+static struct rate_dist tx_dist = {
+	.type = RATE_DIST_CONST,
 };
 
+/* pcap arena, shared read-only by all TX lcores */
+static struct pcap_arena *tx_pcap = NULL;
+static struct flow_table *tx_flows = NULL;
+static struct pkt_size_dist tx_sizes;
+static bool tx_sizes_on = false;
+static unsigned int tx_zc_pkts = 0;
+static unsigned int tx_inband = 0;
+
+static unsigned int rx_stamp = RX_STAMP_BURST;
+static const char *rx_stamp_name[RX_STAMP_MAX] = {
+	[RX_STAMP_BURST] = "burst",
+	[RX_STAMP_PKT] = "pkt",
+	[RX_STAMP_INTERP] = "interp",
+};
+
+/* Cycles taken by one TSC read, to tell the cost of the RX stamps */
+static double tsc_read_cyc = 0;
+
+/* probes from the measure lcore to TX lcore 0 */
+static struct rte_ring *tx_probe_ring = NULL;
+
 void rxtx_set_rate(const char *rate_str)
 {
-	rate_set_rate(rate_str, &tx_ctl.tx_rate);
+	rate_set_rate(rate_str, &tx_rate);
+}
+
+uint64_t rxtx_get_rate(void)
+{
+	return tx_rate.rate_bps;
+}
+
+void rxtx_set_l1_rate(bool l1)
+{
+	tx_rate_l1 = l1;
+}
+
+void rxtx_set_wait(unsigned int mode)
+{
+	tx_wait = mode;
+}
+
+void rxtx_set_loops(unsigned int loops)
+{
+	tx_loops = loops;
+}
+
+void rxtx_set_pcap_timing(bool orig)
+{
+	pcap_orig_timing = orig;
+}
+
+void rxtx_set_smooth(bool smooth)
+{
+	tx_smooth = smooth;
+}
+
+bool rxtx_set_sizes(const char *spec)
+{
+	tx_sizes_on = pkt_size_parse(spec, &tx_sizes);
+	return tx_sizes_on;
+}
+
+void rxtx_set_zero_copy(unsigned int nb_pkts)
+{
+	tx_zc_pkts = nb_pkts;
+}
+
+void rxtx_set_inband(unsigned int nb_pkts)
+{
+	tx_inband = nb_pkts;
+}
+
+unsigned int rxtx_get_inband(void)
+{
+	return tx_inband;
 }
 
-static void __set_tx_pkt_info(struct pkt_seq_info *info)
+bool rxtx_set_rx_stamp(const char *mode)
+{
+	unsigned int i = 0;
+
+	for (i = 0; i < RX_STAMP_MAX; i++) {
+		if (strcmp(mode, rx_stamp_name[i]) == 0) {
+			rx_stamp = i;
+			return true;
+		}
+	}
+	LOG_ERROR("Wrong RX timestamp mode %s", mode);
+	return false;
+}
+
+void rxtx_set_arrival(const struct rate_dist *dist)
+{
+	tx_dist = *dist;
+}
+
+bool rxtx_inject_probe(struct rte_mbuf *m)
+{
+	if (unlikely(tx_probe_ring == NULL))
+		return false;
+	return rte_ring_sp_enqueue(tx_probe_ring, m) == 0;
+}
+
+/*
+ * The ring lives in rte_zmalloc memory instead of a named memzone, as
+ * rte_ring_create would reserve, since it never leaves this process.
+ */
+static struct rte_ring *__probe_ring_create(void)
+{
+	struct rte_ring *r = NULL;
+	ssize_t size = rte_ring_get_memsize(TX_PROBE_RING_SIZE);
+
+	if (size < 0)
+		return NULL;
+
+	r = rte_zmalloc("tx_probe_ring", size, RTE_CACHE_LINE_SIZE);
+	if (r == NULL)
+		return NULL;
+
+	if (rte_ring_init(r, "tx_probe_ring", TX_PROBE_RING_SIZE,
+					RING_F_SP_ENQ | RING_F_SC_DEQ) != 0) {
+		rte_free(r);
+		return NULL;
+	}
+	return r;
+}
+
+static void __probe_ring_free(struct rte_ring *r)
+{
+	void *m = NULL;
+
+	while (rte_ring_sc_dequeue(r, &m) == 0)
+		rte_pktmbuf_free(m);
+	rte_free(r);
+}
+
+/* Share of one TX lcore, never rounded down to 0 which means no pacing */
+static inline uint64_t __lcore_bps(uint64_t bps)
+{
+	return (bps == 0) ? 0 : RTE_MAX(bps / nb_tx_inst, 1UL);
+}
+
+void rxtx_publish_rate(uint64_t bps)
+{
+	uint64_t cpb = RATE_CPB_PAUSED;
+
+	if (bps != 0)
+		cpb = rate_bps_to_cpb(__lcore_bps(bps));
+	__atomic_store_n(&tx_cpb_pub, cpb, __ATOMIC_RELAXED);
+}
+
+#define TSC_COST_LOOPS 4096
+
+static double __tsc_read_cost(void)
+{
+	uint64_t start = 0, end = 0;
+	unsigned int i = 0;
+
+	start = rte_get_tsc_cycles();
+	for (i = 0; i < TSC_COST_LOOPS; i++)
+		end = rte_get_tsc_cycles();
+	return (double)(end - start) / TSC_COST_LOOPS;
+}
+
+bool rxtx_init(unsigned tx_type, const char *filename, unsigned nb_tx)
+{
+	if (tx_type >= TX_TYPE_MAX || nb_tx == 0) {
+		LOG_ERROR("Wrong TX type %u or TX lcore number %u",
+						tx_type, nb_tx);
+		return false;
+	}
+	nb_tx_inst = nb_tx;
+
+	if (tx_rate.rate_bps == 0)
+		rxtx_set_rate(TX_RATE_DEF);
+	tx_cpb_pub = rate_bps_to_cpb(__lcore_bps(tx_rate.rate_bps));
+
+	/* random gaps are drawn per packet, not per burst */
+	if (tx_dist.type != RATE_DIST_CONST && !tx_smooth) {
+		LOG_INFO("%s arrivals, pacing each packet",
+						rate_dist_name(tx_dist.type));
+		tx_smooth = true;
+	}
+
+	if (tx_sizes_on) {
+		if (tx_type == TX_TYPE_PCAP || tx_type == TX_TYPE_5TUPLE_TRACE) {
+			LOG_ERROR("Packet sizes only apply to generated packets");
+			return false;
+		}
+		LOG_INFO("%u packet sizes up to %u bytes, mean %.1lf bytes",
+						tx_sizes.nb_sizes, tx_sizes.max_len,
+						tx_sizes.mean_len);
+	}
+
+	if (tx_zc_pkts > 0) {
+		if (tx_type == TX_TYPE_PCAP || tx_type == TX_TYPE_5TUPLE_TRACE) {
+			LOG_ERROR("Zero-copy TX only applies to generated packets");
+			return false;
+		}
+		LOG_INFO("Zero-copy TX, %u pre-built packets per TX lcore",
+						tx_zc_pkts);
+	}
+
+	if (tx_inband > 0) {
+		if (tx_type == TX_TYPE_PCAP || tx_type == TX_TYPE_5TUPLE_TRACE
+				|| tx_zc_pkts > 0) {
+			LOG_ERROR("In-band samples need generated packets "
+							"copied into each mbuf");
+			return false;
+		}
+		LOG_INFO("In-band sample every %u data packets", tx_inband);
+	}
+
+	tsc_read_cyc = __tsc_read_cost();
+	LOG_INFO("RX timestamps: %s, a TSC read takes %.1lf cycles",
+					rx_stamp_name[rx_stamp], tsc_read_cyc);
+
+	tx_probe_ring = __probe_ring_create();
+	if (tx_probe_ring == NULL) {
+		LOG_ERROR("Failed to create probe ring");
+		return false;
+	}
+
+	if (tx_type == TX_TYPE_PCAP) {
+		tx_pcap = pcap_arena_load(filename, PKT_TMPL_MAX);
+		if (tx_pcap == NULL) {
+			LOG_ERROR("Failed to load pcap file %s", filename);
+			return false;
+		}
+		LOG_INFO("Replay %u packets, %u passes (0 for endless), %s",
+						tx_pcap->nb_pkts, tx_loops,
+						pcap_orig_timing ? "original timing" : "full speed");
+	} else if (tx_type == TX_TYPE_FLOW) {
+		tx_flows = flow_table_create(filename);
+		if (tx_flows == NULL) {
+			LOG_ERROR("Failed to build flow set %s", filename);
+			return false;
+		}
+		/* each TX lcore would only ever send its first pre-built ones */
+		if (tx_zc_pkts > 0 && tx_flows->nb_flows > tx_zc_pkts) {
+			LOG_ERROR("Zero-copy TX pre-builds %u packets, fewer than the "
+							"%u flows of %s", tx_zc_pkts,
+							tx_flows->nb_flows, filename);
+			return false;
+		}
+	}
+	return true;
+}
+
+void rxtx_cleanup(void)
+{
+	if (tx_pcap != NULL) {
+		pcap_arena_free(tx_pcap);
+		tx_pcap = NULL;
+	}
+	if (tx_flows != NULL) {
+		flow_table_free(tx_flows);
+		tx_flows = NULL;
+	}
+	if (tx_probe_ring != NULL) {
+		__probe_ring_free(tx_probe_ring);
+		tx_probe_ring = NULL;
+	}
+}
+
+static void __set_tx_pkt_info(struct tx_ctl *ctl, struct pkt_seq_info *info)
 {
 	if (info == NULL) {
-		pkt_seq_init(&tx_ctl.pkt_info);
+		pkt_seq_init(&ctl->pkt_info);
 	} else {
-		tx_ctl.pkt_info.src_ip = info->src_ip;
-		tx_ctl.pkt_info.dst_ip = info->dst_ip;
-		tx_ctl.pkt_info.proto = info->proto;
-		tx_ctl.pkt_info.src_port = info->src_port;
-		tx_ctl.pkt_info.dst_port = info->dst_port;
-		tx_ctl.pkt_info.pkt_len = info->pkt_len;
+		ctl->pkt_info.src_ip = info->src_ip;
+		ctl->pkt_info.dst_ip = info->dst_ip;
+		ctl->pkt_info.proto = info->proto;
+		ctl->pkt_info.src_port = info->src_port;
+		ctl->pkt_info.dst_port = info->dst_port;
+		ctl->pkt_info.pkt_len = info->pkt_len;
 	}
 }
 
-static inline void __pkt_setup(struct rte_mbuf *m, unsigned tx_type,
-				struct pkt_seq_info *info)
+static inline void __pkt_setup(struct rte_mbuf *m, struct tx_ctl *ctl)
 {
-	if (tx_type == TX_TYPE_RANDOM) {
-		uint64_t val = 0;
+	struct pkt_seq_info *info = &ctl->pkt_info;
+	uint64_t val = 0;
+
+	if (ctl->sizes == NULL) {
+		pkt_seq_tmpl_to_mbuf(&ctl->tmpl, m);
+		/* headers never change, the pre-built frame is complete */
+		if (ctl->tx_type == TX_TYPE_SINGLE)
+			return;
+	} else {
+		pkt_seq_tmpl_to_mbuf_len(&ctl->tmpl, m,
+						pkt_size_next(ctl->sizes, &ctl->tx_rate));
+	}
 
+	if (ctl->tx_type == TX_TYPE_RANDOM) {
+		/* only the addresses change, patch the checksums for them */
 		val = rte_rand();
-		info->src_ip = val & 0xffffffff;
-		info->dst_ip = (val >> 32) &0xffffffff;
+		pkt_seq_rewrite_flow(m, val & 0xffffffff, (val >> 32) & 0xffffffff,
+						info->src_port, info->dst_port);
+	} else if (ctl->tx_type == TX_TYPE_FLOW) {
+		flow_apply(ctl->flows, flow_next(ctl->flows, &ctl->flow_cur,
+								&ctl->tx_rate), &ctl->flow_base, m);
 	}
 
-	pkt_seq_fill_mbuf(m, info);
+	if (ctl->sizes != NULL)
+		pkt_seq_set_len(m);
+	pkt_seq_set_fcs(m);
 }
 
-static bool __tx_init(unsigned tx_type, struct rte_mempool *mp,
-				struct pkt_seq_info *seq, const char *filename)
+static void __zc_free(struct tx_ctl *ctl)
 {
-	if (tx_type >= TX_TYPE_MAX) {
-		LOG_ERROR("Wrong TX type %u", tx_type);
+	unsigned int i = 0;
+
+	if (ctl->zc_pkts == NULL)
+		return;
+
+	/* packets still in flight keep their own reference */
+	for (i = 0; i < ctl->nb_zc; i++)
+		rte_pktmbuf_free(ctl->zc_pkts[i]);
+	rte_free(ctl->zc_pkts);
+	ctl->zc_pkts = NULL;
+	ctl->nb_zc = 0;
+}
+
+/*
+ * Zero-copy TX keeps nb_pkts packets built once and sends indirect mbufs
+ * attached to them. OVS frees what it gets from the ring in its own
+ * process, where the detach only drops the reference of the pre-built
+ * mbuf. External buffers would need a free callback living in this
+ * process, so they cannot be used across the ring.
+ */
+static bool __zc_init(struct tx_ctl *ctl, unsigned int nb_pkts)
+{
+	struct rte_mbuf *m = NULL;
+	unsigned int i = 0;
+
+	ctl->zc_pkts = rte_zmalloc("pktgen: zero-copy packets",
+					sizeof(struct rte_mbuf *) * nb_pkts, 0);
+	if (ctl->zc_pkts == NULL) {
+		LOG_ERROR("Failed to allocate zero-copy packet table");
 		return false;
 	}
-	tx_ctl.tx_type = tx_type;
 
-	if (tx_ctl.tx_rate.rate_bps == 0)
-		rxtx_set_rate(TX_RATE_DEF);
+	for (i = 0; i < nb_pkts; i++) {
+		m = rte_pktmbuf_alloc(ctl->tx_mp);
+		if (m == NULL) {
+			LOG_ERROR("Failed to allocate zero-copy packet %u", i);
+			__zc_free(ctl);
+			return false;
+		}
+		__pkt_setup(m, ctl);
+		ctl->zc_pkts[ctl->nb_zc++] = m;
+	}
+	ctl->zc_idx = 0;
+	return true;
+}
+
+/* m comes from __pktmbuf_alloc_bulk: direct, refcnt 1 */
+static inline void __zc_setup(struct rte_mbuf *m, struct tx_ctl *ctl)
+{
+	rte_pktmbuf_attach(m, ctl->zc_pkts[ctl->zc_idx]);
+	if (++ctl->zc_idx == ctl->nb_zc)
+		ctl->zc_idx = 0;
+}
+
+static bool __tx_init(struct tx_ctl *ctl, struct rxtx_param *param)
+{
+	uint64_t first = 0, cnt = 0;
 
-	__set_tx_pkt_info(seq);
+	if (param->tx_type >= TX_TYPE_MAX) {
+		LOG_ERROR("Wrong TX type %u", param->tx_type);
+		return false;
+	}
+	ctl->tx_type = param->tx_type;
+	ctl->inst = param->inst;
+	ctl->stat = stat_get_shard();
+	ctl->tsc_off = tsc_get_offset(rte_lcore_id());
+
+	ctl->tx_rate = tx_rate;
+	if (nb_tx_inst > 1)
+		rate_set_bps(&ctl->tx_rate, __lcore_bps(tx_rate.rate_bps));
+	ctl->tx_rate.overhead = tx_rate_l1 ? RATE_L1_OVERHEAD : 0;
+	rate_set_dist(&ctl->tx_rate, &tx_dist,
+					rte_get_tsc_cycles() + ((uint64_t)ctl->inst << 48));
+	ctl->stop_wait_cyc = TX_STOP_WAIT_USEC * (rte_get_tsc_hz() / 1000000);
+	hist_reset(&ctl->gap);
+	ctl->last_tx_cycle = 0;
+
+	/* probes go out on queue 0 of pair 0, the port of TX lcore 0 */
+	ctl->probe_ring = (ctl->inst == 0) ? tx_probe_ring : NULL;
+	ctl->nb_probe = 0;
+	ctl->probe_wait_cyc = TX_PROBE_WAIT_USEC * (rte_get_tsc_hz() / 1000000);
+	ctl->probe_spliced = 0;
+	ctl->probe_alone = 0;
+
+	ctl->inband_left = tx_inband;
+	ctl->inband_next = 0;
+	ctl->inband_mask = 0;
+	ctl->inband_sent = 0;
+	ctl->inband_short = 0;
+
+	__set_tx_pkt_info(ctl, param->seq);
+
+	/* the template holds the largest size, smaller ones are cut from it */
+	ctl->sizes = NULL;
+	if (tx_sizes_on) {
+		ctl->pkt_info.pkt_len = tx_sizes.max_len - ETH_CRC_LEN;
+		if (tx_sizes.nb_sizes > 1)
+			ctl->sizes = &tx_sizes;
+	}
 
-	if (tx_type == TX_TYPE_RANDOM)
-		rte_srand(rte_get_tsc_cycles());
+	if (ctl->tx_type == TX_TYPE_RANDOM)
+		rte_srand(rte_get_tsc_cycles() + ctl->inst);
 
-	tx_ctl.tx_mp = mp;
+	ctl->tx_mp = param->mp;
 
-	if (tx_type == TX_TYPE_SINGLE || tx_type == TX_TYPE_RANDOM) {
-//		/* Set default packets */
-//		param.info = &tx_ctl.pkt_info;
-//		param.type = tx_type;
-//		rte_mempool_obj_iter(tx_ctl.tx_mp, __pkt_setup, &param);
+	if (ctl->tx_type == TX_TYPE_SINGLE || ctl->tx_type == TX_TYPE_RANDOM
+			|| ctl->tx_type == TX_TYPE_FLOW) {
+		/* The mempool is shared with ovs, which rewrites the mbufs it
+		 * allocates, so the packet is built once here and copied into
+		 * each mbuf instead of being stamped into the pool. */
+		if (!pkt_seq_build_tmpl(&ctl->pkt_info, &ctl->tmpl)) {
+			LOG_ERROR("Failed to build packet template");
+			return false;
+		}
+		if (ctl->tx_type == TX_TYPE_FLOW) {
+			if (!flow_base_init(&ctl->flow_base, &ctl->tmpl))
+				return false;
+			ctl->flows = tx_flows;
+			flow_cursor_init(&ctl->flow_cur, tx_flows, ctl->inst, nb_tx_inst);
+		}
+		if (tx_zc_pkts > 0 && !__zc_init(ctl, tx_zc_pkts))
+			return false;
+	} else if (ctl->tx_type == TX_TYPE_PCAP) {
+		if (tx_pcap == NULL) {
+			LOG_ERROR("No pcap loaded");
+			return false;
+		}
+		/* each TX lcore replays every nb_tx_inst-th frame */
+		ctl->pcap = tx_pcap;
+		ctl->pcap_idx = ctl->inst;
+		ctl->pcap_pass = 0;
+		ctl->pcap_base = 0;
+		ctl->pcap_done = (ctl->inst >= tx_pcap->nb_pkts);
+	} else if (ctl->tx_type == TX_TYPE_5TUPLE_TRACE) {
+		/* each TX lcore streams its own slice of the trace */
+		if (!trace_get_nb_recs(param->filename, &cnt)) {
+			LOG_ERROR("Failed to open trace file %s", param->filename);
+			return false;
+		}
+		first = cnt * ctl->inst / nb_tx_inst;
+		cnt = cnt * (ctl->inst + 1) / nb_tx_inst - first;
+		if (cnt == 0) {
+			LOG_ERROR("Trace too short for %u TX lcores", nb_tx_inst);
+			return false;
+		}
 
-	} else if (tx_type == TX_TYPE_5TUPLE_TRACE || tx_type == TX_TYPE_PCAP) {
-		LOG_INFO("TODO: load file %s", filename);
-		return false;
+		ctl->trace = trace_reader_open(param->filename, tx_loops,
+						first, cnt);
+		if (ctl->trace == NULL) {
+			LOG_ERROR("Failed to open trace file %s", param->filename);
+			return false;
+		}
 	}
 
 	return true;
@@ -179,17 +593,429 @@ __pktmbuf_alloc_bulk(struct rte_mempool *pool,
 //
 //}
 
-static int __process_tx(int portid __rte_unused, struct tx_ctl *ctl)
+static void __tx_cleanup(struct tx_ctl *ctl)
+{
+	if (ctl->trace != NULL) {
+		trace_reader_close(ctl->trace);
+		ctl->trace = NULL;
+	}
+
+	__zc_free(ctl);
+
+	while (ctl->nb_probe > 0)
+		rte_pktmbuf_free(ctl->probe_tbl[--ctl->nb_probe]);
+	ctl->probe_ring = NULL;
+
+	/* the arena and flows are owned by rxtx_init/rxtx_cleanup */
+	ctl->pcap = NULL;
+	ctl->flows = NULL;
+}
+
+/* Pick up the rate published by the schedule, false while paused */
+static inline bool __tx_rate_sync(struct tx_ctl *ctl, uint64_t now)
+{
+	struct rate_ctl *rate = &ctl->tx_rate;
+	uint64_t cpb = __atomic_load_n(&tx_cpb_pub, __ATOMIC_RELAXED);
+
+	if (unlikely(cpb != rate->cycle_per_byte))
+		rate_set_cpb(rate, cpb, now);
+
+	if (unlikely(cpb == RATE_CPB_PAUSED)) {
+		rate->next_tx_cycle = now + TX_PAUSE_POLL_USEC
+						* (rte_get_tsc_hz() / 1000000);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Issue one tx_burst with the pending probes ahead of cnt data packets.
+ * The probes are stamped right before it, so that their send time covers
+ * neither their wait in the ring nor the build of the burst, and nothing
+ * of this burst leaves before them. Returns the data packets sent.
+ */
+static inline int __tx_burst_probes(int portid, struct tx_ctl *ctl,
+				struct rte_mbuf **pkts, unsigned int cnt)
+{
+	struct rte_mbuf *burst[TX_PROBE_BURST + TX_BURST];
+	struct pkt_probe *probe = NULL;
+	unsigned int nb_probe = ctl->nb_probe, sent = 0, i = 0;
+	uint64_t now = 0, stamp = 0;
+	int ret = 0;
+
+	memcpy(burst, ctl->probe_tbl, nb_probe * sizeof(struct rte_mbuf *));
+	memcpy(burst + nb_probe, pkts, cnt * sizeof(struct rte_mbuf *));
+
+	now = rte_get_tsc_cycles();
+	stamp = now - ctl->tsc_off;
+	for (i = 0; i < nb_probe; i++)
+		pkt_seq_stamp_probe(burst[i], stamp);
+	ctl->stamp_cyc += rte_get_tsc_cycles() - now;
+	ctl->stamp_pkts += nb_probe;
+
+	ret = rte_eth_tx_burst(portid, 0, burst, nb_probe + cnt);
+
+	sent = RTE_MIN((unsigned)ret, nb_probe);
+	for (i = 0; i < sent; i++) {
+		probe = rte_pktmbuf_mtod(burst[i], struct pkt_probe *);
+		stat_update_tx_probe(ctl->stat, probe->probe_class, 0,
+						probe->probe_idx, burst[i]->pkt_len, stamp);
+	}
+	if (cnt > 0)
+		ctl->probe_spliced += sent;
+	else
+		ctl->probe_alone += sent;
+
+	ctl->nb_probe -= sent;
+	memmove(ctl->probe_tbl, ctl->probe_tbl + sent,
+					ctl->nb_probe * sizeof(struct rte_mbuf *));
+	return ret - sent;
+}
+
+/* Take the probes queued by the measure lcore, send them alone if they
+ * waited too long for a data burst */
+static inline void __tx_probe_poll(int portid, struct tx_ctl *ctl)
+{
+	unsigned int n = 0;
+
+	if (ctl->probe_ring == NULL)
+		return;
+
+	if (ctl->nb_probe < TX_PROBE_BURST) {
+#if RTE_VERSION >= RTE_VERSION_NUM(17, 5, 0, 0)
+		n = rte_ring_sc_dequeue_burst(ctl->probe_ring,
+						(void **)&ctl->probe_tbl[ctl->nb_probe],
+						TX_PROBE_BURST - ctl->nb_probe, NULL);
+#else
+		n = rte_ring_sc_dequeue_burst(ctl->probe_ring,
+						(void **)&ctl->probe_tbl[ctl->nb_probe],
+						TX_PROBE_BURST - ctl->nb_probe);
+#endif
+		if (n > 0 && ctl->nb_probe == 0)
+			ctl->probe_since = rte_get_tsc_cycles();
+		ctl->nb_probe += n;
+	}
+
+	if (ctl->nb_probe > 0 && rte_get_tsc_cycles() - ctl->probe_since
+					>= ctl->probe_wait_cyc)
+		__tx_burst_probes(portid, ctl, NULL, 0);
+}
+
+/* Slots first to first + cnt - 1 of mbuf_tbl */
+static inline uint32_t __tx_slots(unsigned int first, unsigned int cnt)
+{
+	return (uint32_t)(((1ULL << cnt) - 1) << first);
+}
+
+/* Pick the in-band samples of a new burst. When a sample is due on a
+ * packet too short for the trailer, the next packet takes it. */
+static inline void __inband_mark(struct tx_ctl *ctl, unsigned int cnt)
+{
+	unsigned int i = 0;
+
+	RTE_BUILD_BUG_ON(TX_BURST > 32);
+
+	ctl->inband_mask = 0;
+	for (i = 0; i < cnt; i++) {
+		if (ctl->inband_left > 1) {
+			ctl->inband_left--;
+			continue;
+		}
+		if (!pkt_seq_trailer_fits(ctl->mbuf_tbl[i])) {
+			ctl->inband_short++;
+			continue;
+		}
+
+		ctl->inband_mask |= 1U << i;
+		ctl->inband_idx[i] = ctl->inband_next;
+		ctl->inband_next++;
+		ctl->inband_left = tx_inband;
+	}
+}
+
+/* Stamp the samples among the cnt packets about to be sent, returns the
+ * send time written */
+static inline uint64_t __inband_stamp(struct tx_ctl *ctl, unsigned int cnt)
+{
+	uint32_t mask = ctl->inband_mask & __tx_slots(ctl->offset, cnt);
+	uint64_t now = rte_get_tsc_cycles();
+	uint64_t stamp = now - ctl->tsc_off;
+	unsigned int i = 0;
+
+	for (; mask != 0; mask &= mask - 1) {
+		i = __builtin_ctz(mask);
+		pkt_seq_stamp_trailer(ctl->mbuf_tbl[i], PKT_PROBE_CLASS_INBAND,
+						ctl->inst, ctl->inband_idx[i], stamp);
+		ctl->stamp_pkts++;
+	}
+	ctl->stamp_cyc += rte_get_tsc_cycles() - now;
+	return stamp;
+}
+
+/* Log the samples among the sent packets, the others get stamped again */
+static inline void __inband_sent(struct tx_ctl *ctl, unsigned int sent,
+				uint64_t now)
+{
+	uint32_t mask = ctl->inband_mask & __tx_slots(ctl->offset, sent);
+	unsigned int i = 0;
+
+	ctl->inband_mask &= ~mask;
+	for (; mask != 0; mask &= mask - 1) {
+		i = __builtin_ctz(mask);
+		stat_record_tx_probe(ctl->stat, PKT_PROBE_CLASS_INBAND, ctl->inst,
+						ctl->inband_idx[i], now);
+		ctl->inband_sent++;
+	}
+}
+
+/*
+ * Send the pending mbufs of ctl. A paced burst moves the departure schedule
+ * forward by what went out. In smooth mode only the packets whose departure
+ * time has come are sent, one rate slot each, so a burst is spread over its
+ * whole window instead of leaving back to back.
+ */
+static inline int __tx_flush(int portid, struct tx_ctl *ctl, uint64_t now,
+				bool paced)
+{
+	struct rate_ctl *rate = &ctl->tx_rate;
+	struct rate_ctl saved = *rate;
+	struct rte_mbuf **pkts = &ctl->mbuf_tbl[ctl->offset];
+	unsigned int cnt = ctl->len, i = 0;
+	uint64_t sum = 0, stamp = 0;
+	int ret = 0;
+
+	paced = paced && rate->cycle_per_byte != 0;
+	if (paced && tx_smooth) {
+		for (cnt = 0; cnt < ctl->len && now >= rate->next_tx_cycle; cnt++)
+			rate_set_next_cycle(rate, now, pkts[cnt]->data_len, 1);
+		if (cnt == 0)
+			return 0;
+	}
+
+	if (unlikely(ctl->inband_mask != 0))
+		stamp = __inband_stamp(ctl, cnt);
+
+	if (ctl->nb_probe > 0)
+		ret = __tx_burst_probes(portid, ctl, pkts, cnt);
+	else
+		ret = rte_eth_tx_burst(portid, 0, pkts, cnt);
+
+	if (unlikely(ctl->inband_mask != 0))
+		__inband_sent(ctl, ret, stamp);
+	for (i = 0; i < (unsigned)ret; i++)
+		sum += pkts[i]->data_len;
+	ctl->len -= ret;
+	ctl->offset += ret;
+
+	if (ret == 0)
+		return 0;
+
+	stat_update_tx(ctl->stat, sum, ret);
+
+	if (paced && !tx_smooth) {
+		rate_set_next_cycle(rate, now, sum, ret);
+	} else if (paced && (unsigned)ret < cnt) {
+		/* only charge the slots of what the port took */
+		*rate = saved;
+		for (i = 0; i < (unsigned)ret; i++)
+			rate_set_next_cycle(rate, now, pkts[i]->data_len, 1);
+	}
+
+	/* packets of the same tx_burst leave back to back */
+	if (ctl->last_tx_cycle != 0)
+		hist_record(&ctl->gap, now - ctl->last_tx_cycle);
+	hist_record_n(&ctl->gap, 0, ret - 1);
+	ctl->last_tx_cycle = now;
+	return ret;
+}
+
+static void __tx_report_gap(struct tx_ctl *ctl)
+{
+	double cyc_per_usec = (double)rte_get_tsc_hz() / 1000000;
+	const struct hist *h = &ctl->gap;
+
+	if (h->total == 0)
+		return;
+
+	LOG_INFO("tx %u inter-packet gap (us, %lu gaps): p50 %.3lf, "
+					"p90 %.3lf, p99 %.3lf, max %.3lf", ctl->inst,
+					(unsigned long)h->total,
+					hist_percentile(h, 50) / cyc_per_usec,
+					hist_percentile(h, 90) / cyc_per_usec,
+					hist_percentile(h, 99) / cyc_per_usec,
+					hist_percentile(h, 100) / cyc_per_usec);
+}
+
+static void __tx_report_probe(struct tx_ctl *ctl)
+{
+	if (ctl->probe_ring != NULL) {
+		LOG_INFO("tx %u probes: %lu spliced into data bursts, %lu sent alone",
+						ctl->inst, (unsigned long)ctl->probe_spliced,
+						(unsigned long)ctl->probe_alone);
+	}
+
+	if (tx_inband > 0) {
+		LOG_INFO("tx %u in-band samples: %lu sent, %lu packets too short",
+						ctl->inst, (unsigned long)ctl->inband_sent,
+						(unsigned long)ctl->inband_short);
+	}
+
+	/* the stamps are taken before this, so it delays the departure */
+	if (ctl->stamp_pkts > 0) {
+		LOG_INFO("tx %u stamping: %lu packets, %.1lf cycles each",
+						ctl->inst, (unsigned long)ctl->stamp_pkts,
+						(double)ctl->stamp_cyc / ctl->stamp_pkts);
+	}
+}
+
+/* Move to the next frame of the capture, returns false once all the
+ * requested passes are done. */
+static inline bool __pcap_next(struct tx_ctl *ctl)
+{
+	ctl->pcap_idx += nb_tx_inst;
+	if (ctl->pcap_idx < ctl->pcap->nb_pkts)
+		return true;
+
+	ctl->pcap_idx = ctl->inst;
+	ctl->pcap_base += ctl->pcap->duration;
+	ctl->pcap_pass++;
+	return (tx_loops == 0 || ctl->pcap_pass < tx_loops);
+}
+
+static int __process_tx_pcap(int portid, struct tx_ctl *ctl)
+{
+	struct pcap_arena *arena = ctl->pcap;
+	uint32_t frame[TX_BURST];
+	unsigned int cnt = 0, i = 0;
+	uint64_t start_cyc = 0;
+	int ret = 0;
+
+	if (ctl->len <= 0) {
+		if (ctl->pcap_done)
+			return -ENOENT;
+
+		start_cyc = rte_get_tsc_cycles();
+		if (ctl->pcap_base == 0)
+			ctl->pcap_base = start_cyc;
+
+		/* pick the frames of this burst */
+		while (cnt < TX_BURST) {
+			if (pcap_orig_timing && ctl->pcap_base
+					+ arena->ts_cyc[ctl->pcap_idx] > start_cyc)
+				break;
+
+			frame[cnt++] = ctl->pcap_idx;
+			if (!__pcap_next(ctl)) {
+				ctl->pcap_done = true;
+				break;
+			}
+		}
+
+		if (cnt == 0)
+			return 0;
+
+		ret = __pktmbuf_alloc_bulk(ctl->tx_mp, ctl->mbuf_tbl, cnt);
+		if (ret != 0) {
+			ctl->len = 0;
+			ctl->offset = 0;
+			return -ENOMEM;
+		}
+
+		for (i = 0; i < cnt; i++) {
+			struct rte_mbuf *m = ctl->mbuf_tbl[i];
+
+			m->pkt_len = arena->len[frame[i]];
+			m->data_len = arena->len[frame[i]];
+			rte_memcpy(rte_pktmbuf_mtod(m, void *),
+							arena->data + arena->off[frame[i]],
+							arena->len[frame[i]]);
+		}
+
+		ctl->len = cnt;
+		ctl->offset = 0;
+	}
+
+	__tx_flush(portid, ctl, rte_get_tsc_cycles(), false);
+	return 0;
+}
+
+#define TRACE_LEN_MIN (sizeof(struct ether_hdr) + sizeof(struct tcpip_hdr))
+#define TRACE_LEN_MAX (PKT_TMPL_MAX - ETH_CRC_LEN)
+
+static inline void __trace_to_info(const struct trace_rec *rec,
+				struct pkt_seq_info *info)
+{
+	info->src_ip = rec->src_ip;
+	info->dst_ip = rec->dst_ip;
+	info->src_port = rec->src_port;
+	info->dst_port = rec->dst_port;
+	info->proto = (rec->proto == IPPROTO_TCP) ? IPPROTO_TCP : IPPROTO_UDP;
+	info->pkt_len = RTE_MIN(RTE_MAX(rec->pkt_len, TRACE_LEN_MIN),
+					TRACE_LEN_MAX);
+}
+
+static int __process_tx_trace(int portid, struct tx_ctl *ctl)
+{
+	struct trace_rec rec[TX_BURST];
+	unsigned int cnt = 0, i = 0;
+	uint64_t start_cyc = 0;
+	int ret = 0;
+
+	start_cyc = rte_get_tsc_cycles();
+	if (!__tx_rate_sync(ctl, start_cyc)
+			|| start_cyc < ctl->tx_rate.next_tx_cycle)
+		return 0;
+
+	if (ctl->len <= 0) {
+		while (cnt < TX_BURST) {
+			ret = trace_reader_next(ctl->trace, &rec[cnt]);
+			if (ret < 0)
+				break;
+			cnt++;
+		}
+
+		if (cnt == 0)
+			return (ret == -ENOENT) ? -ENOENT : 0;
+
+		ret = __pktmbuf_alloc_bulk(ctl->tx_mp, ctl->mbuf_tbl, cnt);
+		if (ret != 0) {
+			ctl->len = 0;
+			ctl->offset = 0;
+			return -ENOMEM;
+		}
+
+		for (i = 0; i < cnt; i++) {
+			__trace_to_info(&rec[i], &ctl->pkt_info);
+			pkt_seq_fill_mbuf(ctl->mbuf_tbl[i], &ctl->pkt_info);
+		}
+
+		ctl->len = cnt;
+		ctl->offset = 0;
+	}
+
+	__tx_flush(portid, ctl, start_cyc, true);
+	return 0;
+}
+
+/* return -ENOENT once the input is exhausted */
+static int __process_tx(int portid, struct tx_ctl *ctl)
 {
 	int ret = 0;
 	struct rte_mbuf **pkts = NULL;
 	struct rate_ctl *rate = &ctl->tx_rate;
 	unsigned int cnt = 0, i = 0;
-	unsigned int sum = 0;
 	uint64_t start_cyc = 0;
 
+	__tx_probe_poll(portid, ctl);
+
+	if (ctl->tx_type == TX_TYPE_PCAP)
+		return __process_tx_pcap(portid, ctl);
+	else if (ctl->tx_type == TX_TYPE_5TUPLE_TRACE)
+		return __process_tx_trace(portid, ctl);
+
 	start_cyc = rte_get_tsc_cycles();
-	if (start_cyc < rate->next_tx_cycle) {
+	if (!__tx_rate_sync(ctl, start_cyc)
+			|| start_cyc < rate->next_tx_cycle) {
 		return 0;
 	}
 
@@ -199,13 +1025,20 @@ static int __process_tx(int portid __rte_unused, struct tx_ctl *ctl)
 			pkts = ctl->mbuf_tbl;
 			cnt = TX_BURST;
 
-			for (i = 0; i < cnt; i++) {
-				__pkt_setup(pkts[i], ctl->tx_type, &ctl->pkt_info);
+			if (ctl->nb_zc > 0) {
+				for (i = 0; i < cnt; i++)
+					__zc_setup(pkts[i], ctl);
+			} else {
+				for (i = 0; i < cnt; i++)
+					__pkt_setup(pkts[i], ctl);
 			}
 
 			ctl->len = TX_BURST;
 			ctl->offset = 0;
 
+			if (tx_inband > 0)
+				__inband_mark(ctl, cnt);
+
 		} else {
 			ctl->len = 0;
 			ctl->offset = 0;
@@ -213,56 +1046,255 @@ static int __process_tx(int portid __rte_unused, struct tx_ctl *ctl)
 		}
 	}
 
-	pkts = &ctl->mbuf_tbl[ctl->offset];
-	ret = rte_eth_tx_burst(portid, 0, pkts, ctl->len);
-	ctl->len -= ret;
-	ctl->offset += ret;
-
-	sum = (ctl->pkt_info.pkt_len + ETH_CRC_LEN) * ret;
-	stat_update_tx(sum, ret);
-	rate_set_next_cycle(&ctl->tx_rate, start_cyc, sum);
+	__tx_flush(portid, ctl, start_cyc, true);
 	return 0;
 }
 
 
 /**** RX ****/
-struct rte_mbuf *rx_buf[RX_BURST] = {NULL};
+/*
+ * Receive time of rx_buf[i]: the TSC read before rx_burst (start), a new
+ * read, or start plus the share of the rx_burst call (up to end) that
+ * comes before it. It is moved to the TSC of the reference lcore, as the
+ * send times are.
+ */
+static inline uint64_t __rx_stamp(struct rx_ctl *ctl, unsigned int i,
+				uint16_t nb_rx, uint64_t start, uint64_t end)
+{
+	uint64_t cyc = start;
+
+	ctl->stamp_pkts++;
+	if (rx_stamp == RX_STAMP_PKT) {
+		ctl->stamp_reads++;
+		cyc = rte_get_tsc_cycles();
+	} else if (rx_stamp == RX_STAMP_INTERP) {
+		cyc = start + (end - start) * i / nb_rx;
+	}
+	return cyc - ctl->tsc_off;
+}
 
-static void __rx_stat(struct rte_mbuf *pkt, uint64_t recv_cyc)
+/* In-band samples among the data packets, which stay counted as data */
+static inline void __rx_inband(struct rx_ctl *ctl, uint32_t data_mask,
+				uint16_t nb_rx, uint64_t recv_cyc, uint64_t end_cyc)
 {
-	uint32_t probe_idx = 0;
-//	int ret = 0;
+	const struct pkt_trailer *t = NULL;
+	struct rte_mbuf *pkt = NULL;
+	uint32_t mask = 0;
+	unsigned int i = 0;
+
+	data_mask &= (uint32_t)((1ULL << nb_rx) - 1);
+
+	/* the trailer is usually on another cache line than the headers */
+	for (mask = data_mask; mask != 0; mask &= mask - 1) {
+		pkt = ctl->rx_buf[__builtin_ctz(mask)];
+		rte_prefetch0(rte_pktmbuf_mtod_offset(pkt, void *,
+						pkt->data_len - ETH_CRC_LEN - 1));
+	}
 
-	if (pkt_seq_get_idx(pkt, &probe_idx) < 0) {
-		LOG_DEBUG("RX packet");
-		stat_update_rx(pkt->data_len);
-	} else {
-		stat_update_rx_probe(probe_idx, pkt->data_len, recv_cyc);
+	for (mask = data_mask; mask != 0; mask &= mask - 1) {
+		i = __builtin_ctz(mask);
+		t = pkt_seq_get_trailer(ctl->rx_buf[i]);
+		if (t != NULL && t->sender < STAT_SENDER_MAX)
+			stat_record_rx_probe(ctl->stat, t->cls, t->sender, t->idx,
+							__rx_stamp(ctl, i, nb_rx, recv_cyc, end_cyc),
+							t->send_cycle);
+	}
+}
+
+/* Data packets are accounted once per burst, probes one by one */
+static void __rx_stat(struct rx_ctl *ctl, uint16_t nb_rx, uint64_t recv_cyc,
+				uint64_t end_cyc)
+{
+	struct rte_mbuf *pkt = NULL;
+	struct pkt_probe *probe = NULL;
+	uint32_t probe_mask = 0, mask = 0;
+	uint64_t bytes = 0;
+	uint16_t i = 0, idx = 0, nb_data = 0;
+
+	RTE_BUILD_BUG_ON(RX_BURST > PKT_SEQ_CLASSIFY_MAX);
+
+	probe_mask = pkt_seq_classify(ctl->rx_buf, nb_rx);
+	for (i = 0; i < nb_rx; i++)
+		bytes += ctl->rx_buf[i]->data_len;
+
+	for (mask = probe_mask; mask != 0; mask &= mask - 1) {
+		idx = __builtin_ctz(mask);
+		pkt = ctl->rx_buf[idx];
+		probe = rte_pktmbuf_mtod(pkt, struct pkt_probe *);
+
+		/* not one of ours, count it as data */
+		if (unlikely(probe->probe_class >= PKT_PROBE_CLASS_MAX)) {
+			probe_mask &= ~(1U << idx);
+			continue;
+		}
+		bytes -= pkt->data_len;
+
+		/* probes all leave through TX lcore 0 */
+		stat_update_rx_probe(ctl->stat, probe->probe_class, 0,
+						probe->probe_idx, pkt->data_len,
+						__rx_stamp(ctl, idx, nb_rx, recv_cyc, end_cyc),
+						probe->send_cycle);
 		LOG_DEBUG("RX packet %u, len %u, recv_cyc %lu",
-						probe_idx, pkt->data_len,
+						probe->probe_idx, pkt->data_len,
 						(unsigned long)recv_cyc);
 	}
+
+	nb_data = nb_rx - __builtin_popcount(probe_mask);
+	if (nb_data > 0)
+		stat_update_rx(ctl->stat, bytes, nb_data);
+
+	if (tx_inband > 0)
+		__rx_inband(ctl, ~probe_mask, nb_rx, recv_cyc, end_cyc);
+}
+
+static inline struct rte_mempool_cache *__mp_cache(struct rte_mempool *mp)
+{
+#if RTE_VERSION >= RTE_VERSION_NUM(16, 7, 0, 0)
+	return rte_mempool_default_cache(mp, rte_lcore_id());
+#else
+	if (mp->cache_size == 0 || rte_lcore_id() >= RTE_MAX_LCORE)
+		return NULL;
+	return &mp->local_cache[rte_lcore_id()];
+#endif
+}
+
+static inline void __rx_put_bulk(struct rx_ctl *ctl, struct rte_mempool *mp,
+				void **objs, unsigned int cnt)
+{
+	struct rte_mempool_cache *cache = __mp_cache(mp);
+	uint32_t len = (cache != NULL) ? cache->len : 0;
+
+	rte_mempool_put_bulk(mp, objs, cnt);
+
+	/* the cache flushed into the shared ring, or there is none: the
+	 * put went through the pool OVS allocates from */
+	if (cache == NULL || cache->len < len + cnt)
+		ctl->cache_spill++;
+	ctl->free_bulk++;
+	ctl->free_pkts += cnt;
+	ctl->last_pool = mp;
+}
+
+/*
+ * Return a received burst to the mempools. Single segment mbufs that are
+ * no longer referenced are grouped by pool and put back in bulk, chained
+ * ones take the rte_pktmbuf_free path.
+ */
+static inline void __rx_free_bulk(struct rx_ctl *ctl, struct rte_mbuf **pkts,
+				uint16_t nb_pkts)
+{
+	void *objs[RX_BURST];
+	struct rte_mempool *mp = NULL;
+	struct rte_mbuf *m = NULL;
+	unsigned int cnt = 0;
+	uint16_t i = 0;
+
+	for (i = 0; i < nb_pkts; i++) {
+		m = pkts[i];
+		if (unlikely(m->next != NULL)) {
+			rte_pktmbuf_free(m);
+			ctl->free_slow++;
+			continue;
+		}
+
+		/* NULL if still referenced elsewhere */
+		m = rte_pktmbuf_prefree_seg(m);
+		if (unlikely(m == NULL))
+			continue;
+
+		if (unlikely(m->pool != mp)) {
+			if (cnt > 0)
+				__rx_put_bulk(ctl, mp, objs, cnt);
+			mp = m->pool;
+			cnt = 0;
+		}
+		objs[cnt++] = m;
+	}
+
+	if (cnt > 0)
+		__rx_put_bulk(ctl, mp, objs, cnt);
+}
+
+static void __rx_report_free(struct rx_ctl *ctl)
+{
+	if (ctl->free_bulk == 0 && ctl->free_slow == 0)
+		return;
+
+	LOG_INFO("rx %u freed %lu mbufs in %lu bulks (%.1lf per bulk), "
+					"%lu chained one by one", ctl->inst,
+					(unsigned long)ctl->free_pkts,
+					(unsigned long)ctl->free_bulk,
+					ctl->free_bulk ? (double)ctl->free_pkts
+						/ ctl->free_bulk : 0.0,
+					(unsigned long)ctl->free_slow);
+
+	if (ctl->last_pool == NULL)
+		return;
+
+	/* rte_mempool_cache has no size before 16.07, the pool has it in all */
+	LOG_INFO("rx %u mempool %s: lcore cache size %u, %lu of %lu bulk puts "
+					"reached the shared ring (%.2lf%%)", ctl->inst,
+					ctl->last_pool->name,
+					(unsigned)ctl->last_pool->cache_size,
+					(unsigned long)ctl->cache_spill,
+					(unsigned long)ctl->free_bulk,
+					(double)ctl->cache_spill * 100 / ctl->free_bulk);
 }
 
-static int __process_rx(int portid)
+static void __rx_report_stamp(struct rx_ctl *ctl)
 {
-	uint16_t nb_rx, i = 0;
-	uint64_t recv_cyc = 0;
+	double cyc_per_usec = (double)rte_get_tsc_hz() / 1000000;
+
+	if (ctl->stamp_pkts == 0)
+		return;
+
+	LOG_INFO("rx %u stamping (%s): %lu probes and samples, %lu extra TSC "
+					"reads, about %.3lf us in total", ctl->inst,
+					rx_stamp_name[rx_stamp],
+					(unsigned long)ctl->stamp_pkts,
+					(unsigned long)ctl->stamp_reads,
+					ctl->stamp_reads * tsc_read_cyc / cyc_per_usec);
+}
+
+static int __process_rx(int portid, struct rx_ctl *ctl)
+{
+	uint16_t nb_rx = 0;
+	uint64_t recv_cyc = 0, end_cyc = 0;
 
 	recv_cyc = rte_get_tsc_cycles();
-	nb_rx = rte_eth_rx_burst(portid, 0, rx_buf, RX_BURST);
+	nb_rx = rte_eth_rx_burst(portid, 0, ctl->rx_buf, RX_BURST);
 	if (nb_rx == 0)
 		return 0;
 
-	for (i = 0; i < nb_rx; i++) {
-		__rx_stat(rx_buf[i], recv_cyc);
-		rte_pktmbuf_free(rx_buf[i]);
+	end_cyc = recv_cyc;
+	if (rx_stamp == RX_STAMP_INTERP) {
+		end_cyc = rte_get_tsc_cycles();
+		ctl->stamp_reads++;
 	}
+
+	__rx_stat(ctl, nb_rx, recv_cyc, end_cyc);
+	__rx_free_bulk(ctl, ctl->rx_buf, nb_rx);
 	return 0;
 }
 
-void rxtx_thread_run_rx(int portid)
+/* Per-lcore contexts live in the lcore's own NUMA node */
+static struct tx_ctl *__tx_ctl_alloc(void)
 {
+	return rte_zmalloc_socket("pktgen: tx_ctl", sizeof(struct tx_ctl),
+					RTE_CACHE_LINE_SIZE, rte_socket_id());
+}
+
+static struct rx_ctl *__rx_ctl_alloc(void)
+{
+	return rte_zmalloc_socket("pktgen: rx_ctl", sizeof(struct rx_ctl),
+					RTE_CACHE_LINE_SIZE, rte_socket_id());
+}
+
+void rxtx_thread_run_rx(struct rxtx_param *param)
+{
+	struct rx_ctl *ctl = NULL;
+	unsigned int inst = param->inst;
+
 	/* waiting for stat thread */
 	while (ctl_get_state(WORKER_STAT) == STATE_UNINIT && !ctl_is_stop()) {}
 
@@ -270,33 +1302,85 @@ void rxtx_thread_run_rx(int portid)
 					|| ctl_get_state(WORKER_STAT) == STATE_ERROR)
 		return;
 
-	if (portid < 0) {
-		LOG_ERROR("Invalid parameters, portid %d", portid);
-		ctl_set_state(WORKER_RX, STATE_ERROR);
+	if (param->recv < 0) {
+		LOG_ERROR("Invalid parameters, portid %d", param->recv);
+		ctl_set_inst_state(WORKER_RX, inst, STATE_ERROR);
 		return;
 	}
 
-	LOG_INFO("rx running on lcore %u", rte_lcore_id());
+	ctl = __rx_ctl_alloc();
+	if (ctl == NULL) {
+		LOG_ERROR("Failed to allocate RX context");
+		ctl_set_inst_state(WORKER_RX, inst, STATE_ERROR);
+		return;
+	}
+	ctl->portid = param->recv;
+	ctl->inst = inst;
+	ctl->stat = stat_get_shard();
+	ctl->tsc_off = tsc_get_offset(rte_lcore_id());
 
-	ctl_set_state(WORKER_RX, STATE_INITED);
+	LOG_INFO("rx %u running on lcore %u, port %d",
+					inst, rte_lcore_id(), ctl->portid);
 
-	while (!ctl_is_stop()) {
-		if (__process_rx(portid) < 0) {
+	ctl_set_inst_state(WORKER_RX, inst, STATE_INITED);
+
+	while (!ctl_is_stop() && ctl_get_state(WORKER_STAT) != STATE_STOPPED) {
+		if (__process_rx(ctl->portid, ctl) < 0) {
 			LOG_ERROR("RX error!");
 			break;
 		}
 	}
 
-	ctl_set_state(WORKER_RX, STATE_STOPPED);
+	__rx_report_free(ctl);
+	__rx_report_stamp(ctl);
+	rte_free(ctl);
+	ctl_set_inst_state(WORKER_RX, inst, STATE_STOPPED);
 }
 
 #define MAX_RETRY 3
 
-void rxtx_thread_run_tx(int portid,
-				struct rte_mempool *mp, unsigned tx_type,
-				struct pkt_seq_info *seq, const char *filename)
+/* Cycle of the next data departure, 0 if the TX lcore should not wait */
+static inline uint64_t __tx_data_next_cycle(struct tx_ctl *ctl)
+{
+	/* unless smooth pacing holds them back, leftovers go out at once */
+	if (ctl->len > 0 && (!tx_smooth || ctl->tx_type == TX_TYPE_PCAP))
+		return 0;
+
+	if (ctl->tx_type == TX_TYPE_PCAP) {
+		if (!pcap_orig_timing || ctl->pcap_done)
+			return 0;
+		return ctl->pcap_base + ctl->pcap->ts_cyc[ctl->pcap_idx];
+	}
+	return ctl->tx_rate.next_tx_cycle;
+}
+
+/* Wake up in time to send waiting probes, or to take new ones, and
+ * often enough to see a stop */
+static inline uint64_t __tx_next_cycle(struct tx_ctl *ctl)
+{
+	uint64_t next = __tx_data_next_cycle(ctl), probe = 0;
+	uint64_t now = 0;
+
+	if (next == 0)
+		return next;
+
+	now = rte_get_tsc_cycles();
+	next = RTE_MIN(next, now + ctl->stop_wait_cyc);
+	if (ctl->probe_ring == NULL)
+		return next;
+
+	if (ctl->nb_probe > 0)
+		probe = ctl->probe_since + ctl->probe_wait_cyc;
+	else
+		probe = now + ctl->probe_wait_cyc;
+	return RTE_MIN(next, probe);
+}
+
+void rxtx_thread_run_tx(struct rxtx_param *param)
 {
-//	int ret = 0;
+	int ret = 0;
+	struct tx_ctl *ctl = NULL;
+	unsigned int inst = param->inst;
 //	unsigned int tx_retry = 0;
 
 	/* waiting for stat thread */
@@ -306,31 +1390,43 @@ void rxtx_thread_run_tx(int portid,
 					|| ctl_get_state(WORKER_STAT) == STATE_ERROR)
 		return;
 
-	if (portid < 0 || mp == NULL || tx_type >= TX_TYPE_MAX) {
+	if (param->sender < 0 || param->mp == NULL
+			|| param->tx_type >= TX_TYPE_MAX) {
 		LOG_ERROR("Invalid parameters, portid %d, tx type %u",
-						portid, tx_type);
-		ctl_set_state(WORKER_TX, STATE_ERROR);
+						param->sender, param->tx_type);
+		ctl_set_inst_state(WORKER_TX, inst, STATE_ERROR);
 		return;
 	}
 
-	if (!__tx_init(tx_type, mp, seq, filename)) {
+	ctl = __tx_ctl_alloc();
+	if (ctl == NULL || !__tx_init(ctl, param)) {
 		LOG_ERROR("Failed to initialize TX");
-		ctl_set_state(WORKER_TX, STATE_ERROR);
+		rte_free(ctl);
+		ctl_set_inst_state(WORKER_TX, inst, STATE_ERROR);
 		return;
 	}
+	ctl->portid = param->sender;
 
-	LOG_INFO("tx running on lcore %u", rte_lcore_id());
+	LOG_INFO("tx %u running on lcore %u, port %d, rate %lu bps",
+					inst, rte_lcore_id(), ctl->portid,
+					(unsigned long)ctl->tx_rate.rate_bps);
 
 //	tx_seq_iter = 0;
 
-	ctl_set_state(WORKER_TX, STATE_INITED);
+	ctl_set_inst_state(WORKER_TX, inst, STATE_INITED);
 
 	while (!ctl_is_stop()) {
 		/* TX */
-		if (__process_tx(portid, &tx_ctl) < 0) {
+		ret = __process_tx(ctl->portid, ctl);
+		if (ret == -ENOENT) {
+			LOG_INFO("TX finished");
+			break;
+		} else if (ret < 0) {
 			LOG_ERROR("TX error!");
 			break;
 		}
+
+		rate_wait_for_time(__tx_next_cycle(ctl), tx_wait);
 //		ret = __process_tx(portid, mp, seq, true, 0);
 //		if (ret == -ERANGE || ret == -ENOMEM) {
 //			LOG_ERROR("TX error!");
@@ -348,19 +1444,21 @@ void rxtx_thread_run_tx(int portid,
 //		}
 	}
 
-	if (tx_ctl.trace != NULL)
-		fclose(tx_ctl.trace);
+	__tx_report_gap(ctl);
+	__tx_report_probe(ctl);
+	__tx_cleanup(ctl);
+	rte_free(ctl);
 
-	ctl_set_state(WORKER_TX, STATE_STOPPED);
+	ctl_set_inst_state(WORKER_TX, inst, STATE_STOPPED);
 }
 
-void rxtx_thread_run_rxtx(int sender, int recv,
-				struct rte_mempool *mp, unsigned tx_type,
-				struct pkt_seq_info *seq __rte_unused,
-				const char *filename __rte_unused)
+void rxtx_thread_run_rxtx(struct rxtx_param *param)
 {
-//	int ret = 0;
+	int ret = 0;
 	bool is_tx_err = false, is_rx_err = false;
+	struct tx_ctl *tx = NULL;
+	struct rx_ctl *rx = NULL;
+	unsigned int inst = param->inst;
 //	unsigned int tx_retry = 0;
 //	uint64_t stop_cycle = 0;
 
@@ -371,30 +1469,53 @@ void rxtx_thread_run_rxtx(int sender, int recv,
 					ctl_get_state(WORKER_STAT) == STATE_STOPPED)
 		return;
 
-	if (sender < 0 || recv < 0 || mp == NULL || tx_type >= TX_TYPE_MAX) {
+	if (param->sender < 0 || param->recv < 0 || param->mp == NULL
+			|| param->tx_type >= TX_TYPE_MAX) {
 		LOG_ERROR("Invalid parameters, sender %d, recv %d, tx type %u",
-						sender, recv, tx_type);
-		ctl_set_state(WORKER_TX, STATE_ERROR);
-		ctl_set_state(WORKER_RX, STATE_ERROR);
+						param->sender, param->recv, param->tx_type);
+		ctl_set_inst_state(WORKER_TX, inst, STATE_ERROR);
+		ctl_set_inst_state(WORKER_RX, inst, STATE_ERROR);
 		return;
 	}
 
-	if (!__tx_init(tx_type, mp, seq, filename)) {
+	tx = __tx_ctl_alloc();
+	rx = __rx_ctl_alloc();
+	if (tx == NULL || rx == NULL) {
+		LOG_ERROR("Failed to allocate RX/TX context");
+		rte_free(tx);
+		rte_free(rx);
+		ctl_set_inst_state(WORKER_TX, inst, STATE_ERROR);
+		ctl_set_inst_state(WORKER_RX, inst, STATE_ERROR);
+		return;
+	}
+	tx->portid = param->sender;
+	rx->portid = param->recv;
+	rx->inst = inst;
+	rx->stat = stat_get_shard();
+	rx->tsc_off = tsc_get_offset(rte_lcore_id());
+
+	if (!__tx_init(tx, param)) {
 		LOG_ERROR("Failed to initialize TX");
-		ctl_set_state(WORKER_TX, STATE_ERROR);
+		ctl_set_inst_state(WORKER_TX, inst, STATE_ERROR);
 		is_tx_err = true;
 	}
 
 	LOG_INFO("tx running on lcore %u", rte_lcore_id());
 
-	ctl_set_state(WORKER_TX, STATE_INITED);
-	ctl_set_state(WORKER_RX, STATE_INITED);
+	if (!is_tx_err)
+		ctl_set_inst_state(WORKER_TX, inst, STATE_INITED);
+	ctl_set_inst_state(WORKER_RX, inst, STATE_INITED);
 
 	while (!ctl_is_stop()) {
 		/* TX */
 		if (!is_tx_err) {
 //			cycle = rte_get_tsc_cycles();
-			if (__process_tx(sender, &tx_ctl) < 0) {
+			ret = __process_tx(tx->portid, tx);
+			if (ret == -ENOENT) {
+				is_tx_err = true;
+				LOG_INFO("TX finished");
+				ctl_set_inst_state(WORKER_TX, inst, STATE_STOPPED);
+			} else if (ret < 0) {
 				is_tx_err = true;
 				LOG_ERROR("TX error!");
 			}
@@ -402,20 +1523,26 @@ void rxtx_thread_run_rxtx(int sender, int recv,
 
 		/* RX */
 		if (!is_rx_err) {
-			if (__process_rx(recv) < 0) {
+			if (__process_rx(rx->portid, rx) < 0) {
 				LOG_ERROR("RX error!");
 				is_rx_err = true;
 			}
 		}
 
 		/* Check state */
-		if (is_tx_err && is_rx_err)
+		if (is_tx_err && (is_rx_err
+					|| ctl_get_state(WORKER_STAT) == STATE_STOPPED))
 			break;
 	}
 
-	if (tx_ctl.trace != NULL)
-		fclose(tx_ctl.trace);
+	__tx_report_gap(tx);
+	__tx_report_probe(tx);
+	__rx_report_free(rx);
+	__rx_report_stamp(rx);
+	__tx_cleanup(tx);
+	rte_free(tx);
+	rte_free(rx);
 
-	ctl_set_state(WORKER_TX, STATE_STOPPED);
-	ctl_set_state(WORKER_RX, STATE_STOPPED);
+	ctl_set_inst_state(WORKER_TX, inst, STATE_STOPPED);
+	ctl_set_inst_state(WORKER_RX, inst, STATE_STOPPED);
 }
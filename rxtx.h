@@ -2,22 +2,39 @@
 #define _PKTGEN_RXTX_H_
 
 #include <stdbool.h>
+#include <rte_memory.h>
 
 #include "pkt_seq.h"
 #include "rate.h"
+#include "hist.h"
+#include "flow.h"
 
 struct rte_mempool;
+struct rte_ring;
 struct pkt_seq_info;
 struct rate_ctl;
+struct pcap_arena;
+struct trace_reader;
+struct stat_shard;
+struct pkt_size_dist;
 
 enum {
 	TX_TYPE_SINGLE = 0,
 	TX_TYPE_RANDOM,
 	TX_TYPE_5TUPLE_TRACE,
 	TX_TYPE_PCAP,
+	TX_TYPE_FLOW,
 	TX_TYPE_MAX,
 };
 
+/* How RX lcores timestamp the probes and samples of a burst */
+enum {
+	RX_STAMP_BURST = 0,	/* the TSC read before rx_burst, for all */
+	RX_STAMP_PKT,		/* a TSC read per probe as it is looked at */
+	RX_STAMP_INTERP,	/* spread between the reads around rx_burst */
+	RX_STAMP_MAX,
+};
+
 #define DEFAULT_PKT_BURST 32
 #define RX_BURST DEFAULT_PKT_BURST
 #define TX_BURST DEFAULT_PKT_BURST
@@ -25,33 +42,190 @@ enum {
 #define DEFAULT_PRIV_SIZE 0
 #define MBUF_SIZE (RTE_MBUF_DEFAULT_BUF_SIZE + DEFAULT_PRIV_SIZE)
 
+/* Pre-built packets are taken from the shared mempool for the whole run */
+#define TX_ZC_PKTS_MAX 4096
+
+/*
+ * Probes from the measure lcore reach TX lcore 0 through a single producer,
+ * single consumer ring and go out at the head of its next burst. Without
+ * data to send they go alone once they waited TX_PROBE_WAIT_USEC.
+ */
+#define TX_PROBE_RING_SIZE 1024
+#define TX_PROBE_BURST 8
+#define TX_PROBE_WAIT_USEC 10
+
+/* Longest a TX lcore waits without checking for stop, slow rates leave
+ * seconds between bursts */
+#define TX_STOP_WAIT_USEC 1000
+
+/* Per-lcore TX context, only touched by its own lcore */
 struct tx_ctl {
 	unsigned int tx_type;
+	unsigned int inst;
+	int portid;
+	struct stat_shard *stat;
 
 	struct rte_mempool *tx_mp;
 
 	struct pkt_seq_info pkt_info;
 
+	/* for TX_TYPE_SINGLE, TX_TYPE_RANDOM and TX_TYPE_FLOW */
+	struct pkt_tmpl tmpl;
+
+	/* for flow sets */
+	const struct flow_table *flows;
+	struct flow_base flow_base;
+	struct flow_cursor flow_cur;
+
+	/* NULL when all packets have the template length */
+	const struct pkt_size_dist *sizes;
+
+	/* zero-copy TX: pre-built packets sent through indirect mbufs */
+	struct rte_mbuf **zc_pkts;
+	unsigned int nb_zc;
+	unsigned int zc_idx;
+
 	/* fot 5-tuple trace */
-	FILE *trace;
+	struct trace_reader *trace;
+
+	/* for pcap replay */
+	struct pcap_arena *pcap;
+	uint32_t pcap_idx;
+	uint32_t pcap_pass;
+	uint64_t pcap_base;	/* cycle at which the current pass started */
+	bool pcap_done;
+
+	/* probes to splice, only on TX lcore 0 */
+	struct rte_ring *probe_ring;
+	struct rte_mbuf *probe_tbl[TX_PROBE_BURST];
+	unsigned int nb_probe;
+	uint64_t probe_since;	/* cycle at which the oldest one was taken */
+	uint64_t probe_wait_cyc;
+	uint64_t probe_spliced;	/* sent ahead of data packets */
+	uint64_t probe_alone;	/* sent without data to carry them */
+
+	/* in-band samples among the generated packets */
+	unsigned int inband_left;	/* packets before the next sample */
+	uint32_t inband_next;		/* index of the next sample */
+	uint32_t inband_mask;		/* samples in mbuf_tbl, bit per slot */
+	uint32_t inband_idx[TX_BURST];
+	uint64_t inband_sent;
+	uint64_t inband_short;		/* packets too short when one was due */
+
+	/* cost of stamping probes and samples before their burst */
+	uint64_t stamp_cyc;
+	uint64_t stamp_pkts;
+
+	/* TSC offset of this lcore, removed from the stamped cycles */
+	int64_t tsc_off;
 
 	struct rate_ctl tx_rate;
+	uint64_t stop_wait_cyc;
+
+	/* achieved inter-departure gaps, in cycles */
+	struct hist gap;
+	uint64_t last_tx_cycle;
 
 	unsigned int len;
 	unsigned int offset;
 	struct rte_mbuf *mbuf_tbl[TX_BURST];
+} __rte_cache_aligned;
+
+/* Per-lcore RX context */
+struct rx_ctl {
+	unsigned int inst;
+	int portid;
+	struct stat_shard *stat;
+	struct rte_mbuf *rx_buf[RX_BURST];
+
+	/* how received mbufs went back to their mempools */
+	uint64_t free_bulk;	/* rte_mempool_put_bulk calls */
+	uint64_t free_pkts;	/* mbufs returned by them */
+	uint64_t free_slow;	/* chained mbufs freed one by one */
+	uint64_t cache_spill;	/* bulk puts not absorbed by the lcore cache */
+	struct rte_mempool *last_pool;
+
+	/* TSC reads beyond the one per burst, for the RX_STAMP_* mode */
+	uint64_t stamp_reads;
+	uint64_t stamp_pkts;
+
+	/* TSC offset of this lcore, removed from the receive cycles */
+	int64_t tsc_off;
+} __rte_cache_aligned;
+
+struct rxtx_param {
+	unsigned int inst;	/* index among the lcores of the same role */
+	int sender;
+	int recv;
+	struct rte_mempool *mp;
+	unsigned tx_type;
+	struct pkt_seq_info *seq;
+	const char *filename;
 };
 
-void rxtx_thread_run_rxtx(int sender, int recv,
-				struct rte_mempool *mp, unsigned tx_type,
-				struct pkt_seq_info *seq, const char *filename);
+/* Load shared TX input, must be called before the workers start */
+bool rxtx_init(unsigned tx_type, const char *filename, unsigned nb_tx);
 
-void rxtx_thread_run_rx(int portid);
+void rxtx_cleanup(void);
 
-void rxtx_thread_run_tx(int portid,
-				struct rte_mempool *mp, unsigned tx_type,
-				struct pkt_seq_info *seq, const char *filename);
+void rxtx_thread_run_rxtx(struct rxtx_param *param);
+
+void rxtx_thread_run_rx(struct rxtx_param *param);
+
+void rxtx_thread_run_tx(struct rxtx_param *param);
 
 void rxtx_set_rate(const char *rate_str);
 
+/* Aggregate rate given with -r (or the default), in bps */
+uint64_t rxtx_get_rate(void);
+
+/* Account preamble and inter-frame gap in the TX rate (line rate) */
+void rxtx_set_l1_rate(bool l1);
+
+/* How dedicated TX lcores wait between departures, RATE_WAIT_* */
+void rxtx_set_wait(unsigned int mode);
+
+/* Number of passes over the input file, 0 for endless */
+void rxtx_set_loops(unsigned int loops);
+
+/* Replay pcap with the captured inter-packet gaps instead of at full speed */
+void rxtx_set_pcap_timing(bool orig);
+
+/* Pace every packet on its own instead of every burst */
+void rxtx_set_smooth(bool smooth);
+
+/* Frame length distribution of generated packets, see pkt_size_parse */
+bool rxtx_set_sizes(const char *spec);
+
+/* Send indirect mbufs attached to nb_pkts pre-built packets per TX lcore
+ * instead of copying each packet, 0 to copy. A flow set must not have
+ * more flows than nb_pkts. */
+void rxtx_set_zero_copy(unsigned int nb_pkts);
+
+/*
+ * Turn every nb_pkts-th generated data packet into an in-band sample: a
+ * pkt_trailer at the end of its payload, stamped right before it is sent,
+ * counted in probe class PKT_PROBE_CLASS_INBAND. Each TX lcore samples its
+ * own packets, their indices interleave. 0 to disable.
+ */
+void rxtx_set_inband(unsigned int nb_pkts);
+
+unsigned int rxtx_get_inband(void);
+
+/* Format: burst (default), pkt or interp, see RX_STAMP_* */
+bool rxtx_set_rx_stamp(const char *mode);
+
+/* Inter-arrival process of the data packets, implies smooth pacing
+ * unless const */
+void rxtx_set_arrival(const struct rate_dist *dist);
+
+/* Queue a probe for TX lcore 0, which stamps and sends it with its next
+ * burst. Must only be called from one lcore. false if the queue is full,
+ * the mbuf is then still owned by the caller. */
+bool rxtx_inject_probe(struct rte_mbuf *m);
+
+/* Change the aggregate TX rate of running TX lcores, 0 pauses them.
+ * Pcap replay is not paced and ignores it. */
+void rxtx_publish_rate(uint64_t bps);
+
 #endif /* _PKTGEN_RXTX_H_ */
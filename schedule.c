@@ -0,0 +1,322 @@
+#include "util.h"
+#include "schedule.h"
+#include "rate.h"
+#include "rxtx.h"
+
+#include <math.h>
+#include <rte_cycles.h>
+
+#define SCHED_SPEC_MAX 256
+#define SCHED_LINE_MAX 256
+#define SCHED_ARG_MAX 5
+
+static struct sched_point sched_pts[SCHED_POINT_MAX];
+static unsigned int nb_pts = 0;
+static uint64_t sched_period = 0;	/* usec, 0 to hold the last rate */
+
+/* Only touched by the thread running the schedule */
+static unsigned int sched_cur = 0;
+static uint64_t sched_start_cycle = 0;
+static uint64_t sched_next_cycle = 0;
+static uint64_t sched_tick = 0;
+static uint64_t sched_bps = 0;
+static double cycle_per_usec = 0;
+
+static bool __parse_sec(const char *str, uint64_t *usec)
+{
+	double val = 0;
+	char *end = NULL;
+
+	errno = 0;
+	val = strtod(str, &end);
+	if (errno != 0 || end == str || *end != '\0' || val < 0) {
+		LOG_ERROR("Wrong time %s", str);
+		return false;
+	}
+	*usec = (uint64_t)(val * 1000000);
+	return true;
+}
+
+static bool __add_point(uint64_t usec, uint64_t bps, bool ramp)
+{
+	if (nb_pts >= SCHED_POINT_MAX) {
+		LOG_ERROR("More than %u points in the rate schedule",
+						SCHED_POINT_MAX);
+		return false;
+	}
+
+	if (nb_pts > 0 && usec <= sched_pts[nb_pts - 1].usec) {
+		LOG_ERROR("Schedule times must increase, %.6lf after %.6lf",
+						usec / 1e6, sched_pts[nb_pts - 1].usec / 1e6);
+		return false;
+	}
+
+	sched_pts[nb_pts].usec = usec;
+	sched_pts[nb_pts].bps = bps;
+	sched_pts[nb_pts].ramp = ramp;
+	nb_pts++;
+	return true;
+}
+
+static bool __build_step(uint64_t from, uint64_t to, uint64_t inc,
+				uint64_t usec)
+{
+	uint64_t bps = from, t = 0;
+
+	if (inc == 0 || usec == 0) {
+		LOG_ERROR("Stair height and length must not be 0");
+		return false;
+	}
+
+	while (true) {
+		if (!__add_point(t, bps, false))
+			return false;
+		if (bps == to)
+			break;
+
+		t += usec;
+		if (from < to)
+			bps = (to - bps > inc) ? bps + inc : to;
+		else
+			bps = (bps - to > inc) ? bps - inc : to;
+	}
+	return true;
+}
+
+static bool __build_sine(uint64_t min, uint64_t max, uint64_t period)
+{
+	unsigned int k = 0;
+	double phase = 0;
+
+	if (min > max || period < SCHED_SINE_STEPS) {
+		LOG_ERROR("Wrong sine schedule");
+		return false;
+	}
+
+	/* start from the bottom of the wave */
+	for (k = 0; k <= SCHED_SINE_STEPS; k++) {
+		phase = 2 * M_PI * k / SCHED_SINE_STEPS;
+		if (!__add_point(period * k / SCHED_SINE_STEPS,
+							min + (uint64_t)((max - min)
+								* (1 - cos(phase)) / 2), true))
+			return false;
+	}
+	sched_period = period;
+	return true;
+}
+
+static bool __build_onoff(uint64_t bps, uint64_t on, uint64_t off)
+{
+	if (on == 0 || off == 0) {
+		LOG_ERROR("On and off periods must not be 0");
+		return false;
+	}
+
+	if (!__add_point(0, bps, false) || !__add_point(on, 0, false))
+		return false;
+	sched_period = on + off;
+	return true;
+}
+
+/*
+ * One point per line: "<sec> <rate> [ramp]", with "ramp" the rate goes
+ * linearly to the one of the next point. A last line "<sec> loop" repeats
+ * the schedule with that period. '#' starts a comment.
+ */
+static bool __load_file(const char *path)
+{
+	FILE *fp = NULL;
+	char line[SCHED_LINE_MAX];
+	char t_str[64], r_str[64], opt[16];
+	uint64_t usec = 0, bps = 0;
+	unsigned int lineno = 0;
+	int n = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		LOG_ERROR("Failed to open schedule file %s", path);
+		return false;
+	}
+
+	while (fgets(line, SCHED_LINE_MAX, fp) != NULL) {
+		lineno++;
+		if (strchr(line, '#') != NULL)
+			*strchr(line, '#') = '\0';
+
+		n = sscanf(line, "%63s %63s %15s", t_str, r_str, opt);
+		if (n <= 0)
+			continue;
+
+		if (sched_period != 0) {
+			LOG_ERROR("%s:%u: point after loop", path, lineno);
+			goto close_file;
+		}
+
+		if (n < 2 || !__parse_sec(t_str, &usec))
+			goto close_bad_line;
+
+		if (strcmp(r_str, "loop") == 0) {
+			if (nb_pts == 0 || usec <= sched_pts[nb_pts - 1].usec)
+				goto close_bad_line;
+			sched_period = usec;
+			continue;
+		}
+
+		if (!rate_parse_bps(r_str, &bps)
+				|| (n == 3 && strcmp(opt, "ramp") != 0)
+				|| !__add_point(usec, bps, n == 3))
+			goto close_bad_line;
+	}
+
+	fclose(fp);
+	if (nb_pts == 0) {
+		LOG_ERROR("Empty schedule file %s", path);
+		return false;
+	}
+	return true;
+
+close_bad_line:
+	LOG_ERROR("%s:%u: wrong schedule line", path, lineno);
+close_file:
+	fclose(fp);
+	return false;
+}
+
+bool sched_parse(const char *spec)
+{
+	char buf[SCHED_SPEC_MAX];
+	char *arg[SCHED_ARG_MAX + 1], *save = NULL;
+	uint64_t val[3] = {0}, usec = 0;
+	unsigned int nb_arg = 0, i = 0;
+	bool ret = false;
+
+	nb_pts = 0;
+	sched_period = 0;
+
+	if (strncmp(spec, "file:", 5) == 0) {
+		ret = __load_file(spec + 5);
+		goto close_check;
+	}
+
+	snprintf(buf, SCHED_SPEC_MAX, "%s", spec);
+	for (arg[0] = strtok_r(buf, ":", &save); arg[nb_arg] != NULL;
+					arg[nb_arg] = strtok_r(NULL, ":", &save)) {
+		if (++nb_arg > SCHED_ARG_MAX) {
+			LOG_ERROR("Too many fields in schedule %s", spec);
+			return false;
+		}
+	}
+	if (nb_arg < 2)
+		goto close_usage;
+
+	/* <rates...>:<sec>, except onoff which gives two times */
+	if (strcmp(arg[0], "onoff") == 0 && nb_arg == 4) {
+		if (!rate_parse_bps(arg[1], &val[0])
+				|| !__parse_sec(arg[2], &val[1])
+				|| !__parse_sec(arg[3], &usec))
+			goto close_usage;
+		ret = __build_onoff(val[0], val[1], usec);
+		goto close_check;
+	}
+
+	for (i = 1; i < nb_arg - 1; i++) {
+		if (!rate_parse_bps(arg[i], &val[i - 1]))
+			goto close_usage;
+	}
+	if (!__parse_sec(arg[nb_arg - 1], &usec))
+		goto close_usage;
+
+	if (strcmp(arg[0], "ramp") == 0 && nb_arg == 4) {
+		ret = __add_point(0, val[0], true)
+				&& __add_point(usec, val[1], false);
+	} else if (strcmp(arg[0], "step") == 0 && nb_arg == 5) {
+		ret = __build_step(val[0], val[1], val[2], usec);
+	} else if (strcmp(arg[0], "sine") == 0 && nb_arg == 4) {
+		ret = __build_sine(val[0], val[1], usec);
+	} else {
+		goto close_usage;
+	}
+
+close_check:
+	if (!ret)
+		nb_pts = 0;
+	return ret;
+
+close_usage:
+	LOG_ERROR("Wrong rate schedule %s", spec);
+	nb_pts = 0;
+	return false;
+}
+
+bool sched_is_set(void)
+{
+	return nb_pts > 0;
+}
+
+static uint64_t __rate_at(uint64_t usec)
+{
+	const struct sched_point *p = NULL, *next = NULL;
+
+	if (sched_period != 0)
+		usec %= sched_period;
+
+	if (usec < sched_pts[sched_cur].usec)
+		sched_cur = 0;
+	while (sched_cur + 1 < nb_pts && sched_pts[sched_cur + 1].usec <= usec)
+		sched_cur++;
+
+	p = &sched_pts[sched_cur];
+	if (!p->ramp || sched_cur + 1 >= nb_pts || usec < p->usec)
+		return p->bps;
+
+	next = &sched_pts[sched_cur + 1];
+	return p->bps + (int64_t)(((double)next->bps - p->bps)
+					* (usec - p->usec) / (next->usec - p->usec));
+}
+
+uint64_t sched_first_bps(void)
+{
+	return sched_is_set() ? __rate_at(0) : 0;
+}
+
+void sched_start(uint64_t start_cycle)
+{
+	if (!sched_is_set())
+		return;
+
+	cycle_per_usec = (double)rte_get_tsc_hz() / 1000000;
+	sched_tick = SCHED_TICK_USEC * cycle_per_usec;
+	sched_start_cycle = start_cycle;
+	sched_next_cycle = start_cycle;
+	sched_cur = 0;
+
+	sched_bps = __rate_at(0);
+	rxtx_publish_rate(sched_bps);
+
+	LOG_INFO("Rate schedule of %u points, %s %.3lf s, starting at %lu bps",
+					nb_pts, sched_period ? "period" : "length",
+					(sched_period ? sched_period
+						: sched_pts[nb_pts - 1].usec) / 1e6,
+					(unsigned long)sched_bps);
+}
+
+uint64_t sched_update(uint64_t cur_cycle)
+{
+	uint64_t bps = 0;
+
+	if (!sched_is_set())
+		return UINT64_MAX;
+
+	if (cur_cycle < sched_next_cycle)
+		return sched_next_cycle;
+
+	bps = __rate_at((cur_cycle - sched_start_cycle) / cycle_per_usec);
+	if (bps != sched_bps) {
+		sched_bps = bps;
+		rxtx_publish_rate(bps);
+		LOG_DEBUG("Schedule rate %lu bps", (unsigned long)bps);
+	}
+
+	sched_next_cycle = cur_cycle + sched_tick;
+	return sched_next_cycle;
+}
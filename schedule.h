@@ -0,0 +1,53 @@
+#ifndef _PKTGEN_SCHEDULE_H_
+#define _PKTGEN_SCHEDULE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Time-varying TX rate. A schedule is a list of points (time, rate), the
+ * rate is held from a point to the next one, or ramped linearly towards
+ * it. Schedules either hold their last rate or repeat with a period.
+ */
+#define SCHED_POINT_MAX 4096
+
+/* How often the schedule is evaluated */
+#define SCHED_TICK_USEC 1000
+
+/* Points generated per period of a sine schedule */
+#define SCHED_SINE_STEPS 64
+
+struct sched_point {
+	uint64_t usec;		/* since the start of the run (of the period) */
+	uint64_t bps;		/* aggregate rate, 0 pauses TX */
+	bool ramp;		/* ramp linearly towards the next point */
+};
+
+/*
+ * Format:
+ *   ramp:<from>:<to>:<sec>              linear ramp, then hold <to>
+ *   step:<from>:<to>:<inc>:<sec>        staircase, <sec> per stair
+ *   sine:<min>:<max>:<period sec>       sinusoidal load
+ *   onoff:<rate>:<on sec>:<off sec>     duty cycle
+ *   file:<path>                         points read by __load_file in
+ *                                       schedule.c, one per line:
+ *                                       "<sec> <rate> [ramp]", and an
+ *                                       optional last "<sec> loop" to
+ *                                       repeat with that period
+ * Rates take the -r format, times may be fractional.
+ */
+bool sched_parse(const char *spec);
+
+bool sched_is_set(void);
+
+/* Aggregate rate at time 0 */
+uint64_t sched_first_bps(void);
+
+/* Publish the rate at time 0, the schedule starts at start_cycle */
+void sched_start(uint64_t start_cycle);
+
+/* Publish the current rate if it changed, returns the cycle of the next
+ * evaluation */
+uint64_t sched_update(uint64_t cur_cycle);
+
+#endif /* _PKTGEN_SCHEDULE_H_ */
@@ -0,0 +1,37 @@
+#include "util.h"
+#include "seq_track.h"
+
+uint64_t seq_track_holes(const struct seq_track *s)
+{
+	uint64_t valid = 0, set = 0;
+	unsigned int i = 0;
+
+	if (!s->started)
+		return 0;
+
+	valid = s->max - s->first + 1;
+	if (valid > SEQ_WIN_SIZE)
+		valid = SEQ_WIN_SIZE;
+
+	for (i = 0; i < SEQ_WIN_WORDS; i++)
+		set += __builtin_popcountll(s->win[i]);
+	return valid - set;
+}
+
+void seq_track_reset(struct seq_track *s)
+{
+	memset(s, 0, sizeof(struct seq_track));
+}
+
+void seq_cnt_add(struct seq_cnt *dst, const struct seq_cnt *src)
+{
+	uint64_t extent = __atomic_load_n(&src->max_extent, __ATOMIC_RELAXED);
+
+	dst->recv += __atomic_load_n(&src->recv, __ATOMIC_RELAXED);
+	dst->lost += __atomic_load_n(&src->lost, __ATOMIC_RELAXED);
+	dst->dup += __atomic_load_n(&src->dup, __ATOMIC_RELAXED);
+	dst->late += __atomic_load_n(&src->late, __ATOMIC_RELAXED);
+	dst->reorder += __atomic_load_n(&src->reorder, __ATOMIC_RELAXED);
+	if (extent > dst->max_extent)
+		dst->max_extent = extent;
+}
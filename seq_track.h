@@ -0,0 +1,122 @@
+#ifndef _PKTGEN_SEQ_TRACK_H_
+#define _PKTGEN_SEQ_TRACK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Loss, duplicate and reordering accounting of a probe sequence in fixed
+ * memory (RFC 4737 style). A bitmap remembers which of the last
+ * SEQ_WIN_SIZE indices below the highest one arrived. An index still
+ * missing when it leaves the window is lost; if it shows up later it is
+ * counted as late and no longer as lost. An index below the highest one
+ * arriving within the window is reordered, by that many places.
+ */
+#define SEQ_WIN_BITS 12
+#define SEQ_WIN_SIZE (1U << SEQ_WIN_BITS)
+#define SEQ_WIN_WORDS (SEQ_WIN_SIZE / 64)
+
+/* Written by the owner only, read by the stat thread */
+struct seq_cnt {
+	uint64_t recv;		/* distinct indices */
+	uint64_t lost;
+	uint64_t dup;
+	uint64_t late;		/* arrived after leaving the window */
+	uint64_t reorder;
+	uint64_t max_extent;	/* largest reorder distance */
+};
+
+struct seq_track {
+	struct seq_cnt cnt;
+	bool started;
+	uint64_t first;		/* indices are widened to 64 bits */
+	uint64_t max;
+	uint64_t win[SEQ_WIN_WORDS];
+};
+
+static inline bool __seq_test(const struct seq_track *s, uint64_t k)
+{
+	k &= SEQ_WIN_SIZE - 1;
+	return (s->win[k >> 6] >> (k & 63)) & 1;
+}
+
+static inline void __seq_set(struct seq_track *s, uint64_t k)
+{
+	k &= SEQ_WIN_SIZE - 1;
+	s->win[k >> 6] |= 1ULL << (k & 63);
+}
+
+static inline void __seq_clear(struct seq_track *s, uint64_t k)
+{
+	k &= SEQ_WIN_SIZE - 1;
+	s->win[k >> 6] &= ~(1ULL << (k & 63));
+}
+
+static inline void __seq_add(uint64_t *c, uint64_t n)
+{
+	__atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+/* Indices of the window not received yet */
+uint64_t seq_track_holes(const struct seq_track *s);
+
+void seq_track_reset(struct seq_track *s);
+
+static inline void seq_track_update(struct seq_track *s, uint32_t idx)
+{
+	int64_t diff = 0;
+	uint64_t ext = 0, k = 0, lost = 0;
+
+	if (!s->started) {
+		s->started = true;
+		s->first = s->max = idx;
+		__seq_set(s, idx);
+		__seq_add(&s->cnt.recv, 1);
+		return;
+	}
+
+	/* widen idx around the highest index, which survives wrapping */
+	diff = (int32_t)(idx - (uint32_t)s->max);
+	ext = s->max + diff;
+
+	if (diff > 0) {
+		if (diff >= SEQ_WIN_SIZE) {
+			lost = seq_track_holes(s) + diff - SEQ_WIN_SIZE;
+			memset(s->win, 0, sizeof(s->win));
+		} else {
+			/* slot k held k - SEQ_WIN_SIZE, which leaves now */
+			for (k = s->max + 1; k <= ext; k++) {
+				if (k >= s->first + SEQ_WIN_SIZE && !__seq_test(s, k))
+					lost++;
+				__seq_clear(s, k);
+			}
+		}
+		s->max = ext;
+		__seq_set(s, ext);
+		__seq_add(&s->cnt.recv, 1);
+		if (lost > 0)
+			__seq_add(&s->cnt.lost, lost);
+	} else if (diff == 0) {
+		__seq_add(&s->cnt.dup, 1);
+	} else if (-diff >= SEQ_WIN_SIZE || (uint64_t)-diff > s->max - s->first) {
+		/* older than the window, or than the first index seen */
+		__seq_add(&s->cnt.late, 1);
+		if ((uint64_t)-diff <= s->max - s->first && s->cnt.lost > 0)
+			__atomic_store_n(&s->cnt.lost, s->cnt.lost - 1,
+							__ATOMIC_RELAXED);
+	} else if (__seq_test(s, ext)) {
+		__seq_add(&s->cnt.dup, 1);
+	} else {
+		__seq_set(s, ext);
+		__seq_add(&s->cnt.recv, 1);
+		__seq_add(&s->cnt.reorder, 1);
+		if ((uint64_t)-diff > s->cnt.max_extent)
+			__atomic_store_n(&s->cnt.max_extent, -diff, __ATOMIC_RELAXED);
+	}
+}
+
+/* dst += src, src may be updated concurrently by its writer */
+void seq_cnt_add(struct seq_cnt *dst, const struct seq_cnt *src);
+
+#endif /* _PKTGEN_SEQ_TRACK_H_ */
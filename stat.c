@@ -1,19 +1,55 @@
 #include "util.h"
 #include "control.h"
 #include "stat.h"
+#include "tsc.h"
 
 #include <rte_lcore.h>
 #include <rte_cycles.h>
 #include <rte_ring.h>
 #include <rte_malloc.h>
+#include <rte_branch_prediction.h>
 
+/* Aggregated view, only touched by the stat thread */
 static struct stat_info port_stat[STAT_IDX_MAX];
 
+static struct stat_shard stat_shards[STAT_SHARD_MAX];
+static bool shard_used[STAT_SHARD_MAX];
+
+/* Latency snapshots: all shards now, at the last dump, and the delta */
+static struct hist lat_cur;
+static struct hist lat_last;
+static struct hist lat_delta;
+
+/* Probe sequence counters of all shards, now and at the last dump */
+static struct seq_cnt seq_cur;
+static struct seq_cnt seq_last;
+
+/*
+ * Probe sequences by class and sender. Each is tracked by one RX lcore,
+ * the first to receive from it: an RX lcore counting a sequence that is
+ * partly received elsewhere would take the other indices as lost. The
+ * indices reaching other RX lcores are stray there; merging counts them
+ * as received and takes them off the losses of the owner, which has them
+ * as holes.
+ */
+struct stat_seq {
+	struct stat_shard *owner;
+	struct seq_track seq;
+};
+
+static struct stat_seq *stat_seqs[PKT_PROBE_CLASS_MAX];
+
+/* Same by probe class, the ones above sum them. Only the classes in use
+ * are printed. */
+static uint32_t probe_cls_mask = 1;
+static struct hist cls_lat_cur[PKT_PROBE_CLASS_MAX];
+static struct hist cls_lat_last[PKT_PROBE_CLASS_MAX];
+static struct seq_cnt cls_seq_cur[PKT_PROBE_CLASS_MAX];
+static struct seq_cnt cls_seq_last[PKT_PROBE_CLASS_MAX];
+
 #define PREFIX_MAX 100
 
 static char output_prefix[PREFIX_MAX] = {'\0'};
-static FILE *fout_rx = NULL;
-static FILE *fout_tx = NULL;
 
 static uint64_t cycle_per_sec = 0;
 static uint64_t next_dump_cycle = 0;
@@ -24,38 +60,157 @@ void stat_set_output(const char *prefix)
 	snprintf(output_prefix, PREFIX_MAX, "%s", prefix);
 }
 
-static void __update_stat(struct stat_info *stat, uint64_t byte)
+struct stat_shard *stat_get_shard(void)
 {
-	stat->stat_bytes += byte;
-	stat->stat_pkts ++;
+	unsigned int id = rte_lcore_id(), i = 0;
+	struct stat_shard *shard = NULL;
+
+	if (id >= RTE_MAX_LCORE)
+		id = RTE_MAX_LCORE;
+	shard = &stat_shards[id];
+
+	/* an lcore doing both RX and TX gets here twice */
+	for (i = 0; i < PKT_PROBE_CLASS_MAX; i++) {
+		if (!(probe_cls_mask & (1U << i)) || shard->cls[i] != NULL)
+			continue;
+
+		shard->cls[i] = rte_zmalloc_socket("pktgen: stat class",
+						sizeof(struct stat_class), RTE_CACHE_LINE_SIZE,
+						rte_socket_id());
+		if (shard->cls[i] == NULL)
+			LOG_ERROR("Failed to allocate statistics of probe class %u, "
+							"lcore %u does not record it", i, id);
+	}
+
+	shard->log = probe_log_get_ring();
+	__atomic_store_n(&shard_used[id], true, __ATOMIC_RELEASE);
+	return shard;
 }
 
-void stat_update_rx(uint64_t bytes)
+void stat_set_probe_classes(uint32_t cls_mask)
 {
-	__update_stat(&port_stat[STAT_IDX_RX], bytes);
+	cls_mask &= (1U << PKT_PROBE_CLASS_MAX) - 1;
+	probe_cls_mask = (cls_mask != 0) ? cls_mask : 1;
 }
 
-void stat_update_rx_probe(uint32_t idx, uint64_t bytes, uint64_t cycle)
+static inline void __record_seq(struct stat_shard *shard,
+				struct stat_class *c, uint16_t cls, uint16_t sender,
+				uint32_t idx)
 {
-	if (fout_rx != NULL)
-		fprintf(fout_rx, "%u,%u,%lu\n", idx, RECORD_RX, cycle);
+	struct stat_seq *s = &stat_seqs[cls][sender];	/* allocated with c */
+	struct stat_shard *owner = __atomic_load_n(&s->owner, __ATOMIC_ACQUIRE);
+
+	/* on failure owner is set to the lcore that won */
+	if (unlikely(owner == NULL)
+			&& __atomic_compare_exchange_n(&s->owner, &owner, shard, false,
+							__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		owner = shard;
+
+	if (owner == shard)
+		seq_track_update(&s->seq, idx);
+	else
+		__atomic_store_n(&c->stray, c->stray + 1, __ATOMIC_RELAXED);
+}
+
+void stat_record_rx_probe(struct stat_shard *shard, uint16_t cls,
+				uint16_t sender, uint32_t idx, uint64_t cycle,
+				uint64_t send_cycle)
+{
+	struct stat_class *c = shard->cls[cls];
+
+	/* a class not in use */
+	if (unlikely(c == NULL))
+		return;
+
+	/* both stamps come from the TSC of this host */
+	hist_record(&c->lat, (cycle > send_cycle) ? cycle - send_cycle : 0);
+	__record_seq(shard, c, cls, sender, idx);
+
+	if (shard->log != NULL)
+		probe_log_put(shard->log, cls, sender, idx, RECORD_RX, cycle);
 
-	LOG_DEBUG("RX probe packet %u at %lu", idx, (unsigned long)cycle);
-	__update_stat(&port_stat[STAT_IDX_RX], bytes);
+	LOG_DEBUG("RX probe packet %u of class %u at %lu", idx, cls,
+					(unsigned long)cycle);
 }
 
-void stat_update_tx(uint64_t bytes, unsigned int pkts)
+void stat_record_tx_probe(struct stat_shard *shard, uint16_t cls,
+				uint16_t sender, uint32_t idx, uint64_t cycle)
 {
-	port_stat[STAT_IDX_TX].stat_bytes += bytes;
-	port_stat[STAT_IDX_TX].stat_pkts += pkts;
+	if (shard->log != NULL)
+		probe_log_put(shard->log, cls, sender, idx, RECORD_TX, cycle);
 }
 
-void stat_update_tx_probe(uint32_t idx, uint64_t bytes, uint64_t cycle)
+void stat_update_rx_probe(struct stat_shard *shard, uint16_t cls,
+				uint16_t sender, uint32_t idx, uint64_t bytes,
+				uint64_t cycle, uint64_t send_cycle)
 {
-	if (fout_tx != NULL)
-		fprintf(fout_tx, "%u,%u,%lu\n", idx, RECORD_TX, cycle);
+	stat_record_rx_probe(shard, cls, sender, idx, cycle, send_cycle);
+	stat_shard_add(shard, STAT_IDX_RX, bytes, 1);
+}
 
-	__update_stat(&port_stat[STAT_IDX_TX_PROBE], bytes);
+void stat_update_tx_probe(struct stat_shard *shard, uint16_t cls,
+				uint16_t sender, uint32_t idx, uint64_t bytes,
+				uint64_t cycle)
+{
+	stat_record_tx_probe(shard, cls, sender, idx, cycle);
+	stat_shard_add(shard, STAT_IDX_TX_PROBE, bytes, 1);
+}
+
+/* Sum all the shards into port_stat */
+static void __aggregate_stat(void)
+{
+	uint64_t bytes[STAT_IDX_MAX] = {0}, pkts[STAT_IDX_MAX] = {0};
+	uint64_t stray[PKT_PROBE_CLASS_MAX] = {0};
+	struct stat_counter *c = NULL;
+	struct stat_class *sc = NULL;
+	struct stat_seq *ss = NULL;
+	unsigned int id = 0, i = 0, j = 0;
+
+	for (i = 0; i < PKT_PROBE_CLASS_MAX; i++) {
+		hist_reset(&cls_lat_cur[i]);
+		memset(&cls_seq_cur[i], 0, sizeof(struct seq_cnt));
+	}
+	for (id = 0; id < STAT_SHARD_MAX; id++) {
+		if (!__atomic_load_n(&shard_used[id], __ATOMIC_ACQUIRE))
+			continue;
+
+		for (i = 0; i < PKT_PROBE_CLASS_MAX; i++) {
+			sc = stat_shards[id].cls[i];
+			if (sc == NULL)
+				continue;
+			hist_add(&cls_lat_cur[i], &sc->lat);
+			stray[i] += __atomic_load_n(&sc->stray, __ATOMIC_RELAXED);
+		}
+		for (i = 0; i < STAT_IDX_MAX; i++) {
+			c = &stat_shards[id].cnt[i];
+			pkts[i] += __atomic_load_n(&c->pkts, __ATOMIC_ACQUIRE);
+			bytes[i] += __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+		}
+	}
+
+	for (i = 0; i < STAT_IDX_MAX; i++) {
+		port_stat[i].stat_bytes = bytes[i];
+		port_stat[i].stat_pkts = pkts[i];
+	}
+
+	/* until the owner counts a stray index as lost, lost is below zero:
+	 * only differences and the final value are printed */
+	for (i = 0; i < PKT_PROBE_CLASS_MAX; i++) {
+		for (j = 0; stat_seqs[i] != NULL && j < STAT_SENDER_MAX; j++) {
+			ss = &stat_seqs[i][j];
+			if (__atomic_load_n(&ss->owner, __ATOMIC_ACQUIRE) != NULL)
+				seq_cnt_add(&cls_seq_cur[i], &ss->seq.cnt);
+		}
+		cls_seq_cur[i].recv += stray[i];
+		cls_seq_cur[i].lost -= stray[i];
+	}
+
+	hist_reset(&lat_cur);
+	memset(&seq_cur, 0, sizeof(seq_cur));
+	for (i = 0; i < PKT_PROBE_CLASS_MAX; i++) {
+		hist_add(&lat_cur, &cls_lat_cur[i]);
+		seq_cnt_add(&seq_cur, &cls_seq_cur[i]);
+	}
 }
 
 static inline void __process_stat(struct stat_info *stat,
@@ -81,6 +236,85 @@ static inline void __process_stat(struct stat_info *stat,
 	*pps = (pkts - last_p) / (sec * 1024);
 }
 
+static inline double __cycle_to_usec(uint64_t cycles)
+{
+	return (double)cycles * 1000000 / cycle_per_sec;
+}
+
+static void __print_latency(const char *title, const struct hist *h)
+{
+	if (h->total == 0) {
+		LOG_INFO("%s latency: no probe received", title);
+		return;
+	}
+
+	LOG_INFO("%s latency (us, %lu probes): p50 %.3lf, p90 %.3lf, "
+					"p99 %.3lf, p99.9 %.3lf, max %.3lf", title,
+					(unsigned long)h->total,
+					__cycle_to_usec(hist_percentile(h, 50)),
+					__cycle_to_usec(hist_percentile(h, 90)),
+					__cycle_to_usec(hist_percentile(h, 99)),
+					__cycle_to_usec(hist_percentile(h, 99.9)),
+					__cycle_to_usec(hist_percentile(h, 100)));
+}
+
+/* Counters may go down between dumps: late probes are no longer lost */
+static void __print_seq(const char *title, const struct seq_cnt *cur,
+				const struct seq_cnt *last, uint64_t holes)
+{
+	if (cur->recv == last->recv && cur->lost == last->lost
+			&& cur->late == last->late && cur->dup == last->dup)
+		return;
+
+	LOG_INFO("%s probes: received %ld, lost %ld, duplicate %ld, late %ld, "
+					"reordered %ld (max extent %lu)", title,
+					(long)(cur->recv - last->recv),
+					(long)(cur->lost + holes - last->lost),
+					(long)(cur->dup - last->dup),
+					(long)(cur->late - last->late),
+					(long)(cur->reorder - last->reorder),
+					(unsigned long)cur->max_extent);
+}
+
+/* Probes of class cls still missing in the windows, once RX is over */
+static uint64_t __seq_holes(unsigned int cls)
+{
+	uint64_t holes = 0;
+	unsigned int i = 0;
+
+	for (i = 0; stat_seqs[cls] != NULL && i < STAT_SENDER_MAX; i++) {
+		if (stat_seqs[cls][i].owner != NULL)
+			holes += seq_track_holes(&stat_seqs[cls][i].seq);
+	}
+	return holes;
+}
+
+/*
+ * Latency and sequence lines of each probe class since the snapshots in
+ * last, which are moved forward. Missing probes are only final once RX
+ * is over, so holes are only counted at the end.
+ */
+static void __print_classes(const char *title, struct hist *lat_last,
+				struct seq_cnt *seq_last, bool final)
+{
+	char name[32];
+	unsigned int i = 0;
+
+	for (i = 0; i < PKT_PROBE_CLASS_MAX; i++) {
+		if (!(probe_cls_mask & (1U << i)))
+			continue;
+
+		snprintf(name, sizeof(name), "%s %u", title, i);
+		hist_sub(&lat_delta, &cls_lat_cur[i], &lat_last[i]);
+		lat_last[i] = cls_lat_cur[i];
+		__print_latency(name, &lat_delta);
+
+		__print_seq(name, &cls_seq_cur[i], &seq_last[i],
+						final ? __seq_holes(i) : 0);
+		seq_last[i] = cls_seq_cur[i];
+	}
+}
+
 static void __summary_stat(uint64_t cycles)
 {
 	double sec = 0;
@@ -101,35 +335,45 @@ static void __summary_stat(uint64_t cycles)
 	LOG_INFO("\tTX %lu bytes (%lf kbps), %lu packets (%lf pps)",
 					tx_bytes, (tx_bytes * 8 / (sec * 1024)),
 					tx_pkts, (tx_pkts / sec));
+	__print_latency("\tTotal", &lat_cur);
 }
 
 bool stat_init(void)
 {
 	uint64_t cycle;
 	int i = 0;
-	char buf[PREFIX_MAX + 4] = {'\0'};
 
 	memset(port_stat, 0, sizeof(struct stat_info) * STAT_IDX_MAX);
+	memset(stat_shards, 0, sizeof(stat_shards));
+	hist_reset(&lat_cur);
+	hist_reset(&lat_last);
+	memset(&seq_last, 0, sizeof(seq_last));
+	memset(cls_lat_last, 0, sizeof(cls_lat_last));
+	memset(cls_seq_last, 0, sizeof(cls_seq_last));
+
+	for (i = 0; i < PKT_PROBE_CLASS_MAX; i++) {
+		if (!(probe_cls_mask & (1U << i)))
+			continue;
+
+		stat_seqs[i] = rte_zmalloc("pktgen: probe seq",
+						sizeof(struct stat_seq) * STAT_SENDER_MAX,
+						RTE_CACHE_LINE_SIZE);
+		if (stat_seqs[i] == NULL) {
+			LOG_ERROR("Failed to allocate sequences of probe class %d", i);
+			goto close_set_error;
+		}
+	}
 
 	if (strlen(output_prefix) <= 0)
 		sprintf(output_prefix, "probe");
 
-	sprintf(buf, "%s.rx", output_prefix);
-	fout_rx = fopen(buf, "w");
-	if (fout_rx == NULL) {
-		LOG_ERROR("Failed to open RX output file");
+	if (!probe_log_start(output_prefix)) {
+		LOG_ERROR("Failed to open probe output files");
 		goto close_set_error;
 	}
 
-	sprintf(buf, "%s.tx", output_prefix);
-	fout_tx = fopen(buf, "w");
-	if (fout_tx == NULL) {
-		LOG_ERROR("Failed to open TX output file");
-		goto close_free_rx;
-	}
-
-	/* Initialize timer */
-	cycle_per_sec = rte_get_tsc_hz();
+	/* Initialize timer, latencies are converted with the measured rate */
+	cycle_per_sec = tsc_get_hz();
 	dump_interval = STAT_PRINT_SEC * cycle_per_sec;
 	cycle = rte_get_tsc_cycles();
 	for (i = 0; i < STAT_IDX_MAX; i++) {
@@ -140,15 +384,25 @@ bool stat_init(void)
 	ctl_set_state(WORKER_STAT, STATE_INITED);
 	return true;
 
-close_free_rx:
-	fclose(fout_rx);
-	fout_rx = NULL;
-
 close_set_error:
 	ctl_set_state(WORKER_STAT, STATE_ERROR);
 	return false;
 }
 
+void stat_cleanup(void)
+{
+	unsigned int id = 0, i = 0;
+
+	for (i = 0; i < PKT_PROBE_CLASS_MAX; i++) {
+		rte_free(stat_seqs[i]);
+		stat_seqs[i] = NULL;
+		for (id = 0; id < STAT_SHARD_MAX; id++) {
+			rte_free(stat_shards[id].cls[i]);
+			stat_shards[id].cls[i] = NULL;
+		}
+	}
+}
+
 bool stat_is_stop(void)
 {
 	unsigned int tx_state, rx_state;
@@ -172,6 +426,7 @@ uint64_t stat_processing(void)
 		return next_dump_cycle;
 	}
 
+	__aggregate_stat();
 	for (i = 0; i < STAT_IDX_MAX; i++) {
 		__process_stat(&port_stat[i], cur_cycle, &bps[i], &pps[i]);
 //		__process_stat(&port_stat[i], &bps[i], &pps[i]);
@@ -183,19 +438,53 @@ uint64_t stat_processing(void)
 	LOG_INFO("RX speed %lf kbps, %lf pps",
 					bps[STAT_IDX_RX], pps[STAT_IDX_RX]);
 
+	hist_sub(&lat_delta, &lat_cur, &lat_last);
+	lat_last = lat_cur;
+	__print_latency("Interval", &lat_delta);
+
+	__print_seq("Interval", &seq_cur, &seq_last, 0);
+	seq_last = seq_cur;
+
+	if (__builtin_popcount(probe_cls_mask) > 1)
+		__print_classes("Interval class", cls_lat_last, cls_seq_last,
+						false);
+
 	next_dump_cycle = cur_cycle + dump_interval;
 	return next_dump_cycle;
 }
 
+void stat_get_total(struct stat_total *total)
+{
+	__aggregate_stat();
+	total->tx_bytes = port_stat[STAT_IDX_TX].stat_bytes
+				+ port_stat[STAT_IDX_TX_PROBE].stat_bytes;
+	total->tx_pkts = port_stat[STAT_IDX_TX].stat_pkts
+				+ port_stat[STAT_IDX_TX_PROBE].stat_pkts;
+	total->rx_bytes = port_stat[STAT_IDX_RX].stat_bytes;
+	total->rx_pkts = port_stat[STAT_IDX_RX].stat_pkts;
+}
+
 void stat_finish(uint64_t start_cycle)
 {
+	struct seq_cnt none;
+	uint64_t holes = 0;
+	unsigned int i = 0;
+
+	__aggregate_stat();
 	__summary_stat(rte_get_tsc_cycles() - start_cycle);
 
-	if (fout_tx != NULL)
-		fclose(fout_tx);
+	for (i = 0; i < PKT_PROBE_CLASS_MAX; i++)
+		holes += __seq_holes(i);
+	memset(&none, 0, sizeof(none));
+	__print_seq("\tTotal", &seq_cur, &none, holes);
+
+	if (__builtin_popcount(probe_cls_mask) > 1) {
+		memset(cls_lat_last, 0, sizeof(cls_lat_last));
+		memset(cls_seq_last, 0, sizeof(cls_seq_last));
+		__print_classes("\tTotal class", cls_lat_last, cls_seq_last, true);
+	}
 
-	if (fout_rx != NULL)
-		fclose(fout_rx);
+	probe_log_stop();
 
 	ctl_set_state(WORKER_STAT, STATE_STOPPED);
 }
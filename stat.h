@@ -2,6 +2,14 @@
 #define _PKTGEN_STAT_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <rte_memory.h>
+
+#include "hist.h"
+#include "seq_track.h"
+#include "probe_log.h"
+#include "pkt_seq.h"
+#include "control.h"
 
 struct stat_info {
 	uint64_t last_bytes;
@@ -23,26 +31,116 @@ enum {
 	STAT_IDX_MAX
 };
 
+struct stat_counter {
+	uint64_t bytes;
+	uint64_t pkts;
+};
+
+/* Senders of a probe sequence, the TX lcores */
+#define STAT_SENDER_MAX WORKER_INST_MAX
+
+/* What RX lcores record about the probes of one class */
+struct stat_class {
+	/* latency in TSC cycles */
+	struct hist lat;
+
+	/* probes of a sequence tracked by another RX lcore */
+	uint64_t stray;
+};
+
+/*
+ * Counters of one worker thread. Only the owner writes them, the stat
+ * thread reads them, and each shard has its own cache lines so RX and TX
+ * lcores never share one.
+ */
+struct stat_shard {
+	struct stat_counter cnt[STAT_IDX_MAX];
+
+	/* raw probe records of this thread */
+	struct probe_ring *log;
+
+	/* probes this RX lcore receives, by class. Only the classes in use
+	 * are allocated, on the socket of the lcore. */
+	struct stat_class *cls[PKT_PROBE_CLASS_MAX];
+} __rte_cache_aligned;
+
+/* One shard per EAL lcore, plus one for non-EAL threads */
+#define STAT_SHARD_MAX (RTE_MAX_LCORE + 1)
+
 #define STAT_PERIOD_USEC 200000
 #define STAT_PRINT_SEC	1
 #define STAT_PERIOD_MULTI (1000000 / STAT_PRINT_USEC)
 #define STAT_PRINT_INTERVAL (STAT_PRINT_USEC / STAT_PERIOD_USEC - 1)
 
+/* Counters since the start, TX includes the probes */
+struct stat_total {
+	uint64_t tx_bytes;
+	uint64_t tx_pkts;
+	uint64_t rx_bytes;
+	uint64_t rx_pkts;
+};
+
+/* Probe classes in use, bit i for class i, before stat_init */
+void stat_set_probe_classes(uint32_t cls_mask);
+
 bool stat_init(void);
 
+/* Once no thread uses its shard any more */
+void stat_cleanup(void);
+
 bool stat_is_stop(void);
 
 uint64_t stat_processing(void);
 
 void stat_finish(uint64_t start_cycle);
 
-void stat_update_rx(uint64_t bytes);
-
-void stat_update_rx_probe(uint32_t idx, uint64_t bytes, uint64_t cycle);
-
-void stat_update_tx(uint64_t bytes, unsigned int pkts);
-
-void stat_update_tx_probe(uint32_t idx, uint64_t bytes, uint64_t cycle);
+/* Only from the stat thread */
+void stat_get_total(struct stat_total *total);
+
+/* Get the shard of the calling thread, call after stat_init */
+struct stat_shard *stat_get_shard(void);
+
+static inline void stat_shard_add(struct stat_shard *shard, unsigned idx,
+				uint64_t bytes, uint64_t pkts)
+{
+	struct stat_counter *c = &shard->cnt[idx];
+
+	/* single writer: plain add, published with a release store so the
+	 * reader never sees the packets before their bytes */
+	__atomic_store_n(&c->bytes, c->bytes + bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->pkts, c->pkts + pkts, __ATOMIC_RELEASE);
+}
+
+static inline void stat_update_rx(struct stat_shard *shard,
+				uint64_t bytes, uint64_t pkts)
+{
+	stat_shard_add(shard, STAT_IDX_RX, bytes, pkts);
+}
+
+static inline void stat_update_tx(struct stat_shard *shard,
+				uint64_t bytes, unsigned int pkts)
+{
+	stat_shard_add(shard, STAT_IDX_TX, bytes, pkts);
+}
+
+/* Latency, sequence and log of a probe, without counting the packet.
+ * Also used for in-band samples, which are counted as data. cls must be
+ * below PKT_PROBE_CLASS_MAX, sender (the TX lcore whose sequence idx
+ * belongs to) below STAT_SENDER_MAX. */
+void stat_record_rx_probe(struct stat_shard *shard, uint16_t cls,
+				uint16_t sender, uint32_t idx, uint64_t cycle,
+				uint64_t send_cycle);
+
+void stat_record_tx_probe(struct stat_shard *shard, uint16_t cls,
+				uint16_t sender, uint32_t idx, uint64_t cycle);
+
+void stat_update_rx_probe(struct stat_shard *shard, uint16_t cls,
+				uint16_t sender, uint32_t idx, uint64_t bytes,
+				uint64_t cycle, uint64_t send_cycle);
+
+void stat_update_tx_probe(struct stat_shard *shard, uint16_t cls,
+				uint16_t sender, uint32_t idx, uint64_t bytes,
+				uint64_t cycle);
 
 void stat_set_output(const char *prefix);
 
@@ -0,0 +1,319 @@
+#include "util.h"
+#include "control.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <rte_malloc.h>
+
+#define TRACE_LINE_MAX 256
+#define TRACE_LOADER_POLL_USEC 50
+
+static bool __parse_proto(const char *str, uint8_t *proto)
+{
+	int val = 0;
+
+	if (strcasecmp(str, "tcp") == 0) {
+		*proto = IPPROTO_TCP;
+	} else if (strcasecmp(str, "udp") == 0) {
+		*proto = IPPROTO_UDP;
+	} else if (str_to_int(str, 0, &val) && val >= 0 && val <= 0xff) {
+		*proto = val;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static bool __parse_line(const char *line, struct trace_rec *rec)
+{
+	char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN], proto[8];
+	unsigned int sport = 0, dport = 0, len = 0;
+	struct in_addr addr;
+
+	if (sscanf(line, "%15s %15s %u %u %7s %u",
+				src, dst, &sport, &dport, proto, &len) != 6)
+		return false;
+
+	if (sport > 0xffff || dport > 0xffff || len > 0xffff)
+		return false;
+
+	memset(rec, 0, sizeof(struct trace_rec));
+	if (inet_pton(AF_INET, src, &addr) != 1)
+		return false;
+	rec->src_ip = ntohl(addr.s_addr);
+	if (inet_pton(AF_INET, dst, &addr) != 1)
+		return false;
+	rec->dst_ip = ntohl(addr.s_addr);
+
+	if (!__parse_proto(proto, &rec->proto))
+		return false;
+
+	rec->src_port = sport;
+	rec->dst_port = dport;
+	rec->pkt_len = len;
+	return true;
+}
+
+bool trace_convert(const char *text_file, const char *bin_file)
+{
+	FILE *fin = NULL, *fout = NULL;
+	char line[TRACE_LINE_MAX];
+	struct trace_file_hdr hdr = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.nb_recs = 0,
+	};
+	struct trace_rec rec;
+	unsigned long lineno = 0;
+	char *p = NULL;
+
+	if (text_file == NULL || bin_file == NULL) {
+		LOG_ERROR("Need both text and binary trace file");
+		return false;
+	}
+
+	fin = fopen(text_file, "r");
+	if (fin == NULL) {
+		LOG_ERROR("Failed to open text trace %s", text_file);
+		return false;
+	}
+
+	fout = fopen(bin_file, "w");
+	if (fout == NULL) {
+		LOG_ERROR("Failed to open binary trace %s", bin_file);
+		goto close_fin;
+	}
+
+	/* header is rewritten with the record count at the end */
+	if (fwrite(&hdr, sizeof(hdr), 1, fout) != 1)
+		goto close_write_err;
+
+	while (fgets(line, sizeof(line), fin) != NULL) {
+		lineno++;
+		for (p = line; *p == ' ' || *p == '\t'; p++) {}
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		if (!__parse_line(p, &rec)) {
+			LOG_ERROR("Bad trace record at line %lu", lineno);
+			goto close_fout;
+		}
+
+		if (fwrite(&rec, sizeof(rec), 1, fout) != 1)
+			goto close_write_err;
+		hdr.nb_recs++;
+	}
+
+	if (fseek(fout, 0, SEEK_SET) != 0
+			|| fwrite(&hdr, sizeof(hdr), 1, fout) != 1)
+		goto close_write_err;
+
+	fclose(fin);
+	if (fclose(fout) != 0) {
+		LOG_ERROR("Failed to write binary trace %s", bin_file);
+		return false;
+	}
+
+	LOG_INFO("Converted %lu records from %s into %s",
+					(unsigned long)hdr.nb_recs, text_file, bin_file);
+	return true;
+
+close_write_err:
+	LOG_ERROR("Failed to write binary trace %s", bin_file);
+
+close_fout:
+	fclose(fout);
+
+close_fin:
+	fclose(fin);
+	return false;
+}
+
+/* Fill one window, rewinding for the next pass when needed */
+static uint32_t __load_window(struct trace_reader *reader,
+				struct trace_rec *win)
+{
+	uint32_t cnt = 0, n = 0;
+	ssize_t ret = 0;
+	off_t off = 0;
+
+	while (cnt < TRACE_WIN_RECS && !reader->eof) {
+		if (reader->next_rec >= reader->nb_recs) {
+			reader->pass++;
+			if (reader->loops != 0 && reader->pass >= reader->loops) {
+				reader->eof = true;
+				break;
+			}
+			reader->next_rec = 0;
+		}
+
+		n = TRACE_WIN_RECS - cnt;
+		if (n > reader->nb_recs - reader->next_rec)
+			n = reader->nb_recs - reader->next_rec;
+
+		off = sizeof(struct trace_file_hdr) + (reader->first_rec
+				+ reader->next_rec) * sizeof(struct trace_rec);
+		ret = pread(reader->fd, win + cnt, n * sizeof(struct trace_rec), off);
+		if (ret <= 0) {
+			LOG_ERROR("Failed to read trace at record %lu",
+							(unsigned long)reader->next_rec);
+			reader->eof = true;
+			break;
+		}
+
+		n = ret / sizeof(struct trace_rec);
+		cnt += n;
+		reader->next_rec += n;
+	}
+	return cnt;
+}
+
+static void *__loader_run(void *arg)
+{
+	struct trace_reader *reader = arg;
+	unsigned int b = 0;
+	uint32_t cnt = 0;
+
+	ctl_pin_off_lcores();
+
+	while (!__atomic_load_n(&reader->stop, __ATOMIC_RELAXED)) {
+		if (__atomic_load_n(&reader->win_ready[b], __ATOMIC_ACQUIRE)) {
+			usleep(TRACE_LOADER_POLL_USEC);
+			continue;
+		}
+
+		cnt = __load_window(reader, reader->win[b]);
+		reader->win_cnt[b] = cnt;
+		__atomic_store_n(&reader->win_ready[b], 1, __ATOMIC_RELEASE);
+
+		/* the empty window tells the reader we are done */
+		if (cnt == 0)
+			break;
+		b ^= 1;
+	}
+	return NULL;
+}
+
+static int __open_trace(const char *filename, struct trace_file_hdr *hdr)
+{
+	struct stat st;
+	int fd = -1;
+
+	if (filename == NULL) {
+		LOG_ERROR("No trace file given");
+		return -1;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		LOG_ERROR("Failed to open trace file %s", filename);
+		return -1;
+	}
+
+	if (read(fd, hdr, sizeof(*hdr)) != sizeof(*hdr)
+			|| hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION) {
+		LOG_ERROR("%s is not a binary 5-tuple trace", filename);
+		close(fd);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || hdr->nb_recs == 0 || (uint64_t)st.st_size
+			< sizeof(*hdr) + hdr->nb_recs * sizeof(struct trace_rec)) {
+		LOG_ERROR("Trace file %s is empty or truncated", filename);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool trace_get_nb_recs(const char *filename, uint64_t *nb_recs)
+{
+	struct trace_file_hdr hdr;
+	int fd = -1;
+
+	fd = __open_trace(filename, &hdr);
+	if (fd < 0)
+		return false;
+
+	*nb_recs = hdr.nb_recs;
+	close(fd);
+	return true;
+}
+
+struct trace_reader *trace_reader_open(const char *filename,
+				unsigned int loops, uint64_t first, uint64_t cnt)
+{
+	struct trace_reader *reader = NULL;
+	struct trace_file_hdr hdr;
+	int fd = -1;
+
+	fd = __open_trace(filename, &hdr);
+	if (fd < 0)
+		return NULL;
+
+	if (cnt == 0 || first + cnt > hdr.nb_recs) {
+		LOG_ERROR("Records [%lu, %lu) out of trace %s",
+						(unsigned long)first,
+						(unsigned long)(first + cnt), filename);
+		goto close_fd;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	reader = rte_zmalloc("pktgen: trace reader",
+					sizeof(struct trace_reader), 0);
+	if (reader == NULL)
+		goto close_no_mem;
+
+	reader->fd = fd;
+	reader->first_rec = first;
+	reader->nb_recs = cnt;
+	reader->loops = loops;
+	reader->win[0] = rte_malloc("pktgen: trace window",
+					sizeof(struct trace_rec) * TRACE_WIN_RECS, 0);
+	reader->win[1] = rte_malloc("pktgen: trace window",
+					sizeof(struct trace_rec) * TRACE_WIN_RECS, 0);
+	if (reader->win[0] == NULL || reader->win[1] == NULL)
+		goto close_no_mem;
+
+	if (pthread_create(&reader->tid, NULL, __loader_run, reader)) {
+		LOG_ERROR("Failed to create trace loader thread");
+		goto close_free;
+	}
+
+	LOG_INFO("Streaming records [%lu, %lu) from %s",
+					(unsigned long)first,
+					(unsigned long)(first + cnt), filename);
+	return reader;
+
+close_no_mem:
+	LOG_ERROR("Failed to allocate memory for trace reader");
+
+close_free:
+	if (reader != NULL) {
+		rte_free(reader->win[0]);
+		rte_free(reader->win[1]);
+		rte_free(reader);
+	}
+
+close_fd:
+	close(fd);
+	return NULL;
+}
+
+void trace_reader_close(struct trace_reader *reader)
+{
+	if (reader == NULL)
+		return;
+
+	__atomic_store_n(&reader->stop, true, __ATOMIC_RELAXED);
+	pthread_join(reader->tid, NULL);
+
+	close(reader->fd);
+	rte_free(reader->win[0]);
+	rte_free(reader->win[1]);
+	rte_free(reader);
+}
@@ -0,0 +1,104 @@
+#ifndef _PKTGEN_TRACE_H_
+#define _PKTGEN_TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+/*
+ * Binary 5-tuple trace: a trace_file_hdr followed by nb_recs fixed-width
+ * trace_rec, all fields in host byte order.
+ */
+#define TRACE_MAGIC 0x50545431	/* "1TTP" */
+#define TRACE_VERSION 1
+
+struct trace_file_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t nb_recs;
+};
+
+struct trace_rec {
+	uint32_t src_ip;
+	uint32_t dst_ip;
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint8_t proto;
+	uint8_t pad;
+	uint16_t pkt_len;	/* frame length without FCS */
+} __attribute__((packed));
+
+/* Records per window buffer (1MB) */
+#define TRACE_WIN_RECS (1 << 16)
+
+/*
+ * Streams a trace through two in-memory windows. A loader thread refills
+ * the window the TX lcore is not reading, so the TX lcore never waits on
+ * disk.
+ */
+struct trace_reader {
+	int fd;
+	uint64_t first_rec;	/* slice of the file this reader streams */
+	uint64_t nb_recs;
+	unsigned int loops;	/* 0 for endless */
+
+	struct trace_rec *win[2];
+	uint32_t win_cnt[2];
+	int win_ready[2];	/* set by the loader, cleared by the reader */
+
+	/* reader side */
+	unsigned int cur;
+	uint32_t pos;
+
+	/* loader side */
+	pthread_t tid;
+	bool stop;
+	uint64_t next_rec;
+	unsigned int pass;
+	bool eof;
+};
+
+/* Convert a text trace into the binary format. Each text line holds
+ * "<src ip> <dst ip> <src port> <dst port> <proto> <pkt len>", with
+ * dotted IPv4 addresses, proto as a number or tcp/udp, '#' comments. */
+bool trace_convert(const char *text_file, const char *bin_file);
+
+/* Read the number of records of a binary trace */
+bool trace_get_nb_recs(const char *filename, uint64_t *nb_recs);
+
+/* Stream records [first, first + cnt) of the trace */
+struct trace_reader *trace_reader_open(const char *filename,
+				unsigned int loops, uint64_t first, uint64_t cnt);
+
+void trace_reader_close(struct trace_reader *reader);
+
+/*
+ * Get the next record.
+ * Return 0 on success, -EAGAIN if the next window is not loaded yet and
+ * -ENOENT once all passes are done.
+ */
+static inline int trace_reader_next(struct trace_reader *reader,
+				struct trace_rec *rec)
+{
+	unsigned int cur = reader->cur;
+
+	if (!__atomic_load_n(&reader->win_ready[cur], __ATOMIC_ACQUIRE))
+		return -EAGAIN;
+
+	/* an empty window marks the end of the trace */
+	if (reader->win_cnt[cur] == 0)
+		return -ENOENT;
+
+	*rec = reader->win[cur][reader->pos++];
+
+	/* end of the window, hand it back to the loader */
+	if (reader->pos >= reader->win_cnt[cur]) {
+		reader->pos = 0;
+		reader->cur = cur ^ 1;
+		__atomic_store_n(&reader->win_ready[cur], 0, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+#endif /* _PKTGEN_TRACE_H_ */
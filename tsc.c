@@ -0,0 +1,210 @@
+#include "util.h"
+#include "tsc.h"
+
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_launch.h>
+#include <rte_memory.h>
+#ifdef RTE_ARCH_X86
+#include <cpuid.h>
+#endif
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+/* Clock reads per sample, the one with the shortest TSC bracket is kept */
+#define TSC_SAMPLE_TRIES 16
+
+/* Ping telling the measured lcore to return */
+#define TSC_PING_STOP UINT32_MAX
+
+/* Shared between the master and the lcore being measured */
+struct tsc_pingpong {
+	uint32_t ping __rte_cache_aligned;	/* round asked by the master */
+	uint32_t pong __rte_cache_aligned;	/* round answered */
+	uint64_t pong_cyc;			/* TSC of the lcore when answering */
+};
+
+static struct tsc_pingpong pingpong;
+static struct tsc_lcore lcores[RTE_MAX_LCORE];
+static uint64_t tsc_hz = 0;
+static bool tsc_invariant = false;
+static unsigned int ref_lcore = 0;
+
+static bool __invariant(void)
+{
+#ifdef RTE_ARCH_X86
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+	/* CPUID.80000007H:EDX[8] */
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0)
+		return false;
+	return (edx & (1U << 8)) != 0;
+#else
+	/* the generic timers of other architectures run at a fixed rate */
+	return true;
+#endif
+}
+
+static inline uint64_t __ts_nsec(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+/* A TSC value and the raw monotonic time taken at about the same moment */
+static void __sample(uint64_t *cyc, uint64_t *nsec)
+{
+	struct timespec ts;
+	uint64_t c0 = 0, c1 = 0, best = UINT64_MAX;
+	unsigned int i = 0;
+
+	for (i = 0; i < TSC_SAMPLE_TRIES; i++) {
+		c0 = rte_rdtsc_precise();
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		c1 = rte_rdtsc_precise();
+		if (c1 - c0 < best) {
+			best = c1 - c0;
+			*cyc = c0 + (c1 - c0) / 2;
+			*nsec = __ts_nsec(&ts);
+		}
+	}
+}
+
+static uint64_t __measure_hz(void)
+{
+	uint64_t c0 = 0, n0 = 0, c1 = 0, n1 = 0;
+
+	__sample(&c0, &n0);
+	do {
+		__sample(&c1, &n1);
+	} while (n1 - n0 < TSC_CAL_MSEC * NSEC_PER_MSEC);
+
+	return (double)(c1 - c0) * NSEC_PER_SEC / (n1 - n0) + 0.5;
+}
+
+/* Runs on the measured lcore, answers every round with its TSC */
+static int __pong(void *arg)
+{
+	struct tsc_pingpong *pp = arg;
+	uint32_t round = 0, ping = 0;
+
+	for (round = 1; ; round++) {
+		do {
+			ping = __atomic_load_n(&pp->ping, __ATOMIC_ACQUIRE);
+		} while (ping != round && ping != TSC_PING_STOP);
+		if (ping == TSC_PING_STOP)
+			break;
+
+		pp->pong_cyc = rte_rdtsc_precise();
+		__atomic_store_n(&pp->pong, round, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+/*
+ * The master stamps t1, asks, and stamps t3 when the answer t2 is seen.
+ * If both ways take as long, t2 was read at (t1 + t3) / 2 on the master,
+ * so the error is at most half the round trip; the shortest one is kept.
+ */
+static bool __measure_lcore(unsigned int lcore, struct tsc_lcore *res)
+{
+	struct tsc_pingpong *pp = &pingpong;
+	uint64_t t1 = 0, t2 = 0, t3 = 0, end = 0;
+	uint64_t timeout = tsc_hz / 1000 * TSC_SKEW_TIMEOUT_MSEC;
+	uint32_t round = 0;
+
+	memset(pp, 0, sizeof(struct tsc_pingpong));
+	res->offset = 0;
+	res->rtt = UINT64_MAX;
+
+	if (rte_eal_remote_launch(__pong, pp, lcore) != 0)
+		return false;
+
+	end = rte_rdtsc_precise() + tsc_hz / 1000 * TSC_SKEW_MAX_MSEC;
+	for (round = 1; round <= TSC_SKEW_ROUNDS && t3 < end; round++) {
+		t1 = rte_rdtsc_precise();
+		__atomic_store_n(&pp->ping, round, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&pp->pong, __ATOMIC_ACQUIRE) != round) {
+			if (rte_rdtsc() - t1 > timeout)
+				goto close_timeout;
+		}
+		t3 = rte_rdtsc_precise();
+		t2 = pp->pong_cyc;
+
+		if (t3 - t1 < res->rtt) {
+			res->rtt = t3 - t1;
+			res->offset = (int64_t)(t2 - t1) - (int64_t)(res->rtt / 2);
+		}
+	}
+	__atomic_store_n(&pp->ping, TSC_PING_STOP, __ATOMIC_RELEASE);
+
+	return rte_eal_wait_lcore(lcore) == 0;
+
+close_timeout:
+	/* waiting for the lcore could block as well, the caller gives up */
+	__atomic_store_n(&pp->ping, TSC_PING_STOP, __ATOMIC_RELEASE);
+	LOG_ERROR("lcore %u did not answer round %u within %u ms", lcore,
+					round, TSC_SKEW_TIMEOUT_MSEC);
+	return false;
+}
+
+bool tsc_calibrate(void)
+{
+	uint64_t nominal = rte_get_tsc_hz();
+	unsigned int lcore = 0;
+
+	memset(lcores, 0, sizeof(lcores));
+	ref_lcore = rte_get_master_lcore();
+
+	tsc_invariant = __invariant();
+	if (!tsc_invariant)
+		LOG_ERROR("TSC is not invariant, latencies are wrong if cores "
+						"change frequency or sleep");
+
+	tsc_hz = __measure_hz();
+	LOG_INFO("TSC %lu Hz against CLOCK_MONOTONIC_RAW, %lu Hz nominal "
+					"(%+.1f ppm)", (unsigned long)tsc_hz,
+					(unsigned long)nominal,
+					((double)tsc_hz - nominal) * 1e6 / nominal);
+
+	RTE_LCORE_FOREACH_SLAVE(lcore) {
+		/* a stuck lcore may still answer pings, stop using the pingpong */
+		if (!__measure_lcore(lcore, &lcores[lcore])) {
+			LOG_ERROR("Failed to measure the TSC offset of lcore %u", lcore);
+			memset(&lcores[lcore], 0, sizeof(struct tsc_lcore));
+			return false;
+		}
+
+		LOG_INFO("lcore %u TSC offset to lcore %u: %ld cycles (%.1f ns), "
+						"+/- %lu cycles", lcore, ref_lcore,
+						(long)lcores[lcore].offset,
+						(double)lcores[lcore].offset * 1e9 / tsc_hz,
+						(unsigned long)lcores[lcore].rtt / 2);
+	}
+	return true;
+}
+
+uint64_t tsc_get_hz(void)
+{
+	return (tsc_hz > 0) ? tsc_hz : rte_get_tsc_hz();
+}
+
+bool tsc_is_invariant(void)
+{
+	return tsc_invariant;
+}
+
+unsigned int tsc_ref_lcore(void)
+{
+	return ref_lcore;
+}
+
+int64_t tsc_get_offset(unsigned int lcore)
+{
+	return (lcore < RTE_MAX_LCORE) ? lcores[lcore].offset : 0;
+}
+
+const struct tsc_lcore *tsc_get_lcore(unsigned int lcore)
+{
+	return (lcore < RTE_MAX_LCORE) ? &lcores[lcore] : NULL;
+}
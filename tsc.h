@@ -0,0 +1,41 @@
+#ifndef _PKTGEN_TSC_H_
+#define _PKTGEN_TSC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * TSC calibration, run from the master lcore before the workers start.
+ * The frequency is measured against CLOCK_MONOTONIC_RAW, and the offset
+ * of every other lcore's TSC to the master's by ping-pong over shared
+ * cache lines, keeping the round trip with the smallest time. Lcores
+ * subtract their offset from the cycles they stamp, so TX and RX cycles
+ * taken on different lcores are on the master's timebase.
+ */
+#define TSC_CAL_MSEC 200
+#define TSC_SKEW_ROUNDS 1000
+#define TSC_SKEW_MAX_MSEC 100	/* per lcore, for lcores sharing a core */
+#define TSC_SKEW_TIMEOUT_MSEC 1000	/* an lcore this late to answer is stuck */
+
+struct tsc_lcore {
+	int64_t offset;		/* its TSC minus the master's */
+	uint64_t rtt;		/* round trip of the kept sample, bounds the error */
+};
+
+/* return value: false if an lcore could not be measured */
+bool tsc_calibrate(void);
+
+/* rte_get_tsc_hz() until tsc_calibrate is done */
+uint64_t tsc_get_hz(void);
+
+bool tsc_is_invariant(void);
+
+/* Lcore all cycles are converted to */
+unsigned int tsc_ref_lcore(void);
+
+/* Zero for the master lcore, non-EAL threads and before calibration */
+int64_t tsc_get_offset(unsigned int lcore);
+
+const struct tsc_lcore *tsc_get_lcore(unsigned int lcore);
+
+#endif /* _PKTGEN_TSC_H_ */
@@ -17,6 +17,7 @@
 #include <limits.h>
 #include <sys/syscall.h>
 #include <sys/resource.h>
+#include <arpa/inet.h>
 
 //#define DEBUG_PRINT
 
@@ -93,4 +94,15 @@ static inline bool str_to_int(
 	return true;
 }
 
+/* Dotted IPv4 address, in host order */
+static inline bool str_to_ipv4(const char *s, uint32_t *ip)
+{
+	struct in_addr addr;
+
+	if (inet_pton(AF_INET, s, &addr) != 1)
+		return false;
+	*ip = ntohl(addr.s_addr);
+	return true;
+}
+
 #endif /* _PKTGEN_UTIL_H_ */